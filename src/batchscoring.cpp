@@ -0,0 +1,145 @@
+#include <atomic>
+#include <algorithm>
+#include <iomanip>
+#include "dataio.hpp"
+#include "batchscoring.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// BatchTreeScorer
+
+BatchTreeScorer::BatchTreeScorer(NucleotideSequences& data, unsigned int num_threads)
+    : data_(data),
+      thread_pool_(num_threads),
+      num_trees_per_instance_(1) {
+}
+
+std::vector<double> BatchTreeScorer::calc_ln_probabilities(const std::vector<GeneTree *>& trees) {
+    std::vector<double> ln_probabilities(trees.size(), 0.0);
+    this->score_batch(trees, ln_probabilities, nullptr);
+    return ln_probabilities;
+}
+
+std::vector<std::vector<double>> BatchTreeScorer::calc_site_ln_probabilities(const std::vector<GeneTree *>& trees) {
+    std::vector<double> ln_probabilities(trees.size(), 0.0);
+    std::vector<std::vector<double>> site_ln_probabilities(trees.size());
+    this->score_batch(trees, ln_probabilities, &site_ln_probabilities);
+    return site_ln_probabilities;
+}
+
+void BatchTreeScorer::score_batch(const std::vector<GeneTree *>& trees,
+        std::vector<double>& ln_probabilities,
+        std::vector<std::vector<double>> * site_ln_probabilities) {
+    if (trees.empty()) {
+        return;
+    }
+    // workers only read the data from here on
+    if (this->data_.get_site_patterns().get_num_sites() == 0) {
+        this->data_.compress_patterns();
+    }
+    if (this->num_trees_per_instance_ > 1) {
+        // blocks of trees are handed out one at a time, as above
+        unsigned long block_size = this->num_trees_per_instance_;
+        unsigned long num_blocks = (trees.size() + block_size - 1) / block_size;
+        std::atomic<unsigned long> next_block_idx(0);
+        unsigned long num_workers = std::min(static_cast<unsigned long>(this->get_num_threads()), num_blocks);
+        for (unsigned long worker_idx = 0; worker_idx < num_workers; ++worker_idx) {
+            this->thread_pool_.submit([this, &trees, &ln_probabilities, site_ln_probabilities, &next_block_idx, block_size, num_blocks] {
+                for (unsigned long block_idx = next_block_idx++; block_idx < num_blocks; block_idx = next_block_idx++) {
+                    this->score_tree_block(trees,
+                            block_idx * block_size,
+                            std::min((block_idx + 1) * block_size, static_cast<unsigned long>(trees.size())),
+                            ln_probabilities,
+                            site_ln_probabilities);
+                }
+            });
+        }
+        this->thread_pool_.wait();
+        return;
+    }
+    // trees are handed out one at a time rather than in fixed blocks, as
+    // their cost varies with their size and shape
+    std::atomic<unsigned long> next_tree_idx(0);
+    unsigned long num_workers = std::min(static_cast<unsigned long>(this->get_num_threads()), trees.size());
+    for (unsigned long worker_idx = 0; worker_idx < num_workers; ++worker_idx) {
+        this->thread_pool_.submit([this, &trees, &ln_probabilities, site_ln_probabilities, &next_tree_idx] {
+            for (unsigned long tree_idx = next_tree_idx++; tree_idx < trees.size(); tree_idx = next_tree_idx++) {
+                this->score_tree(trees[tree_idx],
+                        ln_probabilities[tree_idx],
+                        site_ln_probabilities ? &(*site_ln_probabilities)[tree_idx] : nullptr);
+            }
+        });
+    }
+    this->thread_pool_.wait();
+}
+
+unsigned long BatchTreeScorer::score_trees(std::istream& tree_src,
+        std::ostream& out,
+        const std::string& tree_format) {
+    std::vector<GeneTree *> trees;
+    treeio::read_from_stream(trees, tree_src, tree_format);
+    std::vector<double> ln_probabilities = this->calc_ln_probabilities(trees);
+    for (auto ln_probability : ln_probabilities) {
+        out << std::setprecision(12) << ln_probability << "\n";
+    }
+    out.flush();
+    for (auto & tree : trees) {
+        delete tree;
+    }
+    return ln_probabilities.size();
+}
+
+void BatchTreeScorer::score_tree(GeneTree * tree, double& ln_probability, std::vector<double> * site_ln_probabilities) {
+    tree->set_beagle_settings(this->beagle_settings_);
+    tree->set_site_rate_model(this->site_rate_model_);
+    tree->set_substitution_model(this->substitution_model_);
+    tree->create_beagle_instance(this->data_.get_num_patterns(), this->data_.get_num_compact_sequences());
+    this->data_.set_tip_data(tree);
+    tree->set_store_site_ln_probabilities(site_ln_probabilities != nullptr);
+    ln_probability = tree->calc_ln_probability();
+    if (site_ln_probabilities) {
+        *site_ln_probabilities = tree->calc_site_ln_probabilities();
+    }
+    // the instance keeps the tip data for this worker's next tree
+    tree->free_beagle_instance();
+}
+
+void BatchTreeScorer::score_tree_block(const std::vector<GeneTree *>& trees,
+        unsigned long begin_idx,
+        unsigned long end_idx,
+        std::vector<double>& ln_probabilities,
+        std::vector<std::vector<double>> * site_ln_probabilities) {
+    std::vector<GeneTree *> block(trees.begin() + begin_idx, trees.begin() + end_idx);
+    for (auto & tree : block) {
+        tree->set_beagle_settings(this->beagle_settings_);
+        tree->set_site_rate_model(this->site_rate_model_);
+        tree->set_substitution_model(this->substitution_model_);
+        tree->set_store_site_ln_probabilities(site_ln_probabilities != nullptr);
+    }
+    // the instance always has room for a full block, so that the last
+    // (partial) block reuses the same pooled instances
+    GeneTree * first_tree = block[0];
+    first_tree->create_beagle_instance(this->data_.get_num_patterns(),
+            this->data_.get_num_compact_sequences(),
+            this->num_trees_per_instance_);
+    this->data_.set_tip_data(first_tree);
+    for (unsigned long block_tree_idx = 1; block_tree_idx < block.size(); ++block_tree_idx) {
+        block[block_tree_idx]->join_beagle_instance(first_tree, block_tree_idx);
+        this->data_.set_tip_data(block[block_tree_idx]);
+    }
+    std::vector<double> block_ln_probabilities;
+    GeneTree::calc_ln_probabilities(block, block_ln_probabilities);
+    for (unsigned long block_tree_idx = 0; block_tree_idx < block.size(); ++block_tree_idx) {
+        ln_probabilities[begin_idx + block_tree_idx] = block_ln_probabilities[block_tree_idx];
+        if (site_ln_probabilities) {
+            (*site_ln_probabilities)[begin_idx + block_tree_idx] = block[block_tree_idx]->calc_site_ln_probabilities();
+        }
+    }
+    // the first tree holds the instance for the others
+    for (auto tree_iter = block.rbegin(); tree_iter != block.rend(); ++tree_iter) {
+        (*tree_iter)->free_beagle_instance();
+    }
+}
+
+} // namespace treeshrew
@@ -0,0 +1,90 @@
+#ifndef TREESHREW_BATCHSCORING_HPP
+#define TREESHREW_BATCHSCORING_HPP
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "character.hpp"
+#include "genetree.hpp"
+#include "model.hpp"
+#include "threadpool.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// BatchTreeScorer
+
+// Scores many trees against a single alignment, spreading the trees over a
+// pool of worker threads. Each worker scores its trees one at a time on a
+// pooled BEAGLE instance (see ``BeagleInstancePool``), so that instances
+// are only created (and tip data only loaded) once per worker. With more
+// than one tree per instance, each worker instead takes blocks of that many
+// trees, and scores each block in a single batched instance (see
+// ``GeneTree::calc_ln_probabilities()``), which saves calls into BEAGLE for
+// small trees and gives each call more work to spread over its threads.
+class BatchTreeScorer {
+
+    public:
+        // ``num_threads`` of 0 uses one thread per hardware thread.
+        BatchTreeScorer(NucleotideSequences& data, unsigned int num_threads=0);
+        inline void set_beagle_settings(const BeagleSettings& settings) {
+            this->beagle_settings_ = settings;
+        }
+        inline void set_site_rate_model(const SiteRateModel& site_rate_model) {
+            this->site_rate_model_ = site_rate_model;
+        }
+        inline void set_substitution_model(const SubstitutionModel& substitution_model) {
+            this->substitution_model_ = substitution_model;
+        }
+        inline unsigned int get_num_threads() const {
+            return this->thread_pool_.get_num_threads();
+        }
+        inline void set_num_trees_per_instance(unsigned int num_trees) {
+            this->num_trees_per_instance_ = std::max(num_trees, 1u);
+        }
+        inline unsigned int get_num_trees_per_instance() const {
+            return this->num_trees_per_instance_;
+        }
+        // Log-likelihoods of ``trees``, in the same order. The settings and
+        // models of this scorer are applied to each tree, and no tree
+        // holds a BEAGLE instance on return.
+        std::vector<double> calc_ln_probabilities(const std::vector<GeneTree *>& trees);
+        // Per-pattern log-likelihoods of ``trees`` (see
+        // ``GeneTree::calc_site_ln_probabilities()``), in the same order,
+        // e.g. for ``RellBootstrap``.
+        std::vector<std::vector<double>> calc_site_ln_probabilities(const std::vector<GeneTree *>& trees);
+        // Reads all trees from ``tree_src`` and scores them, writing one
+        // log-likelihood per line to ``out`` in the order read.
+        unsigned long score_trees(std::istream& tree_src,
+                std::ostream& out,
+                const std::string& tree_format="nexus");
+
+    private:
+        // Scores each tree on the pool; ``site_ln_probabilities`` may be
+        // null.
+        void score_batch(const std::vector<GeneTree *>& trees,
+                std::vector<double>& ln_probabilities,
+                std::vector<std::vector<double>> * site_ln_probabilities);
+        void score_tree(GeneTree * tree, double& ln_probability, std::vector<double> * site_ln_probabilities);
+        // Scores ``trees[begin_idx]`` up to (but excluding)
+        // ``trees[end_idx]`` in a single batched instance.
+        void score_tree_block(const std::vector<GeneTree *>& trees,
+                unsigned long begin_idx,
+                unsigned long end_idx,
+                std::vector<double>& ln_probabilities,
+                std::vector<std::vector<double>> * site_ln_probabilities);
+
+    private:
+        NucleotideSequences&    data_;
+        ThreadPool              thread_pool_;
+        BeagleSettings          beagle_settings_;
+        SiteRateModel           site_rate_model_;
+        SubstitutionModel       substitution_model_;
+        unsigned int            num_trees_per_instance_;
+
+}; // BatchTreeScorer
+
+} // namespace treeshrew
+
+#endif
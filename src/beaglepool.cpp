@@ -0,0 +1,182 @@
+#include <tuple>
+#include "utility.hpp"
+#include "beaglepool.hpp"
+#include "nativeengine.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// BeagleInstanceSpec
+
+bool BeagleInstanceSpec::operator<(const BeagleInstanceSpec& other) const {
+    return std::tie(this->num_tips,
+                this->num_partials_buffers,
+                this->num_compact_buffers,
+                this->num_states,
+                this->num_patterns,
+                this->num_eigen_buffers,
+                this->num_matrix_buffers,
+                this->num_categories,
+                this->num_scaling_buffers,
+                this->resources,
+                this->preference_flags,
+                this->requirement_flags,
+                this->native_engine,
+                this->num_threads)
+        < std::tie(other.num_tips,
+                other.num_partials_buffers,
+                other.num_compact_buffers,
+                other.num_states,
+                other.num_patterns,
+                other.num_eigen_buffers,
+                other.num_matrix_buffers,
+                other.num_categories,
+                other.num_scaling_buffers,
+                other.resources,
+                other.preference_flags,
+                other.requirement_flags,
+                other.native_engine,
+                other.num_threads);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// BeagleInstancePool
+
+BeagleInstancePool& BeagleInstancePool::get_pool() {
+    static BeagleInstancePool pool;
+    return pool;
+}
+
+BeagleInstancePool::BeagleInstancePool()
+    : num_instances_created_(0),
+      num_check_outs_(0) {
+}
+
+BeagleInstancePool::~BeagleInstancePool() {
+    this->clear();
+}
+
+PooledBeagleInstance * BeagleInstancePool::check_out(const BeagleInstanceSpec& spec) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        ++this->num_check_outs_;
+        auto idle = this->idle_instances_.find(spec);
+        if (idle != this->idle_instances_.end() && !idle->second.empty()) {
+            PooledBeagleInstance * pooled_instance = idle->second.back();
+            idle->second.pop_back();
+            return pooled_instance;
+        }
+    }
+    PooledBeagleInstance * pooled_instance = new PooledBeagleInstance();
+    pooled_instance->spec = spec;
+    pooled_instance->has_fixed_buffers = false;
+    pooled_instance->tip_data_id = 0;
+    if (spec.native_engine) {
+        pooled_instance->engine = BeagleInstancePool::create_native_engine(spec, pooled_instance->details);
+        pooled_instance->instance = pooled_instance->engine ? 0 : BEAGLE_ERROR_NO_IMPLEMENTATION;
+    } else {
+        pooled_instance->instance = beagleCreateInstance(
+            spec.num_tips,
+            spec.num_partials_buffers,
+            spec.num_compact_buffers,
+            spec.num_states,
+            spec.num_patterns,
+            spec.num_eigen_buffers,
+            spec.num_matrix_buffers,
+            spec.num_categories,
+            spec.num_scaling_buffers,
+            spec.resources.empty() ? NULL : const_cast<int *>(spec.resources.data()),
+            spec.resources.size(),
+            spec.preference_flags,
+            spec.requirement_flags,
+            &pooled_instance->details
+            );
+        if (pooled_instance->instance >= 0) {
+            pooled_instance->engine = new BeagleLikelihoodEngine(pooled_instance->instance);
+        }
+    }
+    if (pooled_instance->instance < 0) {
+        delete pooled_instance;
+        return nullptr;
+    }
+    pooled_instance->tip_state_masks.resize(spec.num_tips);
+    pooled_instance->compact_tip_buffers.assign(spec.num_tips, false);
+    pooled_instance->num_compact_tip_buffers = 0;
+    pooled_instance->pattern_weights.assign(spec.num_patterns, 1.0);
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    ++this->num_instances_created_;
+    return pooled_instance;
+}
+
+void BeagleInstancePool::check_in(PooledBeagleInstance * pooled_instance) {
+    TREESHREW_ASSERT(pooled_instance);
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->idle_instances_[pooled_instance->spec].push_back(pooled_instance);
+}
+
+void BeagleInstancePool::clear() {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    for (auto & idle : this->idle_instances_) {
+        for (auto & pooled_instance : idle.second) {
+            delete pooled_instance->engine;
+            delete pooled_instance;
+        }
+    }
+    this->idle_instances_.clear();
+}
+
+LikelihoodEngine * BeagleInstancePool::create_native_engine(const BeagleInstanceSpec& spec, BeagleInstanceDetails& details) {
+    long supported_flags = BEAGLE_FLAG_PROCESSOR_CPU
+        | BEAGLE_FLAG_PRECISION_DOUBLE
+        | BEAGLE_FLAG_PRECISION_SINGLE
+        | BEAGLE_FLAG_THREADING_NONE
+        | BEAGLE_FLAG_THREADING_OPENMP
+        | BEAGLE_FLAG_COMPUTATION_SYNCH
+        | BEAGLE_FLAG_EIGEN_REAL
+        | (NativeLikelihoodEngine<double>::is_vectorized() ? BEAGLE_FLAG_VECTOR_SSE : BEAGLE_FLAG_VECTOR_NONE);
+    if (spec.num_states != NativeLikelihoodEngine<double>::NUM_STATES
+            || spec.num_scaling_buffers > 0
+            || (spec.requirement_flags & ~supported_flags) != 0
+            || ((spec.requirement_flags & BEAGLE_FLAG_PRECISION_SINGLE) && (spec.requirement_flags & BEAGLE_FLAG_PRECISION_DOUBLE))) {
+        return nullptr;
+    }
+    // single precision is opt-in: it must be asked for, and double
+    // precision must not also be preferred
+    bool single_precision = (spec.requirement_flags & BEAGLE_FLAG_PRECISION_SINGLE)
+        || ((spec.preference_flags & BEAGLE_FLAG_PRECISION_SINGLE)
+                && !((spec.preference_flags | spec.requirement_flags) & BEAGLE_FLAG_PRECISION_DOUBLE));
+    // threading (across subtrees, on the engine's own threads rather than
+    // OpenMP) is opt-in too
+    bool threaded = ((spec.preference_flags | spec.requirement_flags) & BEAGLE_FLAG_THREADING_OPENMP)
+        && !(spec.requirement_flags & BEAGLE_FLAG_THREADING_NONE);
+    unsigned int num_threads = 1;
+    if (threaded) {
+        num_threads = spec.num_threads > 0 ? spec.num_threads : ThreadPool::get_default_num_threads();
+    }
+    static std::string impl_name = std::string("treeshrew-native-4state-") + NativeLikelihoodEngine<double>::get_kernel_name();
+    details.resourceNumber = 0;
+    details.resourceName = const_cast<char *>("CPU");
+    details.implName = const_cast<char *>(impl_name.c_str());
+    details.implDescription = const_cast<char *>("Built-in 4-state pruning engine");
+    details.flags = supported_flags
+        & ~(single_precision ? BEAGLE_FLAG_PRECISION_DOUBLE : BEAGLE_FLAG_PRECISION_SINGLE)
+        & ~(num_threads > 1 ? BEAGLE_FLAG_THREADING_NONE : BEAGLE_FLAG_THREADING_OPENMP);
+    if (single_precision) {
+        return new NativeLikelihoodEngine<float>(spec.num_tips,
+                spec.num_partials_buffers + spec.num_compact_buffers,
+                spec.num_patterns,
+                spec.num_eigen_buffers,
+                spec.num_matrix_buffers,
+                spec.num_categories,
+                num_threads);
+    }
+    return new NativeLikelihoodEngine<double>(spec.num_tips,
+            spec.num_partials_buffers + spec.num_compact_buffers,
+            spec.num_patterns,
+            spec.num_eigen_buffers,
+            spec.num_matrix_buffers,
+            spec.num_categories,
+            num_threads);
+}
+
+} // namespace treeshrew
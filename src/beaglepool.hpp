@@ -0,0 +1,116 @@
+#ifndef TREESHREW_BEAGLEPOOL_HPP
+#define TREESHREW_BEAGLEPOOL_HPP
+
+#include <vector>
+#include <map>
+#include <string>
+#include <mutex>
+#include <libhmsbeagle/beagle.h>
+#include "likelihoodengine.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// BeagleInstanceSpec
+
+// Arguments to ``beagleCreateInstance()``: instances with equal
+// specifications are interchangeable. If ``native_engine`` is set, the
+// instance is a ``NativeLikelihoodEngine`` rather than a BEAGLE instance;
+// ``num_threads`` (0 for one per hardware thread) is the number of threads
+// it uses if threading is requested.
+struct BeagleInstanceSpec {
+    int                 num_tips;
+    int                 num_partials_buffers;
+    int                 num_compact_buffers;
+    int                 num_states;
+    int                 num_patterns;
+    int                 num_eigen_buffers;
+    int                 num_matrix_buffers;
+    int                 num_categories;
+    int                 num_scaling_buffers;
+    std::vector<int>    resources;
+    long                preference_flags;
+    long                requirement_flags;
+    bool                native_engine;
+    unsigned int        num_threads;
+    bool operator<(const BeagleInstanceSpec& other) const;
+}; // BeagleInstanceSpec
+
+////////////////////////////////////////////////////////////////////////////////
+// PooledBeagleInstance
+
+// A BEAGLE instance, along with the data that trees checking it out can
+// share: the tip data (looked up by taxon label) and the pattern weights.
+struct PooledBeagleInstance {
+    // BEAGLE instance handle (0 for the native engine)
+    int                                         instance;
+    // Calculations on the instance go through the engine, which owns it
+    LikelihoodEngine *                          engine;
+    BeagleInstanceSpec                          spec;
+    BeagleInstanceDetails                       details;
+    // Set once buffers that do not depend on the tree or model (e.g. an
+    // identity matrix) have been loaded.
+    bool                                        has_fixed_buffers;
+    // Identifies the data set whose tip data and pattern weights are
+    // loaded (0 if none has been declared, or if any tip data has been
+    // changed since); see ``SitePatterns::get_id()``.
+    unsigned long                               tip_data_id;
+    std::map<std::string, int>                  tip_buffer_indices;
+    // States compatible with each tip buffer at each pattern (bit mask)
+    std::vector<std::vector<unsigned char>>     tip_state_masks;
+    // Tip buffers holding compact states (rather than partials), of
+    // which there can be at most ``spec.num_compact_buffers``
+    std::vector<bool>                           compact_tip_buffers;
+    int                                         num_compact_tip_buffers;
+    std::vector<double>                         pattern_weights;
+}; // PooledBeagleInstance
+
+////////////////////////////////////////////////////////////////////////////////
+// BeagleInstancePool
+
+// Process-wide pool of BEAGLE instances. Instances are created on demand
+// when none with the requested specification is idle, and are only
+// finalized by ``clear()`` or at exit. Safe to use from multiple threads.
+class BeagleInstancePool {
+
+    public:
+        static BeagleInstancePool& get_pool();
+
+    public:
+        ~BeagleInstancePool();
+        // Returns nullptr if BEAGLE (or the native engine) cannot create an
+        // instance with the requested specification.
+        PooledBeagleInstance * check_out(const BeagleInstanceSpec& spec);
+        void check_in(PooledBeagleInstance * pooled_instance);
+        // Finalizes all idle instances.
+        void clear();
+        inline unsigned long get_num_instances_created() const {
+            return this->num_instances_created_;
+        }
+        inline unsigned long get_num_check_outs() const {
+            return this->num_check_outs_;
+        }
+
+    private:
+        BeagleInstancePool();
+        // nullptr if the specification needs anything the native engine
+        // does not support (scaling, other state counts, or required flags
+        // beyond single or double precision on the CPU). Single precision
+        // partials are used only if single precision is required, or
+        // preferred without double precision; multiple threads only if
+        // threading is required or preferred.
+        static LikelihoodEngine * create_native_engine(const BeagleInstanceSpec& spec, BeagleInstanceDetails& details);
+        BeagleInstancePool(const BeagleInstancePool&) = delete;
+        BeagleInstancePool& operator=(const BeagleInstancePool&) = delete;
+
+    private:
+        std::mutex                                                          mutex_;
+        std::map<BeagleInstanceSpec, std::vector<PooledBeagleInstance *>>   idle_instances_;
+        unsigned long                                                       num_instances_created_;
+        unsigned long                                                       num_check_outs_;
+
+}; // BeagleInstancePool
+
+} // namespace treeshrew
+
+#endif
@@ -1,7 +1,13 @@
+#include <atomic>
 #include <algorithm>
 #include <iterator>
 #include "character.hpp"
 
+#if defined(__AVX2__)
+#   define TREESHREW_PACKED_AVX2 1
+#   include <immintrin.h>
+#endif
+
 namespace treeshrew {
 
 //////////////////////////////////////////////////////////////////////////////
@@ -30,6 +36,149 @@ unsigned long sliding_hamming_distance(const CharacterStateVectorType& short_rea
 }
 
 
+//////////////////////////////////////////////////////////////////////////////
+// PackedSequence
+
+// Zero words after the last word of the sequence, enough for the widest
+// unaligned window load
+static const unsigned long PACKED_PADDING_WORDS = 5;
+
+// The 64 bits starting ``shift`` bits into ``words[word_idx]``
+static inline uint64_t packed_window(const std::vector<uint64_t>& words, unsigned long word_idx, unsigned long shift) {
+    if (shift == 0) {
+        return words[word_idx];
+    }
+    return (words[word_idx] >> shift) | (words[word_idx + 1] << (64 - shift));
+}
+
+#if defined(TREESHREW_PACKED_AVX2)
+
+// Set bits in each 64-bit lane
+static inline __m256i packed_popcount(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    __m256i counts = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_nibbles)),
+            _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles)));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+#endif
+
+PackedSequence::PackedSequence()
+    : size_(0) {
+}
+
+PackedSequence::PackedSequence(const CharacterStateType * states, unsigned long size) {
+    this->assign(states, size);
+}
+
+void PackedSequence::assign(const CharacterStateType * states, unsigned long size) {
+    this->size_ = size;
+    unsigned long num_words = (size + BASES_PER_WORD - 1) / BASES_PER_WORD + PACKED_PADDING_WORDS;
+    this->codes_.assign(num_words, 0);
+    this->ambiguities_.assign(num_words, 0);
+    this->valid_.assign(num_words, 0);
+    this->ambiguous_states_.clear();
+    bool has_ambiguities = false;
+    for (unsigned long idx = 0; idx < size; ++idx) {
+        unsigned long word_idx = idx / BASES_PER_WORD;
+        unsigned long bit_idx = 2 * (idx % BASES_PER_WORD);
+        this->valid_[word_idx] |= uint64_t(1) << bit_idx;
+        if (states[idx] >= 0 && states[idx] < 4) {
+            this->codes_[word_idx] |= uint64_t(states[idx]) << bit_idx;
+        } else {
+            this->ambiguities_[word_idx] |= uint64_t(1) << bit_idx;
+            has_ambiguities = true;
+        }
+    }
+    if (has_ambiguities) {
+        this->ambiguous_states_.assign(states, states + size);
+    }
+}
+
+unsigned long PackedSequence::count_mismatches(const PackedSequence& read, unsigned long offset) const {
+    TREESHREW_NDEBUG_ASSERT(offset + read.size_ <= this->size_);
+    unsigned long num_read_words = (read.size_ + BASES_PER_WORD - 1) / BASES_PER_WORD;
+    // every word of the window starts at the same bit of a sequence word
+    unsigned long first_word_idx = offset / BASES_PER_WORD;
+    unsigned long shift = 2 * (offset % BASES_PER_WORD);
+    unsigned long num_mismatches = 0;
+    unsigned long read_word_idx = 0;
+#if defined(TREESHREW_PACKED_AVX2)
+    // four words at a time (a shift of 64 clears a lane, as needed for
+    // aligned windows)
+    const __m128i right_shift = _mm_cvtsi32_si128(shift);
+    const __m128i left_shift = _mm_cvtsi32_si128(64 - shift);
+    __m256i counts = _mm256_setzero_si256();
+    for (; read_word_idx + 4 <= num_read_words; read_word_idx += 4) {
+        const uint64_t * codes = this->codes_.data() + first_word_idx + read_word_idx;
+        const uint64_t * ambiguities = this->ambiguities_.data() + first_word_idx + read_word_idx;
+        __m256i code = _mm256_or_si256(
+                _mm256_srl_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(codes)), right_shift),
+                _mm256_sll_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(codes + 1)), left_shift));
+        __m256i ambiguity = _mm256_or_si256(
+                _mm256_srl_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(ambiguities)), right_shift),
+                _mm256_sll_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(ambiguities + 1)), left_shift));
+        __m256i valid = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(read.valid_.data() + read_word_idx));
+        __m256i diff = _mm256_xor_si256(code,
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(read.codes_.data() + read_word_idx)));
+        __m256i mismatches = _mm256_and_si256(_mm256_or_si256(diff, _mm256_srli_epi64(diff, 1)), valid);
+        ambiguity = _mm256_and_si256(_mm256_or_si256(ambiguity,
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(read.ambiguities_.data() + read_word_idx))),
+                valid);
+        counts = _mm256_add_epi64(counts, packed_popcount(_mm256_andnot_si256(ambiguity, mismatches)));
+        if (!_mm256_testz_si256(ambiguity, ambiguity)) {
+            alignas(32) uint64_t ambiguous_bits[4];
+            _mm256_store_si256(reinterpret_cast<__m256i *>(ambiguous_bits), ambiguity);
+            for (unsigned long lane = 0; lane < 4; ++lane) {
+                if (ambiguous_bits[lane]) {
+                    num_mismatches += this->count_ambiguous_mismatches(read, offset, read_word_idx + lane, ambiguous_bits[lane]);
+                }
+            }
+        }
+    }
+    alignas(32) uint64_t lane_counts[4];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lane_counts), counts);
+    num_mismatches += lane_counts[0] + lane_counts[1] + lane_counts[2] + lane_counts[3];
+#endif
+    for (; read_word_idx < num_read_words; ++read_word_idx) {
+        uint64_t diff = packed_window(this->codes_, first_word_idx + read_word_idx, shift) ^ read.codes_[read_word_idx];
+        uint64_t mismatches = (diff | (diff >> 1)) & read.valid_[read_word_idx];
+        uint64_t ambiguity = (packed_window(this->ambiguities_, first_word_idx + read_word_idx, shift)
+                | read.ambiguities_[read_word_idx]) & read.valid_[read_word_idx];
+        num_mismatches += __builtin_popcountll(mismatches & ~ambiguity);
+        if (ambiguity) {
+            num_mismatches += this->count_ambiguous_mismatches(read, offset, read_word_idx, ambiguity);
+        }
+    }
+    return num_mismatches;
+}
+
+unsigned long PackedSequence::count_ambiguous_mismatches(const PackedSequence& read,
+        unsigned long offset,
+        unsigned long word_idx,
+        uint64_t ambiguous_bits) const {
+    unsigned long num_mismatches = 0;
+    while (ambiguous_bits) {
+        unsigned long read_idx = word_idx * BASES_PER_WORD + __builtin_ctzll(ambiguous_bits) / 2;
+        if (read.get_state(read_idx) != this->get_state(offset + read_idx)) {
+            ++num_mismatches;
+        }
+        ambiguous_bits &= ambiguous_bits - 1;
+    }
+    return num_mismatches;
+}
+
+const char * PackedSequence::get_kernel_name() {
+#if defined(TREESHREW_PACKED_AVX2)
+    return "AVX2";
+#else
+    return "scalar";
+#endif
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // NucleotideSequence
 
@@ -154,6 +303,93 @@ static std::vector<NucleotideSequence> read_fasta(std::istream& src) {
     return seqs;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// SitePatterns
+
+SitePatterns::SitePatterns()
+    : id_(0),
+      num_sites_(0),
+      num_compact_rows_(0) {
+}
+
+SitePatterns::~SitePatterns() {
+}
+
+void SitePatterns::clear() {
+    this->id_ = 0;
+    this->num_sites_ = 0;
+    this->pattern_counts_.clear();
+    this->pattern_weights_.clear();
+    this->site_patterns_.clear();
+    this->pattern_states_.clear();
+    this->pattern_partials_.clear();
+    this->compact_rows_.clear();
+    this->num_compact_rows_ = 0;
+    this->sequence_rows_.clear();
+}
+
+void SitePatterns::compress(const std::vector<const NucleotideSequence *>& sequences,
+        unsigned long num_sites) {
+    static std::atomic<unsigned long> next_id(1);
+    this->clear();
+    this->id_ = next_id++;
+    this->num_sites_ = num_sites;
+    unsigned long num_rows = sequences.size();
+    for (unsigned long row = 0; row < num_rows; ++row) {
+        TREESHREW_NDEBUG_ASSERT(sequences[row]->size() >= num_sites);
+        this->sequence_rows_[sequences[row]] = row;
+    }
+
+    // identical columns hash to the same key (states fit in a char)
+    std::unordered_map<std::string, unsigned long> column_patterns;
+    column_patterns.reserve(num_sites);
+    std::vector<unsigned long> pattern_sites;
+    std::string column(num_rows, 0);
+    this->site_patterns_.reserve(num_sites);
+    for (unsigned long site = 0; site < num_sites; ++site) {
+        for (unsigned long row = 0; row < num_rows; ++row) {
+            column[row] = static_cast<char>(*(sequences[row]->cbegin() + site));
+        }
+        auto pattern = column_patterns.find(column);
+        if (pattern == column_patterns.end()) {
+            unsigned long pattern_index = this->pattern_counts_.size();
+            column_patterns.emplace(column, pattern_index);
+            this->pattern_counts_.push_back(1);
+            pattern_sites.push_back(site);
+            this->site_patterns_.push_back(pattern_index);
+        } else {
+            this->pattern_counts_[pattern->second] += 1;
+            this->site_patterns_.push_back(pattern->second);
+        }
+    }
+    this->pattern_weights_.assign(this->pattern_counts_.cbegin(), this->pattern_counts_.cend());
+
+    // build the pattern matrix from the first site of each pattern
+    unsigned long num_patterns = this->pattern_counts_.size();
+    this->pattern_states_.resize(num_rows);
+    this->pattern_partials_.resize(num_rows);
+    this->compact_rows_.assign(num_rows, true);
+    for (unsigned long row = 0; row < num_rows; ++row) {
+        CharacterStateVectorType& states = this->pattern_states_[row];
+        std::vector<double>& partials = this->pattern_partials_[row];
+        states.reserve(num_patterns);
+        partials.reserve(num_patterns * 4);
+        for (auto site : pattern_sites) {
+            CharacterStateType state = *(sequences[row]->cbegin() + site);
+            states.push_back(state);
+            auto state_partials = NucleotideSequence::state_to_partials_map_.find(state)->second;
+            partials.insert(partials.end(), state_partials.begin(), state_partials.end());
+            // A, C, G, T and missing data precede the ambiguity codes
+            if (state > NucleotideSequence::missing_data_state) {
+                this->compact_rows_[row] = false;
+            }
+        }
+        if (this->compact_rows_[row]) {
+            ++this->num_compact_rows_;
+        }
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // NucleotideSequences
 
@@ -172,17 +408,55 @@ void NucleotideSequences::clear() {
     }
     this->sequences_.clear();
     this->label_sequence_map_.clear();
+    this->site_patterns_.clear();
+}
+
+void NucleotideSequences::compress_patterns() {
+    std::vector<const NucleotideSequence *> sequences(this->sequences_.cbegin(), this->sequences_.cend());
+    this->site_patterns_.compress(sequences, this->get_num_sites());
 }
 
 void NucleotideSequences::set_tip_data(GeneTree * gene_tree) {
-    unsigned long idx=0;
-    for (auto leaf_iter = gene_tree->leaf_begin(); leaf_iter != gene_tree->leaf_end(); ++leaf_iter, ++idx) {
+    if (this->site_patterns_.get_num_sites() == 0) {
+        this->compress_patterns();
+    }
+    for (auto leaf_iter = gene_tree->leaf_begin(); leaf_iter != gene_tree->leaf_end(); ++leaf_iter) {
+        auto label_sequence = this->label_sequence_map_.find(leaf_iter->get_label());
+        if (label_sequence == this->label_sequence_map_.end() || !label_sequence->second) {
+            treeshrew_abort("Null sequence for taxon '", leaf_iter->get_label(), "'");
+        }
+    }
+    if (gene_tree->map_tip_data(this->site_patterns_.get_id())) {
+        return;
+    }
+    int num_compact_tips_left = gene_tree->get_num_compact_tip_buffers();
+    if (this->sequences_.size() <= static_cast<unsigned long>(gene_tree->get_max_tip_data())) {
+        std::vector<TipData> tip_data;
+        tip_data.reserve(this->sequences_.size());
+        for (auto & seq : this->sequences_) {
+            if (num_compact_tips_left > 0 && this->site_patterns_.has_compact_states(seq)) {
+                tip_data.push_back({seq->get_label(), this->site_patterns_.get_states_data(seq), nullptr});
+                --num_compact_tips_left;
+            } else {
+                tip_data.push_back({seq->get_label(), nullptr, this->site_patterns_.get_partials_data(seq)});
+            }
+        }
+        gene_tree->load_tip_data(this->site_patterns_.get_id(),
+                this->site_patterns_.pattern_weights_data(),
+                tip_data);
+        gene_tree->map_tip_data(this->site_patterns_.get_id());
+        return;
+    }
+    gene_tree->set_pattern_weights(this->site_patterns_.pattern_weights_data());
+    for (auto leaf_iter = gene_tree->leaf_begin(); leaf_iter != gene_tree->leaf_end(); ++leaf_iter) {
         const std::string& label = leaf_iter->get_label();
-        NucleotideSequence * seq = this->label_sequence_map_[label];
-        if (!seq) {
-            treeshrew_abort("Null sequence for taxon '", label, "'");
+        NucleotideSequence * seq = this->label_sequence_map_.find(label)->second;
+        if (num_compact_tips_left > 0 && this->site_patterns_.has_compact_states(seq)) {
+            gene_tree->set_tip_states(*leaf_iter, this->site_patterns_.get_states_data(seq));
+            --num_compact_tips_left;
+        } else {
+            gene_tree->set_tip_partials(*leaf_iter, this->site_patterns_.get_partials_data(seq));
         }
-        gene_tree->set_tip_partials(*leaf_iter, seq->partials_data());
     }
 }
 
@@ -215,7 +489,9 @@ NucleotideAlignment::NucleotideAlignment(unsigned long max_sequences,
         unsigned long max_sites)
         : max_sequences_(max_sequences)
         , max_sites_(max_sites)
-        , num_active_sites_(0) {
+        , num_active_sites_(0)
+        , next_sequence_version_(1)
+        , seed_length_(0) {
     this->create();
 }
 
@@ -247,6 +523,143 @@ void NucleotideAlignment::clear() {
     this->sequence_storage_.clear();
     this->sequence_node_data_map_.clear();
     this->node_data_sequence_map_.clear();
+    this->packed_sequences_.clear();
+    this->sequence_versions_.clear();
+    this->seed_length_ = 0;
+    this->seed_indexes_.clear();
+    this->site_patterns_.clear();
+}
+
+void NucleotideAlignment::pack_sequences() {
+    this->packed_sequences_.clear();
+    this->seed_length_ = 0;
+    this->seed_indexes_.clear();
+    for (auto & node_data_sequence : this->node_data_sequence_map_) {
+        this->packed_sequences_[node_data_sequence.second].assign(node_data_sequence.second->state_data(),
+                this->num_active_sites_);
+        this->sequence_versions_[node_data_sequence.second] = this->next_sequence_version_++;
+    }
+}
+
+// Calls ``emit(seed, position)`` for each run of ``seed_length`` unambiguous
+// bases in ``states``, with the bases of the run packed 2 bits each (the
+// first in the highest bits); returns false if any state is ambiguous.
+template <class F>
+static bool for_each_seed(const CharacterStateType * states,
+        unsigned long size,
+        unsigned int seed_length,
+        const F& emit) {
+    uint32_t mask = seed_length == 16 ? 0xffffffff : (static_cast<uint32_t>(1) << (2 * seed_length)) - 1;
+    uint32_t seed = 0;
+    unsigned int run_length = 0;
+    bool is_unambiguous = true;
+    for (unsigned long idx = 0; idx < size; ++idx) {
+        CharacterStateType state = states[idx];
+        if (state < 0 || state > 3) {
+            run_length = 0;
+            is_unambiguous = false;
+            continue;
+        }
+        seed = ((seed << 2) | static_cast<uint32_t>(state)) & mask;
+        if (++run_length >= seed_length) {
+            emit(seed, idx + 1 - seed_length);
+        }
+    }
+    return is_unambiguous;
+}
+
+void NucleotideAlignment::build_seed_index(unsigned int seed_length) {
+    TREESHREW_ASSERT(seed_length > 0 && seed_length <= MAX_SEED_LENGTH);
+    TREESHREW_ASSERT(this->num_active_sites_ <= 0xffffffff);
+    this->seed_indexes_.clear();
+    this->seed_length_ = seed_length;
+    for (auto & node_data_sequence : this->node_data_sequence_map_) {
+        this->index_seeds(node_data_sequence.second);
+    }
+}
+
+void NucleotideAlignment::index_seeds(const NucleotideSequence * seq) {
+    std::vector<uint64_t>& seeds = this->seed_indexes_[seq];
+    seeds.clear();
+    seeds.reserve(this->num_active_sites_);
+    for_each_seed(seq->state_data(), this->num_active_sites_, this->seed_length_,
+            [&seeds](uint32_t seed, unsigned long position) {
+                seeds.push_back((static_cast<uint64_t>(seed) << 32) | position);
+            });
+    std::sort(seeds.begin(), seeds.end());
+}
+
+void NucleotideAlignment::update_sequence(GeneNodeData * gene_node_data) {
+    auto siter = this->node_data_sequence_map_.find(gene_node_data);
+    TREESHREW_ASSERT(siter != this->node_data_sequence_map_.end());
+    this->packed_sequences_[siter->second].assign(siter->second->state_data(), this->num_active_sites_);
+    this->sequence_versions_[siter->second] = this->next_sequence_version_++;
+    if (this->seed_length_ > 0) {
+        this->index_seeds(siter->second);
+    }
+}
+
+bool NucleotideAlignment::find_read_seeds(const ShortReadSequence& short_read, std::vector<uint64_t>& read_seeds) const {
+    TREESHREW_ASSERT(this->seed_length_ > 0);
+    read_seeds.clear();
+    if (short_read.size() < this->seed_length_) {
+        return false;
+    }
+    bool is_unambiguous = for_each_seed(&(*short_read.cbegin()), short_read.size(), this->seed_length_,
+            [&read_seeds](uint32_t seed, unsigned long position) {
+                read_seeds.push_back((static_cast<uint64_t>(seed) << 32) | position);
+            });
+    if (!is_unambiguous) {
+        read_seeds.clear();
+    }
+    return is_unambiguous;
+}
+
+double NucleotideAlignment::calc_seeded_probability_of_sequence(
+        GeneNodeData * gene_node_data,
+        const ShortReadSequence& short_read,
+        const std::vector<uint64_t>& read_seeds,
+        const std::vector<double>& error_probabilities,
+        std::vector<unsigned long>& offsets) const {
+    auto siter = this->node_data_sequence_map_.find(gene_node_data);
+    TREESHREW_ASSERT(siter != this->node_data_sequence_map_.end());
+    auto seeds = this->seed_indexes_.find(siter->second);
+    TREESHREW_ASSERT(seeds != this->seed_indexes_.end());
+    const PackedSequence& long_read = this->packed_sequences_.find(siter->second)->second;
+    const PackedSequence& packed_short_read = short_read.get_packed_states();
+    unsigned long short_read_size = short_read.size();
+    TREESHREW_ASSERT(this->num_active_sites_ >= short_read_size);
+    TREESHREW_ASSERT(error_probabilities.size() == short_read_size + 1);
+    unsigned long num_offsets = this->num_active_sites_ - short_read_size + 1;
+    offsets.clear();
+    for (auto read_seed : read_seeds) {
+        uint64_t seed = read_seed & 0xffffffff00000000;
+        unsigned long read_position = read_seed & 0xffffffff;
+        for (auto hit = std::lower_bound(seeds->second.cbegin(), seeds->second.cend(), seed);
+                hit != seeds->second.cend() && (*hit & 0xffffffff00000000) == seed;
+                ++hit) {
+            unsigned long position = *hit & 0xffffffff;
+            if (position >= read_position && position - read_position < num_offsets) {
+                offsets.push_back(position - read_position);
+            }
+        }
+    }
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    double prob = 0.0;
+    for (auto offset : offsets) {
+        prob += error_probabilities[long_read.count_mismatches(packed_short_read, offset)];
+    }
+    return prob;
+}
+
+void NucleotideAlignment::compress_patterns() {
+    std::vector<const NucleotideSequence *> sequences;
+    sequences.reserve(this->node_data_sequence_map_.size());
+    for (auto & node_data_sequence : this->node_data_sequence_map_) {
+        sequences.push_back(node_data_sequence.second);
+    }
+    this->site_patterns_.compress(sequences, this->num_active_sites_);
 }
 
 void NucleotideAlignment::write_states_as_symbols(
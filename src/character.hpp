@@ -2,6 +2,7 @@
 #define TREESHREW_CHARACTER_HPP
 
 #include <array>
+#include <cstdint>
 #include <algorithm>
 #include <iostream>
 #include <fstream>
@@ -9,9 +10,9 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <numeric>    //inner_product
 #include <functional> //plus, equal_to, not2
-#include <gsl/gsl_randist.h>
 #include "genetree.hpp"
 #include "utility.hpp"
 
@@ -145,6 +146,135 @@ class NucleotideSequence {
 
 }; // NucleotideSequence
 
+//////////////////////////////////////////////////////////////////////////////
+// PackedSequence
+
+// Sequence states packed 2 bits per base (32 bases per 64-bit word), for
+// counting mismatches a word at a time (XOR and popcount). Bases other than
+// A, C, G or T are flagged in a parallel mask; mismatches at those are
+// counted by comparing the original states, so that counts are exactly
+// those of comparing states one by one.
+class PackedSequence {
+
+    public:
+        static const unsigned long BASES_PER_WORD = 32;
+
+    public:
+        PackedSequence();
+        PackedSequence(const CharacterStateType * states, unsigned long size);
+        void assign(const CharacterStateType * states, unsigned long size);
+        inline unsigned long size() const {
+            return this->size_;
+        }
+        inline CharacterStateType get_state(unsigned long idx) const {
+            TREESHREW_NDEBUG_ASSERT(idx < this->size_);
+            if (!this->ambiguous_states_.empty()) {
+                return this->ambiguous_states_[idx];
+            }
+            return (this->codes_[idx / BASES_PER_WORD] >> (2 * (idx % BASES_PER_WORD))) & 3;
+        }
+        // Number of positions at which ``read`` differs from the bases of
+        // this sequence starting at ``offset`` (which need to cover all
+        // of ``read``).
+        unsigned long count_mismatches(const PackedSequence& read, unsigned long offset) const;
+        // "AVX2" or "scalar"
+        static const char * get_kernel_name();
+
+    private:
+        // Mismatches among the positions flagged in ``ambiguous_bits``
+        // (2 bits per base, as the codes) of the ``word_idx``-th word of
+        // ``read`` placed at ``offset``.
+        unsigned long count_ambiguous_mismatches(const PackedSequence& read,
+                unsigned long offset,
+                unsigned long word_idx,
+                uint64_t ambiguous_bits) const;
+
+    private:
+        unsigned long           size_;
+        // Base ``i`` is in bits ``2 * (i % 32)`` and ``2 * (i % 32) + 1``
+        // of word ``i / 32``. Ambiguous bases have a code of 0 and their
+        // low bit set in ``ambiguities_``; ``valid_`` has the low bit of
+        // each base of the sequence set. Words are padded with zeros, so
+        // that unaligned windows can read past the last base.
+        std::vector<uint64_t>   codes_;
+        std::vector<uint64_t>   ambiguities_;
+        std::vector<uint64_t>   valid_;
+        // All states, kept only if any base is ambiguous
+        std::vector<unsigned char>  ambiguous_states_;
+
+}; // PackedSequence
+
+//////////////////////////////////////////////////////////////////////////////
+// SitePatterns
+
+// Compresses a set of aligned sequences into their unique site patterns
+// (columns), with the number of sites represented by each pattern.
+class SitePatterns {
+
+    public:
+        SitePatterns();
+        ~SitePatterns();
+        void clear();
+        void compress(const std::vector<const NucleotideSequence *>& sequences,
+                unsigned long num_sites);
+        inline unsigned long get_num_sites() const {
+            return this->num_sites_;
+        }
+        // Unique (process-wide) identifier of the result of each call to
+        // ``compress()``; 0 before the first.
+        inline unsigned long get_id() const {
+            return this->id_;
+        }
+        inline unsigned long get_num_patterns() const {
+            return this->pattern_counts_.size();
+        }
+        inline const std::vector<unsigned long>& get_pattern_counts() const {
+            return this->pattern_counts_;
+        }
+        inline const double * pattern_weights_data() const {
+            return this->pattern_weights_.data();
+        }
+        inline unsigned long get_pattern_index(unsigned long site) const {
+            TREESHREW_ASSERT(site < this->site_patterns_.size());
+            return this->site_patterns_[site];
+        }
+        inline const CharacterStateType * get_states_data(const NucleotideSequence * seq) const {
+            return this->pattern_states_[this->get_row(seq)].data();
+        }
+        inline const double * get_partials_data(const NucleotideSequence * seq) const {
+            return this->pattern_partials_[this->get_row(seq)].data();
+        }
+        // True if the patterns of ``seq`` have no partial ambiguities (only
+        // A, C, G, T or missing data), so that its states can stand in for
+        // its partials.
+        inline bool has_compact_states(const NucleotideSequence * seq) const {
+            return this->compact_rows_[this->get_row(seq)];
+        }
+        inline unsigned long get_num_compact_rows() const {
+            return this->num_compact_rows_;
+        }
+
+    private:
+        inline unsigned long get_row(const NucleotideSequence * seq) const {
+            auto row = this->sequence_rows_.find(seq);
+            TREESHREW_NDEBUG_ASSERT(row != this->sequence_rows_.end());
+            return row->second;
+        }
+
+    private:
+        unsigned long                                           id_;
+        unsigned long                                           num_sites_;
+        std::vector<unsigned long>                              pattern_counts_;
+        std::vector<double>                                     pattern_weights_;
+        std::vector<unsigned long>                              site_patterns_;
+        std::vector<CharacterStateVectorType>                   pattern_states_;
+        std::vector<std::vector<double>>                        pattern_partials_;
+        std::vector<bool>                                       compact_rows_;
+        unsigned long                                           num_compact_rows_;
+        std::map<const NucleotideSequence *, unsigned long>     sequence_rows_;
+
+}; // SitePatterns
+
 //////////////////////////////////////////////////////////////////////////////
 // NucleotideSequences
 
@@ -204,12 +334,34 @@ class NucleotideSequences {
                 return 0;
             }
         }
+        // Compresses the sequences into unique site patterns; must be
+        // called (again) after sequences are added or modified.
+        void compress_patterns();
+        inline unsigned long get_num_patterns() const {
+            return this->site_patterns_.get_num_patterns();
+        }
+        inline const SitePatterns& get_site_patterns() const {
+            return this->site_patterns_;
+        }
+        // Sequences that can be uploaded as compact tip states (see
+        // ``SitePatterns::has_compact_states()``); to be passed to
+        // ``GeneTree::create_beagle_instance()``.
+        inline unsigned long get_num_compact_sequences() const {
+            return this->site_patterns_.get_num_compact_rows();
+        }
+        // Uploads pattern weights and compressed tip data: compact states
+        // for sequences without partial ambiguities (as far as the
+        // instance has compact buffers for them), partials otherwise.
+        // Where possible, all sequences are loaded into the tree's (pooled)
+        // BEAGLE instance, so subsequent trees checking out that instance
+        // can reuse them.
         void set_tip_data(GeneTree * gene_tree);
         void read_fasta(std::istream& src);
 
     protected:
         std::vector<NucleotideSequence *>               sequences_;
         std::map<std::string, NucleotideSequence *>     label_sequence_map_;
+        SitePatterns                                    site_patterns_;
 
 }; // NucleotideSequences
 
@@ -221,19 +373,24 @@ class ShortReadSequence {
     public:
         ShortReadSequence(const NucleotideSequence& seq)
             : label_(seq.get_label())
-            , sequence_(seq.cbegin(), seq.cend()) {
+            , sequence_(seq.cbegin(), seq.cend())
+            , packed_states_(seq.state_data(), seq.size()) {
             this->begin_ = this->sequence_.begin();
             this->end_ = this->sequence_.end();
             this->size_ = this->sequence_.size();
         }
 
+        // ``error_probabilities`` holds the probability of each number of
+        // errors in a read of this length (see
+        // ``ReadErrorModel::get_probabilities()``).
         inline double calc_probability_of_sequence(
                 const CharacterStateVectorType::const_iterator& long_read_begin,
                 const CharacterStateVectorType::const_iterator& long_read_end,
-                double mean_number_of_errors_per_site) const {
+                const std::vector<double>& error_probabilities) const {
             CharacterStateVectorType::const_iterator start_pos = long_read_begin;
             CharacterStateVectorType::const_iterator stop_pos = long_read_end - this->size_ + 1;
             assert(stop_pos >= start_pos);
+            assert(error_probabilities.size() == this->size_ + 1);
             unsigned long num_mismatches = 0;
             double prob = 0.0;
             while (start_pos < stop_pos) {
@@ -241,8 +398,7 @@ class ShortReadSequence {
                         this->begin_, this->end_, start_pos,
                         0, std::plus<unsigned int>(),
                         std::not2(std::equal_to<CharacterStateVectorType::value_type>()));
-                // prob += gsl_ran_binomial_pdf(num_mismatches, mean_number_of_errors_per_site, this->size_);
-                prob += gsl_ran_poisson_pdf(num_mismatches, 1.0/0.0107);
+                prob += error_probabilities[num_mismatches];
                 ++start_pos;
             }
             // return std::log(prob);
@@ -264,10 +420,14 @@ class ShortReadSequence {
         inline unsigned long size() const {
             return this->size_;
         }
+        inline const PackedSequence& get_packed_states() const {
+            return this->packed_states_;
+        }
 
     private:
         std::string                                 label_;
         CharacterStateVectorType                    sequence_;
+        PackedSequence                              packed_states_;
         CharacterStateVectorType::const_iterator    begin_;
         CharacterStateVectorType::const_iterator    end_;
         unsigned long                               size_;
@@ -352,6 +512,60 @@ class NucleotideAlignment {
         inline const double * get_partials_data(GeneNodeData * gene_node_data) const {
             return this->node_data_sequence_map_.find(gene_node_data)->second->partials_data();
         }
+        // Compresses the active sites of the sequences assigned to gene tree
+        // nodes into unique site patterns; must be called (again) after
+        // sequences are assigned or modified.
+        void compress_patterns();
+        // Packs the active sites of the sequences assigned to gene tree
+        // nodes for scoring short reads (see ``PackedSequence``); must be
+        // called (again) after sequences are assigned or modified.
+        void pack_sequences();
+        // Indexes the seeds (runs of ``seed_length`` unambiguous bases, up
+        // to ``MAX_SEED_LENGTH``) at each position of the packed sequences,
+        // so that short reads can be scored against only the windows that
+        // share a seed with them. Packing the sequences again discards the
+        // index.
+        void build_seed_index(unsigned int seed_length);
+        // Repacks (and reindexes) the sequence assigned to
+        // ``gene_node_data``; must be called after its states are modified
+        // (e.g., through ``sequence_states_begin()``).
+        void update_sequence(GeneNodeData * gene_node_data);
+        // Changes whenever the sequence assigned to ``gene_node_data`` is
+        // packed, i.e., by ``pack_sequences()`` or ``update_sequence()``.
+        inline unsigned long get_sequence_version(GeneNodeData * gene_node_data) const {
+            auto siter = this->node_data_sequence_map_.find(gene_node_data);
+            TREESHREW_ASSERT(siter != this->node_data_sequence_map_.end());
+            auto version = this->sequence_versions_.find(siter->second);
+            return version == this->sequence_versions_.end() ? 0 : version->second;
+        }
+        // 0 if there is no seed index.
+        inline unsigned int get_seed_length() const {
+            return this->seed_length_;
+        }
+        // Collects the seeds of ``short_read``, each with its position in
+        // the read in the low 32 bits. Returns false (and collects none) if
+        // the read is shorter than the seed length or has ambiguous states,
+        // in which case a window without a shared seed is not guaranteed
+        // to differ from the read at one in every ``seed_length`` sites.
+        bool find_read_seeds(const ShortReadSequence& short_read, std::vector<uint64_t>& read_seeds) const;
+        inline unsigned long get_num_patterns() const {
+            return this->site_patterns_.get_num_patterns();
+        }
+        inline const double * get_pattern_weights_data() const {
+            return this->site_patterns_.pattern_weights_data();
+        }
+        inline const double * get_pattern_partials_data(GeneNodeData * gene_node_data) const {
+            return this->site_patterns_.get_partials_data(this->node_data_sequence_map_.find(gene_node_data)->second);
+        }
+        inline const CharacterStateType * get_pattern_states_data(GeneNodeData * gene_node_data) const {
+            return this->site_patterns_.get_states_data(this->node_data_sequence_map_.find(gene_node_data)->second);
+        }
+        inline bool has_compact_pattern_states(GeneNodeData * gene_node_data) const {
+            return this->site_patterns_.has_compact_states(this->node_data_sequence_map_.find(gene_node_data)->second);
+        }
+        inline const SitePatterns& get_site_patterns() const {
+            return this->site_patterns_;
+        }
         inline CharacterStateVectorType::iterator sequence_states_begin(GeneNodeData * gene_node_data) const {
             return this->node_data_sequence_map_.find(gene_node_data)->second->begin();
         }
@@ -364,45 +578,57 @@ class NucleotideAlignment {
         inline CharacterStateVectorType::const_iterator sequence_states_cend(GeneNodeData * gene_node_data) const {
             return this->node_data_sequence_map_.find(gene_node_data)->second->cbegin() + this->num_active_sites_;
         }
+        // Sum, over every window of the sequence, of the probability of the
+        // short read being read (with errors) from the window;
+        // ``error_probabilities`` holds the probability of each number of
+        // errors in a read of its length (see
+        // ``ReadErrorModel::get_probabilities()``).
         inline double calc_probability_of_sequence(
                 GeneNodeData * gene_node_data,
                 const ShortReadSequence& short_read,
-                double mean_number_of_errors_per_site) const {
+                const std::vector<double>& error_probabilities) const {
             auto siter = this->node_data_sequence_map_.find(gene_node_data);
             TREESHREW_ASSERT(siter != this->node_data_sequence_map_.end());
             NucleotideSequence * seq = siter->second;
-            return this->calc_probability_of_sequence(seq, short_read, mean_number_of_errors_per_site);
+            return this->calc_probability_of_sequence(seq, short_read, error_probabilities);
         }
         inline double calc_probability_of_sequence(
                 NucleotideSequence * seq,
                 const ShortReadSequence& short_read,
-                double mean_number_of_errors_per_site) const {
+                const std::vector<double>& error_probabilities) const {
             TREESHREW_ASSERT(seq);
-            CharacterStateVectorType::const_iterator long_read_start_pos = seq->cbegin();
-            CharacterStateVectorType::const_iterator long_read_stop_pos = long_read_start_pos + this->num_active_sites_ - short_read.size() + 1;
-            CharacterStateVectorType::const_iterator short_read_begin = short_read.cbegin();
-            CharacterStateVectorType::const_iterator short_read_end = short_read.cend();
+            auto packed_seq = this->packed_sequences_.find(seq);
+            TREESHREW_ASSERT(packed_seq != this->packed_sequences_.end());
+            const PackedSequence& long_read = packed_seq->second;
+            const PackedSequence& packed_short_read = short_read.get_packed_states();
             unsigned long short_read_size = short_read.size();
-            TREESHREW_ASSERT(long_read_stop_pos >= long_read_start_pos);
+            TREESHREW_ASSERT(this->num_active_sites_ >= short_read_size);
+            TREESHREW_ASSERT(error_probabilities.size() == short_read_size + 1);
+            unsigned long num_offsets = this->num_active_sites_ - short_read_size + 1;
             unsigned long num_mismatches = 0;
             double prob = 0.0;
-            while (long_read_start_pos < long_read_stop_pos) {
-                num_mismatches = std::inner_product(
-                        short_read_begin,
-                        short_read_end,
-                        long_read_start_pos,
-                        0,
-                        std::plus<unsigned int>(),
-                        std::not2(std::equal_to<CharacterStateVectorType::value_type>()));
-                prob += gsl_ran_binomial_pdf(num_mismatches, mean_number_of_errors_per_site, short_read_size);
-                // prob += gsl_ran_poisson_pdf(num_mismatches, (mean_number_of_errors_per_site * short_read_size));
-                ++long_read_start_pos;
+            for (unsigned long offset = 0; offset < num_offsets; ++offset) {
+                num_mismatches = long_read.count_mismatches(packed_short_read, offset);
+                prob += error_probabilities[num_mismatches];
             }
             return prob;
         }
+        // As ``calc_probability_of_sequence()``, but over only the windows
+        // sharing a seed with the read (``read_seeds``, from
+        // ``find_read_seeds()``), whose offsets are left in ``offsets``.
+        double calc_seeded_probability_of_sequence(
+                GeneNodeData * gene_node_data,
+                const ShortReadSequence& short_read,
+                const std::vector<uint64_t>& read_seeds,
+                const std::vector<double>& error_probabilities,
+                std::vector<unsigned long>& offsets) const;
         void write_states_as_symbols(GeneNodeData * gene_node_data, std::ostream& out) const;
 
+    public:
+        static const unsigned int MAX_SEED_LENGTH = 16;
+
     protected:
+        void index_seeds(const NucleotideSequence * seq);
         void set_sequence_states(NucleotideSequence * seq, const NucleotideSequence * src_seq) {
             unsigned long len = src_seq->size();
             if (len > this->max_sites_) {
@@ -425,6 +651,15 @@ class NucleotideAlignment {
         std::stack<NucleotideSequence *>                        available_sequences_;
         std::map<NucleotideSequence *, GeneNodeData *>          sequence_node_data_map_;
         std::map<GeneNodeData *, NucleotideSequence *>          node_data_sequence_map_;
+        std::map<const NucleotideSequence *, PackedSequence>    packed_sequences_;
+        std::map<const NucleotideSequence *, unsigned long>     sequence_versions_;
+        // Never reset, so that versions are not reused
+        unsigned long                                           next_sequence_version_;
+        unsigned int                                            seed_length_;
+        // Seeds of each sequence, each with its position in the low 32
+        // bits, sorted
+        std::map<const NucleotideSequence *, std::vector<uint64_t>>  seed_indexes_;
+        SitePatterns                                            site_patterns_;
 
 }; // NucleotideAlignment
 
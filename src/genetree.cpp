@@ -1,19 +1,119 @@
 #include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <sstream>
 #include "utility.hpp"
 #include "genetree.hpp"
 
 namespace treeshrew {
 
+////////////////////////////////////////////////////////////////////////////////
+// BeagleSettings
+
+void BeagleSettings::parse(const std::string& spec) {
+    std::istringstream src(spec);
+    for (std::string item; std::getline(src, item, ',');) {
+        if (item.empty()) {
+            continue;
+        }
+        bool required = false;
+        if (item[item.size()-1] == '!') {
+            required = true;
+            item.erase(item.size()-1);
+        }
+        if (item == "sse") {
+            this->set_vectorized(required);
+        } else if (item == "threaded") {
+            this->set_threaded(required);
+        } else if (item == "single") {
+            this->set_single_precision(required);
+        } else if (item == "double") {
+            this->set_double_precision(required);
+        } else if (item == "cpu") {
+            this->set_cpu(required);
+        } else if (item == "native") {
+            this->set_native_engine();
+        } else {
+            treeshrew_abort("Unrecognized BEAGLE implementation characteristic: '", item, "'");
+        }
+    }
+}
+
+std::string BeagleSettings::describe_flags(long flags) {
+    static const std::vector<std::pair<long, const char *>> flag_names {
+        {BEAGLE_FLAG_PRECISION_SINGLE,      "PRECISION_SINGLE"},
+        {BEAGLE_FLAG_PRECISION_DOUBLE,      "PRECISION_DOUBLE"},
+        {BEAGLE_FLAG_COMPUTATION_SYNCH,     "COMPUTATION_SYNCH"},
+        {BEAGLE_FLAG_COMPUTATION_ASYNCH,    "COMPUTATION_ASYNCH"},
+        {BEAGLE_FLAG_EIGEN_REAL,            "EIGEN_REAL"},
+        {BEAGLE_FLAG_EIGEN_COMPLEX,         "EIGEN_COMPLEX"},
+        {BEAGLE_FLAG_SCALING_MANUAL,        "SCALING_MANUAL"},
+        {BEAGLE_FLAG_SCALING_AUTO,          "SCALING_AUTO"},
+        {BEAGLE_FLAG_SCALING_ALWAYS,        "SCALING_ALWAYS"},
+        {BEAGLE_FLAG_SCALERS_RAW,           "SCALERS_RAW"},
+        {BEAGLE_FLAG_SCALERS_LOG,           "SCALERS_LOG"},
+        {BEAGLE_FLAG_VECTOR_SSE,            "VECTOR_SSE"},
+        {BEAGLE_FLAG_VECTOR_NONE,           "VECTOR_NONE"},
+        {BEAGLE_FLAG_THREADING_OPENMP,      "THREADING_OPENMP"},
+        {BEAGLE_FLAG_THREADING_NONE,        "THREADING_NONE"},
+        {BEAGLE_FLAG_PROCESSOR_CPU,         "PROCESSOR_CPU"},
+        {BEAGLE_FLAG_PROCESSOR_GPU,         "PROCESSOR_GPU"},
+        {BEAGLE_FLAG_PROCESSOR_FPGA,        "PROCESSOR_FPGA"},
+        {BEAGLE_FLAG_PROCESSOR_CELL,        "PROCESSOR_CELL"},
+    };
+    std::ostringstream out;
+    for (auto & flag_name : flag_names) {
+        if (flags & flag_name.first) {
+            if (out.tellp() > 0) {
+                out << " ";
+            }
+            out << flag_name.second;
+        }
+    }
+    return out.str();
+}
+
+// Tip state mask of a fully ambiguous (or missing) character
+static const unsigned char ALL_STATES_MASK = 0xF;
+
+// Bounds on edge lengths during optimization
+static const double MIN_EDGE_LENGTH = 1e-8;
+static const double MAX_EDGE_LENGTH = 100.0;
+
 ////////////////////////////////////////////////////////////////////////////////
 // GeneTreeNode
 
 GeneTree::GeneTree(unsigned long max_tips):
         Tree<GeneNodeData>(false),
         max_tips_(max_tips),
+        num_tip_nodes_(max_tips * 2),
+        num_internal_nodes_(max_tips * 2 + 1),
         leaf_node_allocator_(max_tips * 2, 0),
         internal_node_allocator_(max_tips * 2 + 1, max_tips * 2),
+        pooled_instance_(nullptr),
         beagle_instance_(-1),
-        beagle_return_info_(nullptr) {
+        engine_(nullptr),
+        tip_buffer_indices_(max_tips * 2),
+        is_tip_data_shared_(false),
+        ln_probability_(0.0),
+        num_patterns_(0),
+        num_rate_categories_(0),
+        uploaded_site_rate_model_version_(0),
+        eigen_index_(0),
+        uploaded_substitution_model_version_(0),
+        are_invariant_probabilities_current_(false),
+        is_storing_site_ln_probabilities_(false),
+        is_schedule_valid_(false),
+        num_transition_matrix_updates_(0),
+        are_upper_partials_current_(false),
+        num_budget_partials_buffers_(0),
+        num_working_partials_buffers_(0),
+        num_checkpoint_nodes_(0),
+        num_batch_trees_(1),
+        batch_index_(0),
+        is_proposal_active_(false),
+        stored_ln_probability_(0.0),
+        stored_eigen_index_(0) {
     this->create(this->allocate_internal_node(),
         this->allocate_internal_node());
 }
@@ -26,149 +126,648 @@ GeneTree::~GeneTree() {
 void GeneTree::clear() {
 }
 
-int GeneTree::create_beagle_instance(int num_sites) {
+void GeneTree::set_edge_length(GeneTreeNode * nd, double edge_length) {
+    TREESHREW_ASSERT(nd);
+    if (this->is_proposal_active_) {
+        this->stored_edge_lengths_.emplace_back(nd, nd->data().get_edge_length());
+    }
+    nd->data().set_edge_length(edge_length);
+    this->flag_path_as_dirty(nd);
+}
+
+void GeneTree::flag_path_as_dirty(GeneTreeNode * nd) {
+    while (nd) {
+        nd->data().flag_as_dirty();
+        nd = nd->parent_node();
+    }
+}
+
+void GeneTree::flag_all_as_dirty() {
+    for (GeneTree::postorder_iterator ndi = this->postorder_begin(); ndi != this->postorder_end(); ++ndi) {
+        ndi->flag_as_dirty();
+    }
+}
+
+void GeneTree::clear_dirty_flags() {
+    for (GeneTree::postorder_iterator ndi = this->postorder_begin(); ndi != this->postorder_end(); ++ndi) {
+        ndi->set_dirty(false);
+    }
+}
+
+void GeneTree::flag_topology_as_dirty() {
+    this->is_schedule_valid_ = false;
+    this->are_invariant_probabilities_current_ = false;
+    this->are_upper_partials_current_ = false;
+    this->flag_all_as_dirty();
+}
+
+void GeneTree::build_operation_schedule() {
+    this->postorder_nodes_.clear();
+    this->matrix_indices_.clear();
+    this->edge_lengths_.clear();
+    this->operation_indices_.clear();
+    this->beagle_operations_.clear();
+    // create a list of partial likelihood update operations
+    // the order is [dest, sourceScaling, destScaling, source1, matrix1, source2, matrix2]
+    // these operations say: first peel node 0 and 1 to calculate the per-site partial likelihoods, and store them
+    // in buffer 3.  Then peel node 2 and buffer 3 and store the per-site partial likelihoods in buffer 4.
+    // BeagleOperation operations[2] = {
+    //     {3, BEAGLE_OP_NONE, BEAGLE_OP_NONE, 0, 0, 1, 1},
+    //     {4, BEAGLE_OP_NONE, BEAGLE_OP_NONE, 2, 2, 3, 3}
+    // };
+    // (buffer indices are refreshed for the current slots when a node is
+    // recalculated)
+    for (GeneTree::postorder_iterator ndi = this->postorder_begin(); ndi != this->postorder_end(); ++ndi) {
+        this->postorder_nodes_.push_back(ndi.node());
+        this->matrix_indices_.push_back(this->get_matrix_buffer_index(*ndi));
+        this->edge_lengths_.push_back(ndi->get_edge_length());
+        if (ndi.is_leaf()) {
+            this->operation_indices_.push_back(-1);
+            continue;
+        }
+        const GeneNodeData& ch1 = ndi.first_child();
+        const GeneNodeData& ch2 = ndi.last_child();
+        this->operation_indices_.push_back(this->beagle_operations_.size());
+        this->beagle_operations_.push_back({
+                this->get_partials_buffer_index(*ndi),
+                BEAGLE_OP_NONE,
+                BEAGLE_OP_NONE,
+                this->get_partials_buffer_index(ch1),
+                this->get_matrix_buffer_index(ch1),
+                this->get_partials_buffer_index(ch2),
+                this->get_matrix_buffer_index(ch2)
+                });
+    }
+    this->dirty_nodes_.reserve(this->postorder_nodes_.size());
+    this->dirty_matrix_indices_.reserve(this->matrix_indices_.size());
+    this->dirty_edge_lengths_.reserve(this->edge_lengths_.size());
+    this->dirty_operations_.reserve(this->beagle_operations_.size());
+    if (this->is_partials_memory_bounded()) {
+        this->assign_checkpoints();
+    }
+    this->is_schedule_valid_ = true;
+}
+
+void GeneTree::assign_checkpoints() {
+    int num_checkpoint_buffers = this->num_budget_partials_buffers_ - this->num_working_partials_buffers_;
+    int num_internal_nodes = 0;
+    for (auto nd : this->postorder_nodes_) {
+        if (!nd->is_leaf() && nd != this->head_node_) {
+            ++num_internal_nodes;
+        }
+    }
+    this->checkpoint_buffer_indices_.assign(this->num_tip_nodes_ + this->num_internal_nodes_, -1);
+    this->num_checkpoint_nodes_ = 0;
+    if (num_checkpoint_buffers > 0 && num_internal_nodes > 0) {
+        // a node becomes a checkpoint once it would otherwise be
+        // recalculated along with ``spacing`` or more internal nodes not
+        // covered by checkpoints below it; as each checkpoint covers at
+        // least ``spacing`` nodes of its own, they fit in the buffers
+        int spacing = (num_internal_nodes + num_checkpoint_buffers - 1) / num_checkpoint_buffers;
+        std::vector<int> num_uncovered(this->checkpoint_buffer_indices_.size(), 0);
+        for (auto nd : this->postorder_nodes_) {
+            if (nd->is_leaf() || nd == this->head_node_) {
+                continue;
+            }
+            int uncovered = 1
+                + num_uncovered[nd->first_child().get_index()]
+                + num_uncovered[nd->last_child().get_index()];
+            if (uncovered >= spacing) {
+                this->checkpoint_buffer_indices_[nd->data().get_index()] = this->get_budget_partials_buffer_index(
+                        this->num_working_partials_buffers_ + this->num_checkpoint_nodes_);
+                ++this->num_checkpoint_nodes_;
+                uncovered = 0;
+            }
+            num_uncovered[nd->data().get_index()] = uncovered;
+        }
+        TREESHREW_ASSERT(this->num_checkpoint_nodes_ <= static_cast<unsigned long>(num_checkpoint_buffers));
+    }
+    this->working_buffer_needs_.assign(this->checkpoint_buffer_indices_.size(), 0);
+    this->is_child_order_reversed_.assign(this->checkpoint_buffer_indices_.size(), false);
+    // checkpoint buffers hold nothing yet
+    this->flag_all_as_dirty();
+}
+
+void GeneTree::begin_proposal() {
+    if (this->is_batched()) {
+        treeshrew_abort("Proposals are not available on trees in a batched BEAGLE instance");
+    }
+    if (this->is_proposal_active_) {
+        this->accept_proposal();
+    }
+    // the stored state must be fully calculated
+    this->stored_ln_probability_ = this->calc_ln_probability();
+    this->stored_site_rate_model_ = this->site_rate_model_;
+    this->stored_substitution_model_ = this->substitution_model_;
+    this->stored_eigen_index_ = this->eigen_index_;
+    if (this->is_storing_site_ln_probabilities_) {
+        this->stored_pattern_ln_probabilities_ = this->pattern_ln_probabilities_;
+    }
+    this->is_proposal_active_ = true;
+}
+
+void GeneTree::accept_proposal() {
+    for (auto & nd : this->swapped_nodes_) {
+        nd->commit_buffer_slot();
+    }
+    this->swapped_nodes_.clear();
+    this->recalculated_nodes_.clear();
+    this->stored_edge_lengths_.clear();
+    this->is_proposal_active_ = false;
+}
+
+void GeneTree::reject_proposal() {
+    TREESHREW_ASSERT(this->is_proposal_active_);
+    for (auto & nd : this->swapped_nodes_) {
+        nd->swap_buffer_slot();
+    }
+    // restore in reverse order so the earliest stored value wins
+    for (auto sei = this->stored_edge_lengths_.rbegin(); sei != this->stored_edge_lengths_.rend(); ++sei) {
+        sei->first->data().set_edge_length(sei->second);
+    }
+    // buffers are back to the (clean) state at the start of the proposal
+    for (auto & nd : this->swapped_nodes_) {
+        nd->set_dirty(false);
+    }
+    for (auto & stored_edge_length : this->stored_edge_lengths_) {
+        for (GeneTreeNode * nd = stored_edge_length.first; nd; nd = nd->parent_node()) {
+            nd->data().set_dirty(false);
+        }
+    }
+    // the restored buffers were calculated under the stored rates, so
+    // these are re-uploaded without flagging anything as dirty
+    this->site_rate_model_ = this->stored_site_rate_model_;
+    this->upload_site_rate_model();
+    // the stored eigen buffer was left untouched
+    this->substitution_model_ = this->stored_substitution_model_;
+    this->eigen_index_ = this->stored_eigen_index_;
+    this->uploaded_substitution_model_version_ = this->substitution_model_.get_version();
+    this->are_invariant_probabilities_current_ = false;
+    this->swapped_nodes_.clear();
+    this->stored_edge_lengths_.clear();
+    // without alternate slots, partials recalculated during the proposal
+    // need recalculating for the restored state
+    for (auto & nd : this->recalculated_nodes_) {
+        nd->flag_as_dirty();
+    }
+    this->recalculated_nodes_.clear();
+    this->ln_probability_ = this->stored_ln_probability_;
+    // upper partials are not double-buffered
+    this->are_upper_partials_current_ = false;
+    if (this->is_storing_site_ln_probabilities_) {
+        this->pattern_ln_probabilities_.swap(this->stored_pattern_ln_probabilities_);
+    }
+    this->is_proposal_active_ = false;
+}
+
+int GeneTree::create_beagle_instance(int num_patterns, int num_compact_tips, int num_batch_trees) {
     this->free_beagle_instance();
-    this->beagle_return_info_ = new BeagleInstanceDetails();
-    int num_tip_nodes = this->max_tips_ * 2;
-    int num_internal_nodes = num_tip_nodes + 1;
+    int num_tip_nodes = this->num_tip_nodes_;
+    int num_internal_nodes = this->num_internal_nodes_;
     int total_nodes = num_tip_nodes + num_internal_nodes;
-    this->beagle_instance_ = beagleCreateInstance(
-        num_tip_nodes,          // Number of tip data elements (input)
-        num_internal_nodes,     // Number of partials buffers to create (input) -- internal node count
-        num_tip_nodes,          // Number of compact state representation buffers to create -- for use with setTipStates (input)
-        4,                      // Number of states in the continuous-time Markov chain (input) -- DNA
-        num_sites,              // Number of site patterns to be handled by the instance (input) -- not compressed in this case
-        1,                      // Number of eigen-decomposition buffers to allocate (input)
-        total_nodes,            // Number of transition matrix buffers (input) -- one per edge
-        1,                      // Number of rate categories
-        0,                      // Number of scaling buffers -- can be zero if scaling is not needed
-        NULL,                   // List of potential resource on which this instance is allowed (input, NULL implies no restriction
-        0,                      // Length of resourceList list (input) -- not needed to use the default hardware config
-        0,                      // Bit-flags indicating preferred implementation charactertistics, see BeagleFlags (input)
-        0,                      // Bit-flags indicating required implementation characteristics, see BeagleFlags (input)
-        this->beagle_return_info_
-        );
-    if (this->beagle_instance_ < 0) {
-        treeshrew_abort("Failed to obtain BEAGLE instance");
-    }
-
-    // let all sites have equal weight
-    std::vector<double> pattern_weights( num_sites, 1 );
-    beagleSetPatternWeights(this->beagle_instance_, pattern_weights.data());
-
-    // create array of state background frequencies
-    double freqs[4] = { 0.25, 0.25, 0.25, 0.25 };
-    beagleSetStateFrequencies(this->beagle_instance_, 0, freqs);
-
-    // create an array containing site category weights and rates
-    const double weights[1] = { 1.0 };
-    const double rates[1] = { 1.0 };
-    beagleSetCategoryWeights(this->beagle_instance_, 0, weights);
-    beagleSetCategoryRates(this->beagle_instance_, rates);
-
-
-    double evec[4 * 4] = {
-        1.0,  2.0,  0.0,  0.5,
-        1.0,  -2.0,  0.5,  0.0,
-        1.0,  2.0, 0.0,  -0.5,
-        1.0,  -2.0,  -0.5,  0.0
-    };
+    this->num_patterns_ = num_patterns;
+    this->num_rate_categories_ = this->site_rate_model_.get_num_gamma_categories();
+    BeagleInstanceSpec spec;
+    spec.num_tips = num_tip_nodes;                                      // Number of tip data elements
+    if (num_compact_tips < 0 || num_compact_tips > num_tip_nodes) {
+        num_compact_tips = num_tip_nodes;
+    }
+    // tip buffers count against the partials and compact buffers alike
+    spec.num_partials_buffers = num_internal_nodes * 2 + total_nodes + 1   // Two slots per internal node, upper partials per node, and ones
+        + num_tip_nodes - num_compact_tips;                             // Tips with partials
+    spec.num_matrix_buffers = total_nodes * 2 + 4;                      // Two slots per edge, identity, and edge evaluation scratch
+    this->num_budget_partials_buffers_ = 0;
+    this->num_batch_trees_ = std::max(num_batch_trees, 1);
+    this->batch_index_ = 0;
+    if (this->is_batched()) {
+        if (this->beagle_settings_.get_partials_memory_budget() > 0) {
+            treeshrew_abort("Batched BEAGLE instances cannot have a partials memory budget");
+        }
+        // a single slot per internal node and edge of each tree
+        spec.num_partials_buffers = num_internal_nodes * this->num_batch_trees_
+            + num_tip_nodes - num_compact_tips;
+        spec.num_matrix_buffers = total_nodes * this->num_batch_trees_;
+    }
+    if (this->beagle_settings_.get_partials_memory_budget() > 0) {
+        int num_working_buffers = this->get_min_partials_memory_budget() / this->get_partials_buffer_size();
+        unsigned long num_budget_buffers = this->beagle_settings_.get_partials_memory_budget() / this->get_partials_buffer_size();
+        if (num_budget_buffers < static_cast<unsigned long>(num_working_buffers)) {
+            treeshrew_abort("Partials memory budget of ", this->beagle_settings_.get_partials_memory_budget(),
+                    " bytes is too small: at least ", this->get_min_partials_memory_budget(),
+                    " bytes are needed");
+        }
+        // beyond a checkpoint per internal node, more buffers are of no use
+        num_budget_buffers = std::min(num_budget_buffers, static_cast<unsigned long>(num_working_buffers + num_internal_nodes));
+        this->num_budget_partials_buffers_ = num_budget_buffers;
+        this->num_working_partials_buffers_ = num_working_buffers;
+        spec.num_partials_buffers = num_budget_buffers
+            + num_tip_nodes - num_compact_tips;
+        // checkpoints are assigned along with the schedule
+        this->is_schedule_valid_ = false;
+    }
+    spec.num_compact_buffers = num_compact_tips;                        // Tips with states (setTipStates)
+    spec.num_states = 4;                                                // DNA
+    spec.num_patterns = num_patterns;
+    spec.num_eigen_buffers = 2;                                         // Current and stored models
+    spec.num_categories = this->num_rate_categories_;
+    spec.num_scaling_buffers = 0;
+    spec.resources = this->beagle_settings_.get_resources();
+    spec.preference_flags = this->beagle_settings_.get_preference_flags();
+    spec.requirement_flags = this->beagle_settings_.get_requirement_flags();
+    spec.native_engine = this->beagle_settings_.is_native_engine();
+    spec.num_threads = this->beagle_settings_.get_num_threads();
+    this->pooled_instance_ = BeagleInstancePool::get_pool().check_out(spec);
+    if (!this->pooled_instance_) {
+        treeshrew_abort("Failed to obtain BEAGLE instance with required characteristics: ",
+                BeagleSettings::describe_flags(this->beagle_settings_.get_requirement_flags()));
+    }
+    this->beagle_instance_ = this->pooled_instance_->instance;
+    this->engine_ = this->pooled_instance_->engine;
+    TREESHREW_DEBUG_OUTPUT("BEAGLE instance " << this->beagle_instance_ << ": "
+            << this->pooled_instance_->details.implName << " ("
+            << BeagleSettings::describe_flags(this->pooled_instance_->details.flags) << ")" << std::endl);
+    this->site_ln_probabilities_.assign(num_patterns, 0.0);
+    this->site_first_derivatives_.assign(num_patterns, 0.0);
+    this->site_second_derivatives_.assign(num_patterns, 0.0);
+    this->pattern_ln_probabilities_.assign(num_patterns, 0.0);
+    this->are_invariant_probabilities_current_ = false;
+    this->are_upper_partials_current_ = false;
+    // matrix buffers may hold another tree's matrices
+    this->matrix_keys_.assign(spec.num_matrix_buffers, {0.0, 0, 0, 0});
+    for (int tip_idx = 0; tip_idx < num_tip_nodes; ++tip_idx) {
+        this->tip_buffer_indices_[tip_idx] = tip_idx;
+    }
+    this->is_tip_data_shared_ = false;
 
-    // JC69 model inverse eigenvector matrix
-    double ivec[4 * 4] = {
-        0.25,  0.25,  0.25,  0.25,
-        0.125,  -0.125,  0.125,  -0.125,
-        0.0,  1.0,  0.0,  -1.0,
-        1.0,  0.0,  -1.0,  0.0
-    };
+    if (this->pooled_instance_->tip_data_id == 0) {
+        // let all patterns have equal weight until told otherwise
+        this->pooled_instance_->tip_buffer_indices.clear();
+        this->release_compact_tip_buffers();
+        this->pooled_instance_->pattern_weights.assign(num_patterns, 1.0);
+        this->engine_->set_pattern_weights(this->pooled_instance_->pattern_weights.data());
+    }
 
-    // JC69 model eigenvalues
-    double eval[4] = { 0.0, -1.3333333333333333, -1.3333333333333333, -1.3333333333333333 };
+    this->upload_site_rate_model();
+    this->eigen_index_ = 0;
+    this->upload_substitution_model();
 
-    int ret_code = beagleSetEigenDecomposition(
-            this->beagle_instance_,                 // instance
-            0,                               // eigenIndex,
-            (const double *)evec,            // inEigenVectors,
-            (const double *)ivec,            // inInverseEigenVectors,
-            eval);                           // inEigenValues
+    if (this->pooled_instance_->has_fixed_buffers || this->is_partials_memory_bounded() || this->is_batched()) {
+        // (there are no upper partials under a budget or in a batch)
+        this->flag_all_as_dirty();
+        return this->beagle_instance_;
+    }
 
+    // fixed buffers for the upper partials of the children of the root
+    std::vector<double> identity_matrix(16 * this->num_rate_categories_, 0.0);
+    for (unsigned int cat = 0; cat < this->num_rate_categories_; ++cat) {
+        for (unsigned int state_idx = 0; state_idx < 4; ++state_idx) {
+            identity_matrix[cat * 16 + state_idx * 4 + state_idx] = 1.0;
+        }
+    }
+    int ret_code = this->engine_->set_transition_matrix(this->get_identity_matrix_buffer_index(),
+            identity_matrix.data(),
+            1.0);
     if (ret_code != 0) {
-        treeshrew_abort("Failed to set eigen decomposition");
+        treeshrew_abort("Failed to set identity transition matrix");
+    }
+    std::vector<double> ones(4 * num_patterns * this->num_rate_categories_, 1.0);
+    ret_code = this->engine_->set_partials(this->get_ones_partials_buffer_index(),
+            ones.data());
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to set root upper partials");
     }
+    this->pooled_instance_->has_fixed_buffers = true;
+
+    // nothing has been calculated on the new instance yet
+    this->flag_all_as_dirty();
 
     return this->beagle_instance_;
 }
 
-int GeneTree::set_tip_states(const GeneNodeData& tip, const int * data) {
-    int beagle_index = tip.get_index() ;
-    int ret_code = beagleSetTipStates(
-            this->beagle_instance_,
-            beagle_index,
+void GeneTree::join_beagle_instance(GeneTree * batch_tree, int batch_idx) {
+    TREESHREW_ASSERT(batch_tree->pooled_instance_ && batch_tree->batch_index_ == 0);
+    TREESHREW_ASSERT(batch_idx > 0 && batch_idx < batch_tree->num_batch_trees_);
+    if (this->max_tips_ != batch_tree->max_tips_) {
+        treeshrew_abort("Trees sharing a BEAGLE instance need the same maximum number of tips (",
+                this->max_tips_, " and ", batch_tree->max_tips_, ")");
+    }
+    if (this->site_rate_model_.get_num_gamma_categories() != batch_tree->num_rate_categories_) {
+        treeshrew_abort("Number of rate categories (", this->site_rate_model_.get_num_gamma_categories(),
+                ") does not match that of the BEAGLE instance (", batch_tree->num_rate_categories_, ")");
+    }
+    this->free_beagle_instance();
+    this->pooled_instance_ = batch_tree->pooled_instance_;
+    this->beagle_instance_ = batch_tree->beagle_instance_;
+    this->engine_ = batch_tree->engine_;
+    this->num_batch_trees_ = batch_tree->num_batch_trees_;
+    this->batch_index_ = batch_idx;
+    this->num_budget_partials_buffers_ = 0;
+    this->num_patterns_ = batch_tree->num_patterns_;
+    this->num_rate_categories_ = batch_tree->num_rate_categories_;
+    this->site_ln_probabilities_.assign(this->num_patterns_, 0.0);
+    this->site_first_derivatives_.assign(this->num_patterns_, 0.0);
+    this->site_second_derivatives_.assign(this->num_patterns_, 0.0);
+    this->pattern_ln_probabilities_.assign(this->num_patterns_, 0.0);
+    this->are_invariant_probabilities_current_ = false;
+    this->are_upper_partials_current_ = false;
+    this->matrix_keys_.assign(this->pooled_instance_->spec.num_matrix_buffers, {0.0, 0, 0, 0});
+    for (int tip_idx = 0; tip_idx < this->num_tip_nodes_; ++tip_idx) {
+        this->tip_buffer_indices_[tip_idx] = tip_idx;
+    }
+    this->is_tip_data_shared_ = false;
+    // (re-)uploading the models into the shared buffers is harmless, as
+    // all trees in the instance have the same ones
+    this->upload_site_rate_model();
+    this->eigen_index_ = 0;
+    this->upload_substitution_model();
+    // operations hold the buffer indices of the previous instance
+    this->flag_topology_as_dirty();
+}
+
+unsigned long GeneTree::get_partials_buffer_size() const {
+    // single precision instances need only half of this
+    return static_cast<unsigned long>(this->num_patterns_) * this->num_rate_categories_ * 4 * sizeof(double);
+}
+
+unsigned long GeneTree::get_min_partials_memory_budget() const {
+    // working buffers for pruning any tree of up to ``max_tips`` tips
+    // without checkpoints: a balanced tree holds a partials buffer per
+    // level while pruning its deepest path, plus the result
+    unsigned long num_working_buffers = 3;
+    for (unsigned long num_tips = 2; num_tips <= this->max_tips_; num_tips *= 2) {
+        ++num_working_buffers;
+    }
+    return num_working_buffers * this->get_partials_buffer_size();
+}
+
+void GeneTree::write_beagle_instance_details(std::ostream& out) const {
+    const BeagleInstanceDetails * details = this->get_beagle_instance_details();
+    if (!details) {
+        out << "BEAGLE instance: none" << std::endl;
+        return;
+    }
+    out << "BEAGLE instance: " << this->beagle_instance_ << std::endl;
+    out << "    Resource: " << details->resourceNumber
+        << " (" << details->resourceName << ")" << std::endl;
+    out << "    Implementation: " << details->implName << std::endl;
+    out << "    Flags: " << BeagleSettings::describe_flags(details->flags) << std::endl;
+}
+
+void GeneTree::set_site_rate_model(const SiteRateModel& site_rate_model) {
+    this->site_rate_model_ = site_rate_model;
+    if (this->beagle_instance_ >= 0) {
+        this->upload_site_rate_model();
+        this->flag_all_as_dirty();
+    }
+}
+
+void GeneTree::upload_site_rate_model() {
+    if (this->site_rate_model_.get_num_gamma_categories() != this->num_rate_categories_) {
+        treeshrew_abort("Number of rate categories (", this->site_rate_model_.get_num_gamma_categories(),
+                ") does not match that of the BEAGLE instance (", this->num_rate_categories_, ")");
+    }
+    // the invariant-sites category is not given to BEAGLE: a zero rate would
+    // rely on V V^{-1} being exactly the identity, which does not hold for
+    // numerically decomposed rate matrices; it is mixed in at the root
+    // instead (see ``calc_ln_probability_with_invariant_sites()``)
+    const std::vector<double>& category_weights = this->site_rate_model_.get_category_weights();
+    double variable_weight = 1.0 - this->site_rate_model_.get_proportion_invariant();
+    std::vector<double> gamma_weights(this->num_rate_categories_);
+    for (unsigned int cat = 0; cat < this->num_rate_categories_; ++cat) {
+        gamma_weights[cat] = category_weights[cat] / variable_weight;
+    }
+    int ret_code = this->engine_->set_category_weights(0, gamma_weights.data());
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to set category weights");
+    }
+    ret_code = this->engine_->set_category_rates(this->site_rate_model_.get_category_rates().data());
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to set category rates");
+    }
+    this->uploaded_site_rate_model_version_ = this->site_rate_model_.get_version();
+}
+
+void GeneTree::set_substitution_model(const SubstitutionModel& substitution_model) {
+    this->substitution_model_ = substitution_model;
+    if (this->beagle_instance_ >= 0) {
+        this->upload_substitution_model();
+        this->flag_all_as_dirty();
+    }
+}
+
+void GeneTree::upload_substitution_model() {
+    if (this->is_proposal_active_ && this->eigen_index_ == this->stored_eigen_index_) {
+        // preserve the stored model's buffer
+        this->eigen_index_ = 1 - this->eigen_index_;
+    }
+    const EigenSystem& eigen_system = this->substitution_model_.get_eigen_system();
+    int ret_code = this->engine_->set_eigen_decomposition(
+            this->eigen_index_,
+            eigen_system.eigenvectors.data(),
+            eigen_system.inverse_eigenvectors.data(),
+            eigen_system.eigenvalues.data());
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to set eigen decomposition");
+    }
+    // state frequency buffers are paired with the eigen buffers
+    ret_code = this->engine_->set_state_frequencies(this->eigen_index_,
+            this->substitution_model_.get_state_frequencies().data());
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to set state frequencies");
+    }
+    this->uploaded_substitution_model_version_ = this->substitution_model_.get_version();
+    this->are_invariant_probabilities_current_ = false;
+}
+
+int GeneTree::set_pattern_weights(const double * weights) {
+    int ret_code = this->engine_->set_pattern_weights(weights);
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to set pattern weights");
+    }
+    this->pooled_instance_->pattern_weights.assign(weights, weights + this->num_patterns_);
+    // the instance no longer holds a shared data set's weights
+    this->pooled_instance_->tip_data_id = 0;
+    // weights only enter at the root
+    this->head_node_->data().flag_as_dirty();
+    return ret_code;
+}
+
+int GeneTree::set_tip_states(GeneNodeData& tip, const int * data) {
+    this->use_unshared_tip_data();
+    this->upload_tip_states(tip.get_index(), data);
+    tip.flag_as_dirty();
+    return 0;
+}
+
+int GeneTree::set_tip_partials(GeneNodeData& tip, const double * data) {
+    this->use_unshared_tip_data();
+    this->upload_tip_partials(tip.get_index(), data);
+    tip.flag_as_dirty();
+    return 0;
+}
+
+void GeneTree::use_unshared_tip_data() {
+    if (this->batch_index_ > 0) {
+        // the tip buffers belong to the first tree of the batch
+        treeshrew_abort("Trees joining a batched BEAGLE instance can only map its shared tip data");
+    }
+    if (this->is_tip_data_shared_) {
+        for (int tip_idx = 0; tip_idx < this->num_tip_nodes_; ++tip_idx) {
+            this->tip_buffer_indices_[tip_idx] = tip_idx;
+        }
+        this->is_tip_data_shared_ = false;
+    }
+    if (!this->pooled_instance_->tip_buffer_indices.empty()) {
+        // shared tip data will be overwritten
+        this->release_compact_tip_buffers();
+    }
+    if (this->pooled_instance_->tip_data_id != 0) {
+        // the instance still holds the shared data set's weights: let all
+        // patterns have equal weight until told otherwise
+        this->pooled_instance_->pattern_weights.assign(this->num_patterns_, 1.0);
+        this->engine_->set_pattern_weights(this->pooled_instance_->pattern_weights.data());
+        this->head_node_->data().flag_as_dirty();
+    }
+    this->pooled_instance_->tip_data_id = 0;
+    this->pooled_instance_->tip_buffer_indices.clear();
+}
+
+void GeneTree::release_compact_tip_buffers() {
+    this->pooled_instance_->compact_tip_buffers.assign(this->num_tip_nodes_, false);
+    this->pooled_instance_->num_compact_tip_buffers = 0;
+}
+
+void GeneTree::upload_tip_states(int buffer_index, const int * data) {
+    PooledBeagleInstance * pooled_instance = this->pooled_instance_;
+    if (!pooled_instance->compact_tip_buffers[buffer_index]) {
+        if (pooled_instance->num_compact_tip_buffers >= pooled_instance->spec.num_compact_buffers) {
+            treeshrew_abort("No compact tip buffers left for buffer index ", buffer_index,
+                    " (maximum: ", pooled_instance->spec.num_compact_buffers, ")");
+        }
+        pooled_instance->compact_tip_buffers[buffer_index] = true;
+        ++pooled_instance->num_compact_tip_buffers;
+    }
+    int ret_code = this->engine_->set_tip_states(
+            buffer_index,
             data
             );
     if (ret_code != 0) {
-        treeshrew_abort("Failed to set tip states for node index ", beagle_index);
+        treeshrew_abort("Failed to set tip states for buffer index ", buffer_index);
     }
-    return ret_code;
+    std::vector<unsigned char>& masks = this->pooled_instance_->tip_state_masks[buffer_index];
+    masks.resize(this->num_patterns_);
+    for (int pattern_idx = 0; pattern_idx < this->num_patterns_; ++pattern_idx) {
+        masks[pattern_idx] = data[pattern_idx] < 4 ? (1 << data[pattern_idx]) : ALL_STATES_MASK;
+    }
+    this->are_invariant_probabilities_current_ = false;
 }
 
-int GeneTree::set_tip_partials(const GeneNodeData& tip, const double * data) {
-    int beagle_index = tip.get_index() ;
-    int ret_code = beagleSetTipPartials(
-            this->beagle_instance_,
-            beagle_index,
+void GeneTree::upload_tip_partials(int buffer_index, const double * data) {
+    if (this->pooled_instance_->compact_tip_buffers[buffer_index]) {
+        this->pooled_instance_->compact_tip_buffers[buffer_index] = false;
+        --this->pooled_instance_->num_compact_tip_buffers;
+    }
+    int ret_code = this->engine_->set_tip_partials(
+            buffer_index,
             data
             );
     if (ret_code != 0) {
-        treeshrew_abort("Failed to set tip partials for node index ", beagle_index);
+        treeshrew_abort("Failed to set tip partials for buffer index ", buffer_index);
     }
-    return ret_code;
+    std::vector<unsigned char>& masks = this->pooled_instance_->tip_state_masks[buffer_index];
+    masks.resize(this->num_patterns_);
+    for (int pattern_idx = 0; pattern_idx < this->num_patterns_; ++pattern_idx) {
+        masks[pattern_idx] = 0;
+        for (unsigned int state_idx = 0; state_idx < 4; ++state_idx) {
+            if (data[pattern_idx * 4 + state_idx] > 0.0) {
+                masks[pattern_idx] |= (1 << state_idx);
+            }
+        }
+    }
+    this->are_invariant_probabilities_current_ = false;
+}
+
+bool GeneTree::map_tip_data(unsigned long data_id) {
+    TREESHREW_ASSERT(this->pooled_instance_);
+    if (data_id == 0 || this->pooled_instance_->tip_data_id != data_id) {
+        return false;
+    }
+    const std::map<std::string, int>& tip_buffer_indices = this->pooled_instance_->tip_buffer_indices;
+    for (auto leaf_iter = this->leaf_begin(); leaf_iter != this->leaf_end(); ++leaf_iter) {
+        if (tip_buffer_indices.find(leaf_iter->get_label()) == tip_buffer_indices.end()) {
+            return false;
+        }
+    }
+    for (auto leaf_iter = this->leaf_begin(); leaf_iter != this->leaf_end(); ++leaf_iter) {
+        this->tip_buffer_indices_[leaf_iter->get_index()] = tip_buffer_indices.find(leaf_iter->get_label())->second;
+        leaf_iter->flag_as_dirty();
+    }
+    this->is_tip_data_shared_ = true;
+    this->are_invariant_probabilities_current_ = false;
+    return true;
+}
+
+void GeneTree::load_tip_data(unsigned long data_id,
+        const double * pattern_weights,
+        const std::vector<TipData>& tip_data) {
+    TREESHREW_ASSERT(this->pooled_instance_);
+    if (static_cast<int>(tip_data.size()) > this->num_tip_nodes_) {
+        treeshrew_abort("Too many tip data sets for BEAGLE instance: ", tip_data.size(),
+                " (maximum: ", this->num_tip_nodes_, ")");
+    }
+    this->set_pattern_weights(pattern_weights);
+    this->use_unshared_tip_data();
+    this->release_compact_tip_buffers();
+    std::map<std::string, int>& tip_buffer_indices = this->pooled_instance_->tip_buffer_indices;
+    for (auto & tip : tip_data) {
+        int buffer_index = tip_buffer_indices.size();
+        tip_buffer_indices[tip.label] = buffer_index;
+        if (tip.states) {
+            this->upload_tip_states(buffer_index, tip.states);
+        } else {
+            this->upload_tip_partials(buffer_index, tip.partials);
+        }
+    }
+    this->pooled_instance_->tip_data_id = data_id;
 }
 
 double GeneTree::calc_ln_probability() {
-    std::vector<int> node_indices;
-    std::vector<double> edge_lens;
-    for (GeneTree::postorder_iterator ndi = this->postorder_begin(); ndi != this->postorder_end(); ++ndi) {
-        node_indices.push_back(ndi->get_index());
-        edge_lens.push_back(ndi->get_edge_length());
+    this->refresh_schedule_and_models();
+    if (this->is_partials_memory_bounded()) {
+        return this->calc_checkpointed_ln_probability();
+    }
+    const std::vector<int> * matrix_indices = nullptr;
+    const std::vector<double> * edge_lengths = nullptr;
+    const std::vector<BeagleOperation> * beagle_operations = nullptr;
+    if (!this->collect_dirty_operations(matrix_indices, edge_lengths, beagle_operations)) {
+        return this->ln_probability_;
     }
-    // tell BEAGLE to populate the transition matrices for the above edge lengthss
-    beagleUpdateTransitionMatrices(this->beagle_instance_,     // instance
-            0,             // eigenIndex
-            node_indices.data(),   // probabilityIndices
-            NULL,          // firstDerivativeIndices
-            NULL,          // secondDervativeIndices
-            edge_lens.data(),   // edgeLengths
-            node_indices.size());            // count
 
-    // create a list of partial likelihood update operations
-    // the order is [dest, sourceScaling, destScaling, source1, matrix1, source2, matrix2]
-    // these operations say: first peel node 0 and 1 to calculate the per-site partial likelihoods, and store them
-    // in buffer 3.  Then peel node 2 and buffer 3 and store the per-site partial likelihoods in buffer 4.
-    // BeagleOperation operations[2] = {
-    //     {3, BEAGLE_OP_NONE, BEAGLE_OP_NONE, 0, 0, 1, 1},
-    //     {4, BEAGLE_OP_NONE, BEAGLE_OP_NONE, 2, 2, 3, 3}
-    // };
-    std::vector<BeagleOperation> beagle_operations;
-    int ch1_idx = 0;
-    int ch2_idx = 0;
-    for (GeneTree::postorder_iterator ndi = this->postorder_begin(); ndi != this->postorder_end(); ++ndi) {
-        if (ndi.is_leaf()) {
-            continue;
+    // tell BEAGLE to populate the transition matrices for the above edge lengthss
+    int ret_code = 0;
+    if (!matrix_indices->empty()) {
+        ret_code = this->engine_->update_transition_matrices(
+                this->eigen_index_,             // eigenIndex
+                matrix_indices->data(),   // probabilityIndices
+                NULL,          // firstDerivativeIndices
+                NULL,          // secondDervativeIndices
+                edge_lengths->data(),   // edgeLengths
+                matrix_indices->size());            // count
+        if (ret_code != 0) {
+            treeshrew_abort("Failed to update transition matrices");
         }
-        ch1_idx = ndi.first_child().get_index();
-        ch2_idx = ndi.last_child().get_index();
-        // std::cerr << nd->get_index() << ": " << ch1_idx << ", " << ch2_idx << std::endl;
-        beagle_operations.push_back(
-                {ndi->get_index(), BEAGLE_OP_NONE, BEAGLE_OP_NONE, ch1_idx, ch1_idx, ch2_idx, ch2_idx}
-                );
+        this->num_transition_matrix_updates_ += matrix_indices->size();
     }
 
     // this invokes all the math to carry out the likelihood calculation
-    beagleUpdatePartials( this->beagle_instance_,      // instance
-            beagle_operations.data(),     // eigenIndex
-            beagle_operations.size(),              // operationCount
-            BEAGLE_OP_NONE);             // cumulative scale index
+    if (!beagle_operations->empty()) {
+        ret_code = this->engine_->update_partials(
+                beagle_operations->data(),     // operations
+                beagle_operations->size());             // operationCount
+        if (ret_code != 0) {
+            treeshrew_abort("Failed to update partials");
+        }
+    }
 
     // for (auto &nd : nodes) {
     //     std::cerr << nd->get_index() << ":";
@@ -178,36 +777,648 @@ double GeneTree::calc_ln_probability() {
     //     std::cerr << std::endl;
     // }
 
+    return this->finish_ln_probability();
+}
+
+void GeneTree::calc_ln_probabilities(const std::vector<GeneTree *>& trees,
+        std::vector<double>& ln_probabilities) {
+    ln_probabilities.assign(trees.size(), 0.0);
+    if (trees.empty()) {
+        return;
+    }
+    GeneTree * first_tree = trees[0];
+    for (auto & tree : trees) {
+        if (!tree->pooled_instance_ || tree->pooled_instance_ != first_tree->pooled_instance_) {
+            treeshrew_abort("Trees evaluated together need to share a batched BEAGLE instance");
+        }
+        if (tree->substitution_model_.get_version() != first_tree->substitution_model_.get_version()
+                || tree->site_rate_model_.get_version() != first_tree->site_rate_model_.get_version()) {
+            treeshrew_abort("Trees sharing a BEAGLE instance need to have the same models");
+        }
+    }
+    // the trees' buffers are disjoint, so their matrices and operations can
+    // be submitted together; all use eigen buffer 0, as batched trees have
+    // no proposals
+    std::vector<int> matrix_indices;
+    std::vector<double> edge_lengths;
+    std::vector<BeagleOperation> beagle_operations;
+    std::vector<bool> is_tree_dirty(trees.size(), false);
+    for (unsigned long tree_idx = 0; tree_idx < trees.size(); ++tree_idx) {
+        GeneTree * tree = trees[tree_idx];
+        tree->refresh_schedule_and_models();
+        const std::vector<int> * tree_matrix_indices = nullptr;
+        const std::vector<double> * tree_edge_lengths = nullptr;
+        const std::vector<BeagleOperation> * tree_operations = nullptr;
+        if (!tree->collect_dirty_operations(tree_matrix_indices, tree_edge_lengths, tree_operations)) {
+            continue;
+        }
+        is_tree_dirty[tree_idx] = true;
+        matrix_indices.insert(matrix_indices.end(), tree_matrix_indices->begin(), tree_matrix_indices->end());
+        edge_lengths.insert(edge_lengths.end(), tree_edge_lengths->begin(), tree_edge_lengths->end());
+        beagle_operations.insert(beagle_operations.end(), tree_operations->begin(), tree_operations->end());
+        tree->num_transition_matrix_updates_ += tree_matrix_indices->size();
+    }
+    LikelihoodEngine * engine = first_tree->engine_;
+    if (!matrix_indices.empty()) {
+        int ret_code = engine->update_transition_matrices(first_tree->eigen_index_,
+                matrix_indices.data(),
+                NULL,
+                NULL,
+                edge_lengths.data(),
+                matrix_indices.size());
+        if (ret_code != 0) {
+            treeshrew_abort("Failed to update transition matrices");
+        }
+    }
+    if (!beagle_operations.empty()) {
+        int ret_code = engine->update_partials(beagle_operations.data(), beagle_operations.size());
+        if (ret_code != 0) {
+            treeshrew_abort("Failed to update partials");
+        }
+    }
+    // a multi-root BEAGLE evaluation sums over the roots (as mixture
+    // components) rather than giving each its own log-likelihood, so roots
+    // are evaluated one tree at a time
+    for (unsigned long tree_idx = 0; tree_idx < trees.size(); ++tree_idx) {
+        GeneTree * tree = trees[tree_idx];
+        ln_probabilities[tree_idx] = is_tree_dirty[tree_idx] ? tree->finish_ln_probability() : tree->ln_probability_;
+    }
+}
+
+void GeneTree::refresh_schedule_and_models() {
+    if (!this->is_schedule_valid_) {
+        this->build_operation_schedule();
+    }
+    if (this->site_rate_model_.get_version() != this->uploaded_site_rate_model_version_) {
+        // every transition matrix depends on the category rates
+        this->upload_site_rate_model();
+        this->flag_all_as_dirty();
+    }
+    if (this->substitution_model_.get_version() != this->uploaded_substitution_model_version_) {
+        this->upload_substitution_model();
+        this->flag_all_as_dirty();
+    }
+}
+
+bool GeneTree::collect_dirty_operations(const std::vector<int> *& matrix_indices,
+        const std::vector<double> *& edge_lengths,
+        const std::vector<BeagleOperation> *& operations) {
+    // collect the edges and nodes that need recalculation; a node is dirty if
+    // it has been flagged or if any of its children are dirty, so flagging
+    // a single node is sufficient to invalidate the path to the root
+    this->dirty_nodes_.clear();
+    this->dirty_matrix_indices_.clear();
+    this->dirty_edge_lengths_.clear();
+    this->dirty_operations_.clear();
+    for (unsigned long pos = 0; pos < this->postorder_nodes_.size(); ++pos) {
+        GeneTreeNode * nd = this->postorder_nodes_[pos];
+        GeneNodeData & nd_data = nd->data();
+        if (!nd->is_leaf() && (nd->first_child().is_dirty() || nd->last_child().is_dirty())) {
+            nd_data.flag_as_dirty();
+        }
+        if (!nd_data.is_dirty()) {
+            continue;
+        }
+        if (this->is_proposal_active_ && !nd_data.is_buffer_slot_swapped()) {
+            // preserve the stored state in the current slot
+            nd_data.swap_buffer_slot();
+            this->swapped_nodes_.push_back(&nd_data);
+        }
+        this->matrix_indices_[pos] = this->get_matrix_buffer_index(nd_data);
+        this->edge_lengths_[pos] = nd_data.get_edge_length();
+        this->dirty_nodes_.push_back(&nd_data);
+        // the partials of an ancestor of a changed edge need
+        // recalculation, but usually not its own matrix
+        if (this->refresh_transition_matrix_key(this->matrix_indices_[pos], this->edge_lengths_[pos])) {
+            this->dirty_matrix_indices_.push_back(this->matrix_indices_[pos]);
+            this->dirty_edge_lengths_.push_back(this->edge_lengths_[pos]);
+        }
+        if (this->operation_indices_[pos] >= 0) {
+            // children have already been visited, so their slots are current
+            BeagleOperation& op = this->beagle_operations_[this->operation_indices_[pos]];
+            const GeneNodeData& ch1 = nd->first_child();
+            const GeneNodeData& ch2 = nd->last_child();
+            op.destinationPartials = this->get_partials_buffer_index(nd_data);
+            op.child1Partials = this->get_partials_buffer_index(ch1);
+            op.child1TransitionMatrix = this->get_matrix_buffer_index(ch1);
+            op.child2Partials = this->get_partials_buffer_index(ch2);
+            op.child2TransitionMatrix = this->get_matrix_buffer_index(ch2);
+            this->dirty_operations_.push_back(op);
+        }
+    }
+    if (this->dirty_nodes_.empty()) {
+        return false;
+    }
+    this->are_upper_partials_current_ = false;
+
+    // if everything is dirty, the cached schedule can be submitted as-is
+    matrix_indices = &this->dirty_matrix_indices_;
+    edge_lengths = &this->dirty_edge_lengths_;
+    operations = &this->dirty_operations_;
+    if (this->dirty_matrix_indices_.size() == this->postorder_nodes_.size()) {
+        matrix_indices = &this->matrix_indices_;
+        edge_lengths = &this->edge_lengths_;
+    }
+    if (this->dirty_nodes_.size() == this->postorder_nodes_.size()) {
+        operations = &this->beagle_operations_;
+    }
+    return true;
+}
+
+double GeneTree::finish_ln_probability() {
+    double logL = this->calc_root_ln_probability(this->get_partials_buffer_index(this->head_node_->data()));
+
+    for (auto & nd : this->dirty_nodes_) {
+        nd->set_dirty(false);
+    }
+    this->ln_probability_ = logL;
+    return logL;
+}
+
+double GeneTree::calc_root_ln_probability(int buffer_index) {
     double logL = 0;
-    int root_index[1] = {this->head_node_->data().get_index()};
-    int category_weight_index[1] = {0};
-    int state_freq_index[1] = {0};
-    int cumulative_scale_index[1] = {BEAGLE_OP_NONE};
 
     // calculate the site likelihoods at the root node
     // this integrates the per-site root partial likelihoods across sites, background state frequencies, and rate categories
     // results in a single log likelihood, output here into logL
-    beagleCalculateRootLogLikelihoods(this->beagle_instance_,               // instance
-            root_index,// bufferIndices
-            category_weight_index,                // weights
-            state_freq_index,                 // stateFrequencies
-            cumulative_scale_index,     // scaleBuffer to use
-            1,                      // count
-            &logL);         // outLogLikelihoods
+    int ret_code = this->engine_->calculate_root_log_likelihood(
+            buffer_index,           // bufferIndex
+            0,                      // weights
+            this->eigen_index_,     // stateFrequencies
+            &logL);         // outLogLikelihood
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to calculate root log-likelihood");
+    }
+    if (this->site_rate_model_.has_invariant_sites()) {
+        logL = this->calc_ln_probability_with_invariant_sites(nullptr, nullptr,
+                this->is_storing_site_ln_probabilities_ ? this->pattern_ln_probabilities_.data() : nullptr);
+    } else if (this->is_storing_site_ln_probabilities_) {
+        ret_code = this->engine_->get_site_log_likelihoods(this->pattern_ln_probabilities_.data());
+        if (ret_code != 0) {
+            treeshrew_abort("Failed to get site log-likelihoods");
+        }
+    }
+    return logL;
+}
 
+double GeneTree::calc_checkpointed_ln_probability() {
+    // as in ``calc_ln_probability()``, but with a single matrix slot, and
+    // with working buffers (sized by ``working_buffer_needs_``) for the
+    // partials of nodes that are not checkpoints
+    this->dirty_nodes_.clear();
+    this->dirty_matrix_indices_.clear();
+    this->dirty_edge_lengths_.clear();
+    for (unsigned long pos = 0; pos < this->postorder_nodes_.size(); ++pos) {
+        GeneTreeNode * nd = this->postorder_nodes_[pos];
+        GeneNodeData & nd_data = nd->data();
+        if (!nd->is_leaf() && (nd->first_child().is_dirty() || nd->last_child().is_dirty())) {
+            nd_data.flag_as_dirty();
+        }
+        int need = 0;
+        if (!nd->is_leaf() && (nd_data.is_dirty() || this->checkpoint_buffer_indices_[nd_data.get_index()] < 0)) {
+            // the result takes a working buffer unless it is a checkpoint,
+            // and whichever child is recalculated first is held while the
+            // other is
+            const GeneNodeData& ch1 = nd->first_child();
+            const GeneNodeData& ch2 = nd->last_child();
+            int need1 = this->working_buffer_needs_[ch1.get_index()];
+            int need2 = this->working_buffer_needs_[ch2.get_index()];
+            int held1 = !nd->first_child_node()->is_leaf() && this->checkpoint_buffer_indices_[ch1.get_index()] < 0;
+            int held2 = !nd->last_child_node()->is_leaf() && this->checkpoint_buffer_indices_[ch2.get_index()] < 0;
+            int own = this->checkpoint_buffer_indices_[nd_data.get_index()] < 0;
+            int need_forward = std::max(std::max(need1, held1 + need2), held1 + held2 + own);
+            int need_reversed = std::max(std::max(need2, held2 + need1), held1 + held2 + own);
+            need = std::min(need_forward, need_reversed);
+            this->is_child_order_reversed_[nd_data.get_index()] = need_reversed < need_forward;
+        }
+        this->working_buffer_needs_[nd_data.get_index()] = need;
+        if (!nd_data.is_dirty()) {
+            continue;
+        }
+        this->dirty_nodes_.push_back(&nd_data);
+        if (this->refresh_transition_matrix_key(this->matrix_indices_[pos], nd_data.get_edge_length())) {
+            this->dirty_matrix_indices_.push_back(this->matrix_indices_[pos]);
+            this->dirty_edge_lengths_.push_back(nd_data.get_edge_length());
+        }
+    }
+    if (this->dirty_nodes_.empty()) {
+        return this->ln_probability_;
+    }
+    this->are_upper_partials_current_ = false;
+    if (this->working_buffer_needs_[this->head_node_->data().get_index()] > this->num_working_partials_buffers_) {
+        treeshrew_abort("Tree needs ", this->working_buffer_needs_[this->head_node_->data().get_index()],
+                " working partials buffers (maximum: ", this->num_working_partials_buffers_, ")");
+    }
+
+    int ret_code = 0;
+    if (!this->dirty_matrix_indices_.empty()) {
+        ret_code = this->engine_->update_transition_matrices(
+                this->eigen_index_,
+                this->dirty_matrix_indices_.data(),
+                NULL,
+                NULL,
+                this->dirty_edge_lengths_.data(),
+                this->dirty_matrix_indices_.size());
+        if (ret_code != 0) {
+            treeshrew_abort("Failed to update transition matrices");
+        }
+        this->num_transition_matrix_updates_ += this->dirty_matrix_indices_.size();
+    }
+
+    this->dirty_operations_.clear();
+    this->free_working_buffers_.clear();
+    for (int buffer_idx = this->num_working_partials_buffers_ - 1; buffer_idx >= 0; --buffer_idx) {
+        this->free_working_buffers_.push_back(this->get_budget_partials_buffer_index(buffer_idx));
+    }
+    int root_buffer_index = this->append_checkpointed_operations(this->head_node_);
+    ret_code = this->engine_->update_partials(
+            this->dirty_operations_.data(),
+            this->dirty_operations_.size());
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to update partials");
+    }
+
+    double logL = this->calc_root_ln_probability(root_buffer_index);
+
+    for (auto & nd : this->dirty_nodes_) {
+        nd->set_dirty(false);
+        if (this->is_proposal_active_) {
+            this->recalculated_nodes_.push_back(nd);
+        }
+    }
+    this->ln_probability_ = logL;
     return logL;
-    return 0.0;
 }
 
-void GeneTree::free_beagle_instance() {
-    if (this->beagle_return_info_) {
-        delete this->beagle_return_info_;
+int GeneTree::append_checkpointed_operations(GeneTreeNode * nd) {
+    GeneNodeData& nd_data = nd->data();
+    if (nd->is_leaf()) {
+        return this->get_partials_buffer_index(nd_data);
     }
-    this->beagle_return_info_ = nullptr;
-    if (this->beagle_instance_ >= 0) {
-        beagleFinalizeInstance(this->beagle_instance_);
+    int checkpoint_buffer_index = this->checkpoint_buffer_indices_[nd_data.get_index()];
+    if (checkpoint_buffer_index >= 0 && !nd_data.is_dirty()) {
+        return checkpoint_buffer_index;
+    }
+    GeneTreeNode * ch1 = nd->first_child_node();
+    GeneTreeNode * ch2 = nd->last_child_node();
+    int ch1_buffer_index = 0;
+    int ch2_buffer_index = 0;
+    if (this->is_child_order_reversed_[nd_data.get_index()]) {
+        ch2_buffer_index = this->append_checkpointed_operations(ch2);
+        ch1_buffer_index = this->append_checkpointed_operations(ch1);
+    } else {
+        ch1_buffer_index = this->append_checkpointed_operations(ch1);
+        ch2_buffer_index = this->append_checkpointed_operations(ch2);
+    }
+    int buffer_index = checkpoint_buffer_index;
+    if (buffer_index < 0) {
+        TREESHREW_ASSERT(!this->free_working_buffers_.empty());
+        buffer_index = this->free_working_buffers_.back();
+        this->free_working_buffers_.pop_back();
+    }
+    this->dirty_operations_.push_back({
+            buffer_index,
+            BEAGLE_OP_NONE,
+            BEAGLE_OP_NONE,
+            ch1_buffer_index,
+            this->get_matrix_buffer_index(ch1->data()),
+            ch2_buffer_index,
+            this->get_matrix_buffer_index(ch2->data())
+            });
+    // operations run in order, so later ones may reuse the children's
+    // working buffers
+    for (auto ch : {ch1, ch2}) {
+        if (!ch->is_leaf() && this->checkpoint_buffer_indices_[ch->data().get_index()] < 0) {
+            this->free_working_buffers_.push_back(ch == ch1 ? ch1_buffer_index : ch2_buffer_index);
+        }
+    }
+    return buffer_index;
+}
+
+void GeneTree::calc_invariant_pattern_probabilities() {
+    // probability of each pattern being constant in the observed state(s),
+    // from the states compatible with all leaves
+    const std::vector<double>& state_freqs = this->substitution_model_.get_state_frequencies();
+    std::vector<unsigned char> constant_masks(this->num_patterns_, ALL_STATES_MASK);
+    for (auto leaf_iter = this->leaf_begin(); leaf_iter != this->leaf_end(); ++leaf_iter) {
+        const std::vector<unsigned char>& masks = this->pooled_instance_->tip_state_masks[this->tip_buffer_indices_[leaf_iter->get_index()]];
+        if (masks.empty()) {
+            // no data
+            continue;
+        }
+        for (int pattern_idx = 0; pattern_idx < this->num_patterns_; ++pattern_idx) {
+            constant_masks[pattern_idx] &= masks[pattern_idx];
+        }
+    }
+    this->invariant_pattern_probabilities_.assign(this->num_patterns_, 0.0);
+    for (int pattern_idx = 0; pattern_idx < this->num_patterns_; ++pattern_idx) {
+        for (unsigned int state_idx = 0; state_idx < 4; ++state_idx) {
+            if (constant_masks[pattern_idx] & (1 << state_idx)) {
+                this->invariant_pattern_probabilities_[pattern_idx] += state_freqs[state_idx];
+            }
+        }
+    }
+    this->are_invariant_probabilities_current_ = true;
+}
+
+bool GeneTree::refresh_transition_matrix_key(int matrix_index, double edge_length) {
+    TransitionMatrixKey& key = this->matrix_keys_[matrix_index];
+    if (key.edge_length == edge_length
+            && key.eigen_index == this->eigen_index_
+            && key.substitution_model_version == this->uploaded_substitution_model_version_
+            && key.site_rate_model_version == this->uploaded_site_rate_model_version_) {
+        return false;
+    }
+    key.edge_length = edge_length;
+    key.eigen_index = this->eigen_index_;
+    key.substitution_model_version = this->uploaded_substitution_model_version_;
+    key.site_rate_model_version = this->uploaded_site_rate_model_version_;
+    return true;
+}
+
+const std::vector<double>& GeneTree::calc_site_ln_probabilities() {
+    TREESHREW_ASSERT(this->is_storing_site_ln_probabilities_);
+    this->calc_ln_probability();
+    return this->pattern_ln_probabilities_;
+}
+
+double GeneTree::calc_ln_probability_with_invariant_sites(double * first_derivative,
+        double * second_derivative,
+        double * pattern_ln_probabilities) {
+    if (!this->are_invariant_probabilities_current_) {
+        this->calc_invariant_pattern_probabilities();
+    }
+    int ret_code = this->engine_->get_site_log_likelihoods(this->site_ln_probabilities_.data());
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to get site log-likelihoods");
+    }
+    if (first_derivative) {
+        ret_code = this->engine_->get_site_derivatives(this->site_first_derivatives_.data(),
+                this->site_second_derivatives_.data());
+        if (ret_code != 0) {
+            treeshrew_abort("Failed to get site derivatives");
+        }
+        *first_derivative = 0.0;
+        *second_derivative = 0.0;
+    }
+    double prop_invar = this->site_rate_model_.get_proportion_invariant();
+    double ln_variable_weight = std::log(1.0 - prop_invar);
+    double ln_prob = 0.0;
+    for (int pattern_idx = 0; pattern_idx < this->num_patterns_; ++pattern_idx) {
+        double ln_variable = ln_variable_weight + this->site_ln_probabilities_[pattern_idx];
+        double invariant = prop_invar * this->invariant_pattern_probabilities_[pattern_idx];
+        double site_ln_prob = ln_variable;
+        if (invariant > 0.0) {
+            double ln_invariant = std::log(invariant);
+            double ln_max = std::max(ln_variable, ln_invariant);
+            site_ln_prob = ln_max + std::log(std::exp(ln_variable - ln_max) + std::exp(ln_invariant - ln_max));
+        }
+        ln_prob += this->pooled_instance_->pattern_weights[pattern_idx] * site_ln_prob;
+        if (pattern_ln_probabilities) {
+            pattern_ln_probabilities[pattern_idx] = site_ln_prob;
+        }
+        if (first_derivative) {
+            // derivatives of the variable-sites component are relative to
+            // its own likelihood, so rescale by its share of the total
+            double share = std::exp(ln_variable - site_ln_prob);
+            double d1 = this->site_first_derivatives_[pattern_idx];
+            double d2 = this->site_second_derivatives_[pattern_idx];
+            *first_derivative += this->pooled_instance_->pattern_weights[pattern_idx] * share * d1;
+            *second_derivative += this->pooled_instance_->pattern_weights[pattern_idx]
+                * (share * (d2 + d1 * d1) - share * share * d1 * d1);
+        }
+    }
+    return ln_prob;
+}
+
+void GeneTree::append_upper_partials_operation(GeneTreeNode * nd) {
+    GeneTreeNode * parent = nd->parent_node();
+    GeneTreeNode * sibling = parent->first_child_node() == nd ? parent->last_child_node() : parent->first_child_node();
+    // the root has no upper partials of its own
+    bool is_root = parent == this->head_node_;
+    this->upper_operations_.push_back({
+            this->get_upper_partials_buffer_index(nd->data()),
+            BEAGLE_OP_NONE,
+            BEAGLE_OP_NONE,
+            this->get_partials_buffer_index(sibling->data()),
+            this->get_matrix_buffer_index(sibling->data()),
+            is_root ? this->get_ones_partials_buffer_index() : this->get_upper_partials_buffer_index(parent->data()),
+            is_root ? this->get_identity_matrix_buffer_index() : this->get_matrix_buffer_index(parent->data())
+            });
+}
+
+void GeneTree::update_upper_partials(GeneTreeNode * nd) {
+    TREESHREW_ASSERT(nd != this->head_node_);
+    if (this->is_partials_memory_bounded()) {
+        treeshrew_abort("Upper partials are not available under a partials memory budget");
+    }
+    if (this->is_batched()) {
+        treeshrew_abort("Upper partials are not available on trees in a batched BEAGLE instance");
+    }
+    this->calc_ln_probability();
+    if (this->are_upper_partials_current_) {
+        return;
+    }
+    // upper partials are calculated from the root down to ``nd``
+    this->upper_operations_.clear();
+    for (GeneTreeNode * child = nd; child != this->head_node_; child = child->parent_node()) {
+        this->append_upper_partials_operation(child);
+    }
+    std::reverse(this->upper_operations_.begin(), this->upper_operations_.end());
+    int ret_code = this->engine_->update_partials(this->upper_operations_.data(),
+            this->upper_operations_.size());
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to update upper partials");
+    }
+}
+
+void GeneTree::update_all_upper_partials() {
+    if (this->is_partials_memory_bounded()) {
+        treeshrew_abort("Upper partials are not available under a partials memory budget");
+    }
+    if (this->is_batched()) {
+        treeshrew_abort("Upper partials are not available on trees in a batched BEAGLE instance");
+    }
+    this->calc_ln_probability();
+    if (this->are_upper_partials_current_) {
+        return;
+    }
+    // reverse postorder visits each parent before its children
+    this->upper_operations_.clear();
+    for (auto ndi = this->postorder_nodes_.rbegin(); ndi != this->postorder_nodes_.rend(); ++ndi) {
+        if (*ndi != this->head_node_) {
+            this->append_upper_partials_operation(*ndi);
+        }
+    }
+    int ret_code = this->engine_->update_partials(this->upper_operations_.data(),
+            this->upper_operations_.size());
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to update upper partials");
+    }
+    this->are_upper_partials_current_ = true;
+}
+
+void GeneTree::calc_edge_ln_probabilities(std::vector<GeneTreeNode *>& nodes,
+        std::vector<double>& ln_probabilities) {
+    this->update_all_upper_partials();
+    nodes.clear();
+    ln_probabilities.clear();
+    for (auto nd : this->postorder_nodes_) {
+        if (nd == this->head_node_) {
+            continue;
+        }
+        // the edge's own (current) transition matrix, without derivatives
+        double ln_prob = 0.0;
+        int ret_code = this->engine_->calculate_edge_log_likelihood(
+                this->get_upper_partials_buffer_index(nd->data()),
+                this->get_partials_buffer_index(nd->data()),
+                this->get_matrix_buffer_index(nd->data()),
+                BEAGLE_OP_NONE,
+                BEAGLE_OP_NONE,
+                0,
+                this->eigen_index_,
+                &ln_prob,
+                nullptr,
+                nullptr);
+        if (ret_code != 0) {
+            treeshrew_abort("Failed to calculate edge log-likelihood");
+        }
+        if (this->site_rate_model_.has_invariant_sites()) {
+            ln_prob = this->calc_ln_probability_with_invariant_sites();
+        }
+        nodes.push_back(nd);
+        ln_probabilities.push_back(ln_prob);
+    }
+}
+
+double GeneTree::calc_edge_ln_probability(GeneTreeNode * nd,
+        double edge_length,
+        double& first_derivative,
+        double& second_derivative) {
+    int matrix_index = this->get_edge_matrix_buffer_index(0);
+    int first_derivative_index = this->get_edge_matrix_buffer_index(1);
+    int second_derivative_index = this->get_edge_matrix_buffer_index(2);
+    int ret_code = this->engine_->update_transition_matrices(this->eigen_index_,
+            &matrix_index,
+            &first_derivative_index,
+            &second_derivative_index,
+            &edge_length,
+            1);
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to update edge transition matrices");
+    }
+    double ln_prob = 0.0;
+    ret_code = this->engine_->calculate_edge_log_likelihood(
+            this->get_upper_partials_buffer_index(nd->data()),
+            this->get_partials_buffer_index(nd->data()),
+            matrix_index,
+            first_derivative_index,
+            second_derivative_index,
+            0,
+            this->eigen_index_,
+            &ln_prob,
+            &first_derivative,
+            &second_derivative);
+    if (ret_code != 0) {
+        treeshrew_abort("Failed to calculate edge log-likelihood");
+    }
+    if (this->site_rate_model_.has_invariant_sites()) {
+        ln_prob = this->calc_ln_probability_with_invariant_sites(&first_derivative, &second_derivative);
+    }
+    return ln_prob;
+}
+
+double GeneTree::calc_edge_ln_probability_derivatives(GeneTreeNode * nd,
+        double edge_length,
+        double& first_derivative,
+        double& second_derivative) {
+    this->update_upper_partials(nd);
+    return this->calc_edge_ln_probability(nd, edge_length, first_derivative, second_derivative);
+}
+
+double GeneTree::optimize_edge_length(GeneTreeNode * nd,
+        double tolerance,
+        unsigned int max_iterations) {
+    this->update_upper_partials(nd);
+    double edge_length = nd->data().get_edge_length();
+    double first_derivative = 0.0;
+    double second_derivative = 0.0;
+    double ln_prob = this->calc_edge_ln_probability(nd, edge_length, first_derivative, second_derivative);
+    for (unsigned int iteration = 0; iteration < max_iterations; ++iteration) {
+        double proposed_edge_length = 0.0;
+        if (second_derivative < 0.0) {
+            proposed_edge_length = edge_length - first_derivative / second_derivative;
+        } else if (first_derivative > 0.0) {
+            // not locally concave: follow the gradient
+            proposed_edge_length = edge_length * 2.0;
+        } else {
+            proposed_edge_length = edge_length * 0.5;
+        }
+        proposed_edge_length = std::min(std::max(proposed_edge_length, MIN_EDGE_LENGTH), MAX_EDGE_LENGTH);
+        double proposed_first_derivative = 0.0;
+        double proposed_second_derivative = 0.0;
+        double proposed_ln_prob = this->calc_edge_ln_probability(nd,
+                proposed_edge_length,
+                proposed_first_derivative,
+                proposed_second_derivative);
+        // backtrack if the step overshot
+        while (proposed_ln_prob < ln_prob && std::fabs(proposed_edge_length - edge_length) > tolerance) {
+            proposed_edge_length = 0.5 * (proposed_edge_length + edge_length);
+            proposed_ln_prob = this->calc_edge_ln_probability(nd,
+                    proposed_edge_length,
+                    proposed_first_derivative,
+                    proposed_second_derivative);
+        }
+        if (proposed_ln_prob < ln_prob) {
+            break;
+        }
+        bool is_converged = std::fabs(proposed_edge_length - edge_length) < tolerance;
+        edge_length = proposed_edge_length;
+        ln_prob = proposed_ln_prob;
+        first_derivative = proposed_first_derivative;
+        second_derivative = proposed_second_derivative;
+        if (is_converged) {
+            break;
+        }
+    }
+    if (edge_length != nd->data().get_edge_length()) {
+        this->set_edge_length(nd, edge_length);
+    }
+    return ln_prob;
+}
+
+double GeneTree::optimize_edge_lengths(double tolerance, unsigned int max_sweeps) {
+    if (!this->is_schedule_valid_) {
+        this->build_operation_schedule();
+    }
+    double ln_prob = this->calc_ln_probability();
+    for (unsigned int sweep = 0; sweep < max_sweeps; ++sweep) {
+        double sweep_ln_prob = ln_prob;
+        // preorder, so that consecutive edges share most of their path to the root
+        for (auto ndi = this->postorder_nodes_.rbegin(); ndi != this->postorder_nodes_.rend(); ++ndi) {
+            if (*ndi != this->head_node_) {
+                sweep_ln_prob = this->optimize_edge_length(*ndi);
+            }
+        }
+        TREESHREW_DEBUG_OUTPUT("Edge length optimization sweep " << sweep + 1 << ": " << sweep_ln_prob << std::endl);
+        bool is_converged = sweep_ln_prob - ln_prob < tolerance;
+        ln_prob = sweep_ln_prob;
+        if (is_converged) {
+            break;
+        }
+    }
+    return this->calc_ln_probability();
+}
+
+void GeneTree::free_beagle_instance() {
+    if (this->pooled_instance_ && this->batch_index_ == 0) {
+        BeagleInstancePool::get_pool().check_in(this->pooled_instance_);
     }
+    this->num_batch_trees_ = 1;
+    this->batch_index_ = 0;
+    this->pooled_instance_ = nullptr;
     this->beagle_instance_ = -1;
+    this->engine_ = nullptr;
 }
 
 } // treeshrew
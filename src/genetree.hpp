@@ -11,6 +11,8 @@
 #include <libhmsbeagle/beagle.h>
 #include "utility.hpp"
 #include "tree.hpp"
+#include "model.hpp"
+#include "beaglepool.hpp"
 
 namespace treeshrew {
 
@@ -23,12 +25,16 @@ class GeneNodeData {
             index_(index),
             edge_length_(0.0),
             is_dirty_(true),
-            ln_likelihood_(0.0) { }
+            ln_likelihood_(0.0),
+            buffer_slot_(0),
+            is_buffer_slot_swapped_(false) { }
 
         inline void clear() {
             this->edge_length_ = 0.0;
             this->is_dirty_ = true;
             this->ln_likelihood_ = 0.0;
+            this->buffer_slot_ = 0;
+            this->is_buffer_slot_swapped_ = false;
         }
 
         inline void set(int index, double edge_length_, const std::string& label, bool is_dirty) {
@@ -65,12 +71,30 @@ class GeneNodeData {
             return this->is_dirty_;
         }
 
+        // Each node owns two partials/transition matrix buffer slots; the
+        // current one is selected by a single bit.
+        inline int get_buffer_slot() const {
+            return this->buffer_slot_;
+        }
+        inline void swap_buffer_slot() {
+            this->buffer_slot_ ^= 1;
+            this->is_buffer_slot_swapped_ = !this->is_buffer_slot_swapped_;
+        }
+        inline void commit_buffer_slot() {
+            this->is_buffer_slot_swapped_ = false;
+        }
+        inline bool is_buffer_slot_swapped() const {
+            return this->is_buffer_slot_swapped_;
+        }
+
     private:
         int             index_;
         double          edge_length_;
         std::string     label_;
         bool            is_dirty_;
         double          ln_likelihood_;
+        int             buffer_slot_;
+        bool            is_buffer_slot_swapped_;
 
 }; // GeneNodeData
 
@@ -133,6 +157,110 @@ class RestrictedResourceAllocator {
         std::stack<T *>   available_;
 }; // RestrictedResourceAllocator
 
+////////////////////////////////////////////////////////////////////////////////
+// BeagleSettings
+
+// Implementation characteristics requested of BEAGLE when an instance is
+// created. Preferred characteristics are honored if available; required
+// characteristics cause instance creation to fail if unavailable. The
+// built-in ``NativeLikelihoodEngine`` can be selected in place of BEAGLE.
+class BeagleSettings {
+
+    public:
+        BeagleSettings()
+            : preference_flags_(0),
+              requirement_flags_(0),
+              is_native_engine_(false),
+              num_threads_(0),
+              partials_memory_budget_(0) { }
+
+        inline void set_vectorized(bool required=false) {
+            this->add_flags(BEAGLE_FLAG_VECTOR_SSE, required);
+        }
+        inline void set_threaded(bool required=false) {
+            this->add_flags(BEAGLE_FLAG_THREADING_OPENMP, required);
+        }
+        inline void set_single_precision(bool required=false) {
+            this->add_flags(BEAGLE_FLAG_PRECISION_SINGLE, required);
+        }
+        inline void set_double_precision(bool required=false) {
+            this->add_flags(BEAGLE_FLAG_PRECISION_DOUBLE, required);
+        }
+        inline void set_cpu(bool required=false) {
+            this->add_flags(BEAGLE_FLAG_PROCESSOR_CPU, required);
+        }
+        inline void set_native_engine(bool native_engine=true) {
+            this->is_native_engine_ = native_engine;
+        }
+        inline bool is_native_engine() const {
+            return this->is_native_engine_;
+        }
+        // Threads used by a threaded native engine (0 for one per hardware
+        // thread); BEAGLE sizes its own thread pool.
+        inline void set_num_threads(unsigned int num_threads) {
+            this->num_threads_ = num_threads;
+        }
+        inline unsigned int get_num_threads() const {
+            return this->num_threads_;
+        }
+        // Bytes available for the partials of internal nodes (0, the
+        // default, for no limit); see ``GeneTree::create_beagle_instance()``.
+        inline void set_partials_memory_budget(unsigned long num_bytes) {
+            this->partials_memory_budget_ = num_bytes;
+        }
+        inline unsigned long get_partials_memory_budget() const {
+            return this->partials_memory_budget_;
+        }
+        inline void add_resource(int resource) {
+            this->resources_.push_back(resource);
+        }
+        inline void add_flags(long flags, bool required=false) {
+            if (required) {
+                this->requirement_flags_ |= flags;
+            } else {
+                this->preference_flags_ |= flags;
+            }
+        }
+        inline long get_preference_flags() const {
+            return this->preference_flags_;
+        }
+        inline long get_requirement_flags() const {
+            return this->requirement_flags_;
+        }
+        inline const std::vector<int>& get_resources() const {
+            return this->resources_;
+        }
+        // Parses a comma-separated list of "sse", "threaded", "single",
+        // "double" or "cpu"; a trailing '!' makes a characteristic required
+        // (e.g., "sse!,threaded"). "native" selects the native engine,
+        // which keeps single precision partials with "single!" or with
+        // "single" alone, and prunes independent subtrees concurrently
+        // with "threaded".
+        void parse(const std::string& spec);
+
+        static std::string describe_flags(long flags);
+
+    private:
+        long                preference_flags_;
+        long                requirement_flags_;
+        std::vector<int>    resources_;
+        bool                is_native_engine_;
+        unsigned int        num_threads_;
+        unsigned long       partials_memory_budget_;
+
+}; // BeagleSettings
+
+////////////////////////////////////////////////////////////////////////////////
+// TipData
+
+// Data for the tip of a taxon: compact states if ``states`` is given,
+// otherwise partials.
+struct TipData {
+    std::string         label;
+    const int *         states;
+    const double *      partials;
+}; // TipData
+
 ////////////////////////////////////////////////////////////////////////////////
 // GeneTree
 
@@ -163,18 +291,403 @@ class GeneTree : public Tree<GeneNodeData> {
 
         void clear();
 
-        int create_beagle_instance(int num_sites);
-        int set_tip_states(const GeneNodeData& tip, const int * data);
-        int set_tip_partials(const GeneNodeData& tip, const double * data);
+        // Sets the length of the edge subtending ``nd`` and flags the path
+        // from ``nd`` to the root as requiring recalculation.
+        void set_edge_length(GeneTreeNode * nd, double edge_length);
+        // Flags ``nd`` and all its ancestors as requiring recalculation.
+        void flag_path_as_dirty(GeneTreeNode * nd);
+        void flag_all_as_dirty();
+        void clear_dirty_flags();
+        // Must be called after any change to the tree structure: discards
+        // the cached operation schedule and flags all nodes as dirty.
+        void flag_topology_as_dirty();
+
+        inline void set_beagle_settings(const BeagleSettings& settings) {
+            this->beagle_settings_ = settings;
+        }
+        inline const BeagleSettings& get_beagle_settings() const {
+            return this->beagle_settings_;
+        }
+        // Details of the implementation BEAGLE chose for the current
+        // instance (nullptr if no instance has been created).
+        inline const BeagleInstanceDetails * get_beagle_instance_details() const {
+            return this->pooled_instance_ ? &this->pooled_instance_->details : nullptr;
+        }
+        void write_beagle_instance_details(std::ostream& out) const;
+
+        // The number of rate categories is fixed when the BEAGLE instance is
+        // created; changes to the model parameters after that are picked up
+        // by the next ``calc_ln_probability()``, which then recalculates
+        // all nodes.
+        void set_site_rate_model(const SiteRateModel& site_rate_model);
+        // Changes to the substitution model parameters are picked up by the
+        // next ``calc_ln_probability()``. Within a proposal, a changed model
+        // is uploaded into the alternate eigen buffer, so that rejection
+        // only needs to switch back to the stored one.
+        void set_substitution_model(const SubstitutionModel& substitution_model);
+        inline SubstitutionModel& get_substitution_model() {
+            return this->substitution_model_;
+        }
+        inline const SubstitutionModel& get_substitution_model() const {
+            return this->substitution_model_;
+        }
+        inline SiteRateModel& get_site_rate_model() {
+            return this->site_rate_model_;
+        }
+        inline const SiteRateModel& get_site_rate_model() const {
+            return this->site_rate_model_;
+        }
+
+        // Proposals: between ``begin_proposal()`` and
+        // ``accept_proposal()``/``reject_proposal()``, recalculated nodes write
+        // into their alternate buffer slot, so that rejection only needs to
+        // swap the slots back (and restore edge lengths changed through
+        // ``set_edge_length()`` and the model parameters). Changes to tip
+        // data are not rolled back.
+        void begin_proposal();
+        void accept_proposal();
+        void reject_proposal();
+        inline bool is_proposal_active() const {
+            return this->is_proposal_active_;
+        }
+
+        // BEAGLE buffer indices for the current slot of ``nd``. Tips have a
+        // single partials buffer (their data, which may be shared with
+        // other trees), but two transition matrices.
+        inline int get_partials_buffer_index(const GeneNodeData& nd) const {
+            int index = nd.get_index();
+            if (index < this->num_tip_nodes_) {
+                return this->tip_buffer_indices_[index];
+            }
+            return index + (nd.get_buffer_slot() + this->batch_index_) * this->num_internal_nodes_;
+        }
+        inline int get_matrix_buffer_index(const GeneNodeData& nd) const {
+            return nd.get_index() + (nd.get_buffer_slot() + this->batch_index_) * (this->num_tip_nodes_ + this->num_internal_nodes_);
+        }
+
+        // Checks an instance out of the process-wide ``BeagleInstancePool``
+        // (returning any instance currently held); the instance is
+        // returned to the pool by ``free_beagle_instance()``. Up to
+        // ``num_compact_tips`` tips can then be given compact states
+        // (rather than partials), and the rest of their buffers go to
+        // partials; a negative number allows all tips compact states.
+        //
+        // With a partials memory budget (see ``BeagleSettings``), the
+        // instance has only as many internal partials buffers as fit in the
+        // budget: a few working buffers, enough to prune any tree of up to
+        // ``max_tips`` tips, and a buffer for each of a set of "checkpoint"
+        // nodes spread evenly over the tree. Only the partials of
+        // checkpoints are kept between calculations; those of other nodes
+        // are recalculated (from the nearest checkpoints below) whenever an
+        // ancestor needs them. Partials are not double-buffered, so a
+        // rejected proposal recalculates what it changed, and upper
+        // partials (edge log-likelihoods and edge length optimization) are
+        // not available.
+        //
+        // With ``num_batch_trees`` > 1, the instance has partials and
+        // transition matrices for that many trees, and up to
+        // ``num_batch_trees`` - 1 other trees (with the same ``max_tips``)
+        // can then use it through ``join_beagle_instance()``, to be
+        // evaluated together by ``calc_ln_probabilities()``. Each tree has
+        // a single buffer slot, so proposals and upper partials are not
+        // available.
+        int create_beagle_instance(int num_patterns, int num_compact_tips=-1, int num_batch_trees=1);
+        // Uses the buffers for the ``batch_idx``-th tree of the batched
+        // instance of ``batch_tree``, which needs to outlive this use (or
+        // have this tree join another instance, or call
+        // ``free_beagle_instance()``, first). Tip data can only be mapped
+        // from the data set loaded into the instance (see
+        // ``map_tip_data()``), and all trees in the instance need to have
+        // the same models (e.g. copies of the same models), as they share
+        // its eigen and category buffers.
+        void join_beagle_instance(GeneTree * batch_tree, int batch_idx);
+        inline bool is_batched() const {
+            return this->num_batch_trees_ > 1;
+        }
+        inline int get_num_batch_trees() const {
+            return this->num_batch_trees_;
+        }
+        inline bool is_partials_memory_bounded() const {
+            return this->num_budget_partials_buffers_ > 0;
+        }
+        // Bytes per partials buffer of the current instance
+        unsigned long get_partials_buffer_size() const;
+        // Smallest partials memory budget for the current instance's
+        // patterns and rate categories (with no checkpoints)
+        unsigned long get_min_partials_memory_budget() const;
+        // Nodes whose partials are kept under a partials memory budget
+        inline unsigned long get_num_checkpoint_nodes() const {
+            return this->num_checkpoint_nodes_;
+        }
+        inline int get_num_compact_tip_buffers() const {
+            return this->pooled_instance_ ? this->pooled_instance_->spec.num_compact_buffers : 0;
+        }
+        int set_pattern_weights(const double * weights);
+        // Tip data for individual leaves. This switches the tree from any
+        // shared tip data (see ``load_tip_data()``) back to a buffer per
+        // leaf, so all leaves need to be set. Compact states are a state
+        // index per pattern, with 4 (or more) for missing data.
+        int set_tip_states(GeneNodeData& tip, const int * data);
+        int set_tip_partials(GeneNodeData& tip, const double * data);
+        // Tip data shared between trees: ``load_tip_data()`` loads tip data
+        // (by taxon label) and pattern weights of the data set identified
+        // by ``data_id`` into the current instance, which then remembers
+        // them, and ``map_tip_data()`` points the leaves of this tree at
+        // that data. The latter returns false if the instance does not hold
+        // that data set (or lacks a leaf's label), in which case it needs
+        // to be loaded.
+        bool map_tip_data(unsigned long data_id);
+        void load_tip_data(unsigned long data_id,
+                const double * pattern_weights,
+                const std::vector<TipData>& tip_data);
+        inline int get_max_tip_data() const {
+            return this->num_tip_nodes_;
+        }
+        // Only transition matrices and partials of nodes flagged as dirty
+        // (or with dirty descendents) are recalculated; all flags are
+        // cleared on successful return.
         double calc_ln_probability();
+        // Log-likelihoods of ``trees``, all of which share a batched
+        // instance, in the same order: the transition matrices and partials
+        // of all trees are recalculated with a single call each, as if
+        // they were one tree, and only the root log-likelihoods are then
+        // calculated tree by tree.
+        static void calc_ln_probabilities(const std::vector<GeneTree *>& trees,
+                std::vector<double>& ln_probabilities);
+        // Number of transition matrices recalculated so far; those whose
+        // buffers still hold the matrix for the current edge length and
+        // model are reused.
+        inline unsigned long get_num_transition_matrix_updates() const {
+            return this->num_transition_matrix_updates_;
+        }
+        // If set, ``calc_ln_probability()`` also keeps the log-likelihood of
+        // each pattern (unweighted, and including any invariant-sites
+        // component), e.g. for RELL resampling (see ``RellBootstrap``).
+        // These are rolled back along with the rest of a rejected proposal.
+        inline void set_store_site_ln_probabilities(bool store=true) {
+            if (store && !this->is_storing_site_ln_probabilities_) {
+                // the next calculation needs to reach the root
+                this->head_node_->data().flag_as_dirty();
+            }
+            this->is_storing_site_ln_probabilities_ = store;
+        }
+        inline bool is_storing_site_ln_probabilities() const {
+            return this->is_storing_site_ln_probabilities_;
+        }
+        // Per-pattern log-likelihoods of the current state (calculating
+        // them if needed); requires ``set_store_site_ln_probabilities()``.
+        const std::vector<double>& calc_site_ln_probabilities();
+
+        // Log-likelihood with the edge subtending ``nd`` set to
+        // ``edge_length`` (the tree itself is not modified), and its first
+        // and second derivatives with respect to that length. Evaluated
+        // across the edge using the partials below ``nd`` and the "upper"
+        // partials of everything else, so that only the path from the root
+        // to ``nd`` needs to be calculated.
+        double calc_edge_ln_probability_derivatives(GeneTreeNode * nd,
+                double edge_length,
+                double& first_derivative,
+                double& second_derivative);
+        inline double calc_edge_ln_probability_derivatives(GeneTreeNode * nd,
+                double& first_derivative,
+                double& second_derivative) {
+            return this->calc_edge_ln_probability_derivatives(nd,
+                    nd->data().get_edge_length(),
+                    first_derivative,
+                    second_derivative);
+        }
+        // Pre-order pass filling the upper partials of every node, so that
+        // the log-likelihood can then be evaluated across any edge without
+        // further pruning (until the tree next needs recalculation). For a
+        // reversible model, the log-likelihood across an edge is that of
+        // the tree rooted anywhere on that edge.
+        void update_all_upper_partials();
+        inline bool are_upper_partials_current() const {
+            return this->are_upper_partials_current_;
+        }
+        // Log-likelihood evaluated across the edge subtending each node
+        // other than the root (``nodes``, in postorder), from the upper
+        // partials of all nodes and the current transition matrices.
+        void calc_edge_ln_probabilities(std::vector<GeneTreeNode *>& nodes,
+                std::vector<double>& ln_probabilities);
+        // Newton-Raphson optimization of the length of the edge subtending
+        // ``nd`` (through ``set_edge_length()``); returns the log-likelihood
+        // at the optimized length.
+        double optimize_edge_length(GeneTreeNode * nd,
+                double tolerance=1e-6,
+                unsigned int max_iterations=20);
+        // Sweeps over all edges, optimizing each in turn, until a sweep
+        // improves the log-likelihood by less than ``tolerance``.
+        double optimize_edge_lengths(double tolerance=1e-4,
+                unsigned int max_sweeps=20);
+
         void free_beagle_instance();
 
+    private:
+        // What a node's transition matrix buffer was calculated from
+        // (model versions of 0 for none)
+        struct TransitionMatrixKey {
+            double          edge_length;
+            int             eigen_index;
+            unsigned long   substitution_model_version;
+            unsigned long   site_rate_model_version;
+        };
+
+    private:
+        void build_operation_schedule();
+        // Brings the schedule and the uploaded models up to date with the
+        // tree (flagging all nodes as dirty if a model changed).
+        void refresh_schedule_and_models();
+        // Collects the transition matrices and operations needed to bring
+        // the partials of dirty nodes up to date, into the ``dirty_*``
+        // buffers (or, when all are dirty, the schedule itself); false if
+        // nothing is dirty.
+        bool collect_dirty_operations(const std::vector<int> *& matrix_indices,
+                const std::vector<double> *& edge_lengths,
+                const std::vector<BeagleOperation> *& operations);
+        // Root log-likelihood once the collected operations have been
+        // carried out, clearing the dirty flags.
+        double finish_ln_probability();
+        // Spreads the available checkpoint buffers over the internal nodes
+        // of the tree (under a partials memory budget).
+        void assign_checkpoints();
+        // Root log-likelihood (with any invariant sites), from the root
+        // partials in ``buffer_index``.
+        double calc_root_ln_probability(int buffer_index);
+        double calc_checkpointed_ln_probability();
+        // Appends the operations producing the partials of ``nd`` (and of
+        // any of its descendants that are not in checkpoints), and returns
+        // the buffer holding them.
+        int append_checkpointed_operations(GeneTreeNode * nd);
+        // True (and the key updated) if the matrix in ``matrix_index``
+        // needs recalculation for ``edge_length`` under the uploaded models.
+        bool refresh_transition_matrix_key(int matrix_index, double edge_length);
+        void upload_site_rate_model();
+        void upload_substitution_model();
+        void calc_invariant_pattern_probabilities();
+        double calc_ln_probability_with_invariant_sites(double * first_derivative=nullptr,
+                double * second_derivative=nullptr,
+                double * pattern_ln_probabilities=nullptr);
+        // Upper partials on the path from the root to ``nd``, unless those
+        // of all nodes are current.
+        void update_upper_partials(GeneTreeNode * nd);
+        void append_upper_partials_operation(GeneTreeNode * nd);
+        void upload_tip_states(int buffer_index, const int * data);
+        void upload_tip_partials(int buffer_index, const double * data);
+        void use_unshared_tip_data();
+        // Forgets which tip buffers hold compact states, when none of the
+        // instance's tip data will be used again.
+        void release_compact_tip_buffers();
+        double calc_edge_ln_probability(GeneTreeNode * nd,
+                double edge_length,
+                double& first_derivative,
+                double& second_derivative);
+        // Buffers beyond those of the postorder pass: an "upper" partials
+        // buffer per node (the conditional likelihood at the parent of
+        // everything but the subtree of the node), a buffer of ones
+        // standing in for the (nonexistent) upper partials of the root, an
+        // identity matrix, and scratch matrices for edge evaluation.
+        inline int get_upper_partials_buffer_index(const GeneNodeData& nd) const {
+            return this->num_tip_nodes_ + 2 * this->num_internal_nodes_ + nd.get_index();
+        }
+        inline int get_ones_partials_buffer_index() const {
+            return 2 * (this->num_tip_nodes_ + this->num_internal_nodes_) + this->num_internal_nodes_;
+        }
+        inline int get_identity_matrix_buffer_index() const {
+            return 2 * (this->num_tip_nodes_ + this->num_internal_nodes_);
+        }
+        inline int get_edge_matrix_buffer_index(int derivative_order) const {
+            return this->get_identity_matrix_buffer_index() + 1 + derivative_order;
+        }
+        // Under a partials memory budget, internal partials buffers follow
+        // the tip buffers: working buffers first, then checkpoints.
+        inline int get_budget_partials_buffer_index(int budget_buffer_idx) const {
+            return this->num_tip_nodes_ + budget_buffer_idx;
+        }
+
     private:
         unsigned long                              max_tips_;
+        int                                        num_tip_nodes_;
+        int                                        num_internal_nodes_;
         RestrictedResourceAllocator<GeneTreeNode>  leaf_node_allocator_;
         RestrictedResourceAllocator<GeneTreeNode>  internal_node_allocator_;
+        BeagleSettings                             beagle_settings_;
+        PooledBeagleInstance *                     pooled_instance_;
         int                                        beagle_instance_;
-        BeagleInstanceDetails *                    beagle_return_info_;
+        LikelihoodEngine *                         engine_;
+        // BEAGLE tip buffer of each leaf, by node index
+        std::vector<int>                           tip_buffer_indices_;
+        bool                                       is_tip_data_shared_;
+        double                                     ln_probability_;
+        SiteRateModel                              site_rate_model_;
+        int                                        num_patterns_;
+        unsigned int                               num_rate_categories_;
+        unsigned long                              uploaded_site_rate_model_version_;
+        SubstitutionModel                          substitution_model_;
+        int                                        eigen_index_;
+        unsigned long                              uploaded_substitution_model_version_;
+        // Invariant-sites support: site values retrieved from BEAGLE, and
+        // the probability of each pattern under the invariant category
+        // (pattern weights and tip state masks are kept with the pooled
+        // instance)
+        std::vector<double>                        site_ln_probabilities_;
+        std::vector<double>                        site_first_derivatives_;
+        std::vector<double>                        site_second_derivatives_;
+        bool                                       are_invariant_probabilities_current_;
+        std::vector<double>                        invariant_pattern_probabilities_;
+        // Per-pattern log-likelihoods of the last root calculation, if kept
+        bool                                       is_storing_site_ln_probabilities_;
+        std::vector<double>                        pattern_ln_probabilities_;
+        // Postorder operation schedule, rebuilt only on topology change.
+        // ``matrix_indices_``, ``edge_lengths_`` and ``operation_indices_``
+        // run parallel to ``postorder_nodes_`` (leaves have no operation).
+        bool                                       is_schedule_valid_;
+        std::vector<GeneTreeNode *>                postorder_nodes_;
+        std::vector<int>                           matrix_indices_;
+        std::vector<double>                        edge_lengths_;
+        std::vector<int>                           operation_indices_;
+        std::vector<BeagleOperation>               beagle_operations_;
+        // Scratch buffers for partial (dirty-only) updates; reused across calls.
+        std::vector<GeneNodeData *>                dirty_nodes_;
+        std::vector<int>                           dirty_matrix_indices_;
+        std::vector<double>                        dirty_edge_lengths_;
+        std::vector<BeagleOperation>               dirty_operations_;
+        // Transition matrix cache, by node matrix buffer index
+        std::vector<TransitionMatrixKey>           matrix_keys_;
+        unsigned long                              num_transition_matrix_updates_;
+        std::vector<BeagleOperation>               upper_operations_;
+        // Set by ``update_all_upper_partials()``, and cleared whenever any
+        // partials or transition matrices change
+        bool                                       are_upper_partials_current_;
+        // Partials memory budget: number of internal partials buffers (0 if
+        // unbounded), of which the first ``num_working_partials_buffers_``
+        // are for partials that are not kept. By node index: the
+        // checkpoint buffer (-1 for none), working buffers needed to
+        // recalculate the node, and whether its children are better
+        // recalculated in reverse order.
+        int                                        num_budget_partials_buffers_;
+        int                                        num_working_partials_buffers_;
+        unsigned long                              num_checkpoint_nodes_;
+        std::vector<int>                           checkpoint_buffer_indices_;
+        std::vector<int>                           working_buffer_needs_;
+        std::vector<bool>                          is_child_order_reversed_;
+        std::vector<int>                           free_working_buffers_;
+        // Batched instances: the number of trees with buffers in the
+        // instance (1 if not batched), and which of them this tree is
+        int                                        num_batch_trees_;
+        int                                        batch_index_;
+        // Proposal state
+        bool                                       is_proposal_active_;
+        double                                     stored_ln_probability_;
+        SiteRateModel                              stored_site_rate_model_;
+        SubstitutionModel                          stored_substitution_model_;
+        int                                        stored_eigen_index_;
+        std::vector<GeneNodeData *>                swapped_nodes_;
+        // Nodes recalculated during a proposal under a partials memory
+        // budget (which has no alternate slots)
+        std::vector<GeneNodeData *>                recalculated_nodes_;
+        std::vector<std::pair<GeneTreeNode *, double>>  stored_edge_lengths_;
+        std::vector<double>                        stored_pattern_ln_probabilities_;
 
 
 }; // GeneTree
@@ -0,0 +1,127 @@
+#include "likelihoodengine.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// BeagleLikelihoodEngine
+
+BeagleLikelihoodEngine::BeagleLikelihoodEngine(int instance)
+    : instance_(instance) {
+}
+
+BeagleLikelihoodEngine::~BeagleLikelihoodEngine() {
+    beagleFinalizeInstance(this->instance_);
+}
+
+int BeagleLikelihoodEngine::set_tip_states(int tip_index, const int * states) {
+    return beagleSetTipStates(this->instance_, tip_index, states);
+}
+
+int BeagleLikelihoodEngine::set_tip_partials(int tip_index, const double * partials) {
+    return beagleSetTipPartials(this->instance_, tip_index, partials);
+}
+
+int BeagleLikelihoodEngine::set_partials(int buffer_index, const double * partials) {
+    return beagleSetPartials(this->instance_, buffer_index, partials);
+}
+
+int BeagleLikelihoodEngine::set_eigen_decomposition(int eigen_index,
+        const double * eigenvectors,
+        const double * inverse_eigenvectors,
+        const double * eigenvalues) {
+    return beagleSetEigenDecomposition(this->instance_,
+            eigen_index,
+            eigenvectors,
+            inverse_eigenvectors,
+            eigenvalues);
+}
+
+int BeagleLikelihoodEngine::set_state_frequencies(int state_frequencies_index, const double * state_frequencies) {
+    return beagleSetStateFrequencies(this->instance_, state_frequencies_index, state_frequencies);
+}
+
+int BeagleLikelihoodEngine::set_category_weights(int category_weights_index, const double * category_weights) {
+    return beagleSetCategoryWeights(this->instance_, category_weights_index, category_weights);
+}
+
+int BeagleLikelihoodEngine::set_category_rates(const double * category_rates) {
+    return beagleSetCategoryRates(this->instance_, category_rates);
+}
+
+int BeagleLikelihoodEngine::set_pattern_weights(const double * pattern_weights) {
+    return beagleSetPatternWeights(this->instance_, pattern_weights);
+}
+
+int BeagleLikelihoodEngine::set_transition_matrix(int matrix_index, const double * matrix, double padded_value) {
+    return beagleSetTransitionMatrix(this->instance_, matrix_index, matrix, padded_value);
+}
+
+int BeagleLikelihoodEngine::update_transition_matrices(int eigen_index,
+        const int * probability_indices,
+        const int * first_derivative_indices,
+        const int * second_derivative_indices,
+        const double * edge_lengths,
+        int count) {
+    return beagleUpdateTransitionMatrices(this->instance_,
+            eigen_index,
+            probability_indices,
+            first_derivative_indices,
+            second_derivative_indices,
+            edge_lengths,
+            count);
+}
+
+int BeagleLikelihoodEngine::update_partials(const BeagleOperation * operations, int count) {
+    return beagleUpdatePartials(this->instance_, operations, count, BEAGLE_OP_NONE);
+}
+
+int BeagleLikelihoodEngine::calculate_root_log_likelihood(int buffer_index,
+        int category_weights_index,
+        int state_frequencies_index,
+        double * out_ln_likelihood) {
+    int cumulative_scale_index = BEAGLE_OP_NONE;
+    return beagleCalculateRootLogLikelihoods(this->instance_,
+            &buffer_index,
+            &category_weights_index,
+            &state_frequencies_index,
+            &cumulative_scale_index,
+            1,
+            out_ln_likelihood);
+}
+
+int BeagleLikelihoodEngine::calculate_edge_log_likelihood(int parent_buffer_index,
+        int child_buffer_index,
+        int probability_index,
+        int first_derivative_index,
+        int second_derivative_index,
+        int category_weights_index,
+        int state_frequencies_index,
+        double * out_ln_likelihood,
+        double * out_first_derivative,
+        double * out_second_derivative) {
+    int cumulative_scale_index = BEAGLE_OP_NONE;
+    bool has_derivatives = first_derivative_index >= 0 && second_derivative_index >= 0;
+    return beagleCalculateEdgeLogLikelihoods(this->instance_,
+            &parent_buffer_index,
+            &child_buffer_index,
+            &probability_index,
+            has_derivatives ? &first_derivative_index : nullptr,
+            has_derivatives ? &second_derivative_index : nullptr,
+            &category_weights_index,
+            &state_frequencies_index,
+            &cumulative_scale_index,
+            1,
+            out_ln_likelihood,
+            out_first_derivative,
+            out_second_derivative);
+}
+
+int BeagleLikelihoodEngine::get_site_log_likelihoods(double * out_ln_likelihoods) {
+    return beagleGetSiteLogLikelihoods(this->instance_, out_ln_likelihoods);
+}
+
+int BeagleLikelihoodEngine::get_site_derivatives(double * out_first_derivatives, double * out_second_derivatives) {
+    return beagleGetSiteDerivatives(this->instance_, out_first_derivatives, out_second_derivatives);
+}
+
+} // namespace treeshrew
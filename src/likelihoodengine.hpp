@@ -0,0 +1,117 @@
+#ifndef TREESHREW_LIKELIHOODENGINE_HPP
+#define TREESHREW_LIKELIHOODENGINE_HPP
+
+#include <libhmsbeagle/beagle.h>
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// LikelihoodEngine
+
+// The buffer-based likelihood calculations a ``GeneTree`` needs, in the
+// terms of (and with the same buffer semantics as) the BEAGLE API: each
+// method corresponds to the BEAGLE function of the same name, restricted to
+// a single root/edge evaluation and no scaling. Methods return a BEAGLE
+// return code (``BEAGLE_SUCCESS`` on success).
+class LikelihoodEngine {
+
+    public:
+        virtual ~LikelihoodEngine() {}
+        virtual int set_tip_states(int tip_index, const int * states) = 0;
+        virtual int set_tip_partials(int tip_index, const double * partials) = 0;
+        virtual int set_partials(int buffer_index, const double * partials) = 0;
+        virtual int set_eigen_decomposition(int eigen_index,
+                const double * eigenvectors,
+                const double * inverse_eigenvectors,
+                const double * eigenvalues) = 0;
+        virtual int set_state_frequencies(int state_frequencies_index, const double * state_frequencies) = 0;
+        virtual int set_category_weights(int category_weights_index, const double * category_weights) = 0;
+        virtual int set_category_rates(const double * category_rates) = 0;
+        virtual int set_pattern_weights(const double * pattern_weights) = 0;
+        virtual int set_transition_matrix(int matrix_index, const double * matrix, double padded_value) = 0;
+        // Derivative indices may be null.
+        virtual int update_transition_matrices(int eigen_index,
+                const int * probability_indices,
+                const int * first_derivative_indices,
+                const int * second_derivative_indices,
+                const double * edge_lengths,
+                int count) = 0;
+        virtual int update_partials(const BeagleOperation * operations, int count) = 0;
+        virtual int calculate_root_log_likelihood(int buffer_index,
+                int category_weights_index,
+                int state_frequencies_index,
+                double * out_ln_likelihood) = 0;
+        // Derivatives are not calculated if either derivative index is
+        // negative, and their outputs may then be null.
+        virtual int calculate_edge_log_likelihood(int parent_buffer_index,
+                int child_buffer_index,
+                int probability_index,
+                int first_derivative_index,
+                int second_derivative_index,
+                int category_weights_index,
+                int state_frequencies_index,
+                double * out_ln_likelihood,
+                double * out_first_derivative,
+                double * out_second_derivative) = 0;
+        // Per-pattern values of the last root or edge evaluation.
+        virtual int get_site_log_likelihoods(double * out_ln_likelihoods) = 0;
+        virtual int get_site_derivatives(double * out_first_derivatives, double * out_second_derivatives) = 0;
+
+}; // LikelihoodEngine
+
+////////////////////////////////////////////////////////////////////////////////
+// BeagleLikelihoodEngine
+
+// Forwards to a BEAGLE instance, which it finalizes on destruction.
+class BeagleLikelihoodEngine : public LikelihoodEngine {
+
+    public:
+        BeagleLikelihoodEngine(int instance);
+        ~BeagleLikelihoodEngine();
+        int set_tip_states(int tip_index, const int * states) override;
+        int set_tip_partials(int tip_index, const double * partials) override;
+        int set_partials(int buffer_index, const double * partials) override;
+        int set_eigen_decomposition(int eigen_index,
+                const double * eigenvectors,
+                const double * inverse_eigenvectors,
+                const double * eigenvalues) override;
+        int set_state_frequencies(int state_frequencies_index, const double * state_frequencies) override;
+        int set_category_weights(int category_weights_index, const double * category_weights) override;
+        int set_category_rates(const double * category_rates) override;
+        int set_pattern_weights(const double * pattern_weights) override;
+        int set_transition_matrix(int matrix_index, const double * matrix, double padded_value) override;
+        int update_transition_matrices(int eigen_index,
+                const int * probability_indices,
+                const int * first_derivative_indices,
+                const int * second_derivative_indices,
+                const double * edge_lengths,
+                int count) override;
+        int update_partials(const BeagleOperation * operations, int count) override;
+        int calculate_root_log_likelihood(int buffer_index,
+                int category_weights_index,
+                int state_frequencies_index,
+                double * out_ln_likelihood) override;
+        int calculate_edge_log_likelihood(int parent_buffer_index,
+                int child_buffer_index,
+                int probability_index,
+                int first_derivative_index,
+                int second_derivative_index,
+                int category_weights_index,
+                int state_frequencies_index,
+                double * out_ln_likelihood,
+                double * out_first_derivative,
+                double * out_second_derivative) override;
+        int get_site_log_likelihoods(double * out_ln_likelihoods) override;
+        int get_site_derivatives(double * out_first_derivatives, double * out_second_derivatives) override;
+        inline int get_instance() const {
+            return this->instance_;
+        }
+
+    private:
+        int     instance_;
+
+}; // BeagleLikelihoodEngine
+
+} // namespace treeshrew
+
+#endif
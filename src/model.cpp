@@ -0,0 +1,274 @@
+#include <cmath>
+#include <atomic>
+#include <algorithm>
+#include <gsl/gsl_cdf.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_eigen.h>
+#include <gsl/gsl_randist.h>
+#include "model.hpp"
+
+namespace treeshrew {
+
+unsigned long next_model_version() {
+    static std::atomic<unsigned long> version(0);
+    return ++version;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SiteRateModel
+
+SiteRateModel::SiteRateModel(unsigned int num_gamma_categories,
+        bool has_invariant_sites,
+        double gamma_shape,
+        double proportion_invariant)
+    : num_gamma_categories_(num_gamma_categories),
+      has_invariant_sites_(has_invariant_sites),
+      gamma_shape_(gamma_shape),
+      proportion_invariant_(has_invariant_sites ? proportion_invariant : 0.0),
+      is_dirty_(true),
+      version_(next_model_version()) {
+    TREESHREW_NDEBUG_ASSERT(num_gamma_categories > 0);
+    this->calc_categories();
+}
+
+void SiteRateModel::calc_categories() {
+    unsigned int num_cats = this->num_gamma_categories_;
+    this->category_rates_.assign(this->get_num_categories(), 0.0);
+    this->category_weights_.assign(this->get_num_categories(), 0.0);
+    double variable_weight = 1.0 - this->proportion_invariant_;
+    if (num_cats == 1) {
+        this->category_rates_[0] = 1.0;
+    } else {
+        // category boundaries are the quantiles of a gamma with mean 1; the
+        // mean rate within a category is given by the incomplete gamma
+        // function with the shape incremented by 1
+        double alpha = this->gamma_shape_;
+        double prev_cdf = 0.0;
+        for (unsigned int cat = 0; cat < num_cats; ++cat) {
+            double cdf = 1.0;
+            if (cat < num_cats - 1) {
+                double upper = gsl_cdf_gamma_Pinv(static_cast<double>(cat + 1) / num_cats, alpha, 1.0/alpha);
+                cdf = gsl_cdf_gamma_P(upper, alpha + 1.0, 1.0/alpha);
+            }
+            this->category_rates_[cat] = (cdf - prev_cdf) * num_cats;
+            prev_cdf = cdf;
+        }
+    }
+    for (unsigned int cat = 0; cat < num_cats; ++cat) {
+        this->category_rates_[cat] /= variable_weight;
+        this->category_weights_[cat] = variable_weight / num_cats;
+    }
+    if (this->has_invariant_sites_) {
+        this->category_rates_[num_cats] = 0.0;
+        this->category_weights_[num_cats] = this->proportion_invariant_;
+    }
+    this->is_dirty_ = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SubstitutionModel
+
+// Upper bound on the number of cached eigen-decompositions; the cache is
+// simply emptied when it is exceeded.
+static const unsigned long MAX_CACHED_EIGEN_SYSTEMS = 1024;
+
+SubstitutionModel::SubstitutionModel(const std::string& name)
+    : name_(name),
+      exchangeabilities_(NUM_EXCHANGEABILITIES, 1.0),
+      state_frequencies_(NUM_STATES, 1.0/NUM_STATES),
+      is_dirty_(true),
+      version_(next_model_version()),
+      eigen_system_cache_(new EigenSystemCache()) {
+    if (name != "JC69" && name != "K80" && name != "HKY85" && name != "GTR") {
+        treeshrew_abort("Unrecognized substitution model: '", name, "'");
+    }
+}
+
+void SubstitutionModel::set_kappa(double kappa) {
+    if (this->name_ != "K80" && this->name_ != "HKY85") {
+        treeshrew_abort("Substitution model '", this->name_, "' does not have a kappa parameter");
+    }
+    TREESHREW_ASSERT(kappa > 0.0);
+    if (kappa != this->get_kappa()) {
+        // transitions: A<->G and C<->T
+        this->exchangeabilities_[1] = kappa;
+        this->exchangeabilities_[4] = kappa;
+        this->flag_as_dirty();
+    }
+}
+
+double SubstitutionModel::get_kappa() const {
+    return this->exchangeabilities_[1];
+}
+
+void SubstitutionModel::set_exchangeabilities(const std::vector<double>& exchangeabilities) {
+    if (this->name_ != "GTR") {
+        treeshrew_abort("Exchangeabilities of substitution model '", this->name_, "' cannot be set");
+    }
+    TREESHREW_NDEBUG_ASSERT(exchangeabilities.size() == NUM_EXCHANGEABILITIES);
+    if (exchangeabilities != this->exchangeabilities_) {
+        this->exchangeabilities_ = exchangeabilities;
+        this->flag_as_dirty();
+    }
+}
+
+void SubstitutionModel::set_state_frequencies(const std::vector<double>& state_frequencies) {
+    if (this->name_ != "HKY85" && this->name_ != "GTR") {
+        treeshrew_abort("State frequencies of substitution model '", this->name_, "' cannot be set");
+    }
+    TREESHREW_NDEBUG_ASSERT(state_frequencies.size() == NUM_STATES);
+    if (state_frequencies != this->state_frequencies_) {
+        this->state_frequencies_ = state_frequencies;
+        this->flag_as_dirty();
+    }
+}
+
+void SubstitutionModel::update_eigen_system() {
+    std::vector<double> key(this->exchangeabilities_);
+    key.insert(key.end(), this->state_frequencies_.begin(), this->state_frequencies_.end());
+    std::lock_guard<std::mutex> lock(this->eigen_system_cache_->mutex);
+    auto & eigen_systems = this->eigen_system_cache_->eigen_systems;
+    auto cached = eigen_systems.find(key);
+    if (cached == eigen_systems.end()) {
+        if (eigen_systems.size() >= MAX_CACHED_EIGEN_SYSTEMS) {
+            eigen_systems.clear();
+        }
+        cached = eigen_systems.insert(std::make_pair(key, EigenSystem())).first;
+        this->calc_eigen_system(cached->second);
+        ++this->eigen_system_cache_->num_decompositions;
+    }
+    this->eigen_system_ = cached->second;
+    this->is_dirty_ = false;
+}
+
+void SubstitutionModel::calc_eigen_system(EigenSystem& eigen_system) const {
+    const std::vector<double>& pi = this->state_frequencies_;
+    double rmat[NUM_STATES][NUM_STATES];
+    unsigned int k = 0;
+    for (unsigned int i = 0; i < NUM_STATES; ++i) {
+        rmat[i][i] = 0.0;
+        for (unsigned int j = i + 1; j < NUM_STATES; ++j) {
+            rmat[i][j] = this->exchangeabilities_[k];
+            rmat[j][i] = this->exchangeabilities_[k];
+            ++k;
+        }
+    }
+    double scale = 0.0;
+    for (unsigned int i = 0; i < NUM_STATES; ++i) {
+        for (unsigned int j = 0; j < NUM_STATES; ++j) {
+            scale += pi[i] * rmat[i][j] * pi[j];
+        }
+    }
+
+    // Q is similar to the symmetric matrix S = P^{1/2} Q P^{-1/2}, with
+    // P = diag(pi), so S = U diag(lambda) U^T gives V = P^{-1/2} U and
+    // V^{-1} = U^T P^{1/2}
+    gsl_matrix * smat = gsl_matrix_alloc(NUM_STATES, NUM_STATES);
+    gsl_matrix * umat = gsl_matrix_alloc(NUM_STATES, NUM_STATES);
+    gsl_vector * lambda = gsl_vector_alloc(NUM_STATES);
+    gsl_eigen_symmv_workspace * workspace = gsl_eigen_symmv_alloc(NUM_STATES);
+    for (unsigned int i = 0; i < NUM_STATES; ++i) {
+        double row_sum = 0.0;
+        for (unsigned int j = 0; j < NUM_STATES; ++j) {
+            if (i != j) {
+                gsl_matrix_set(smat, i, j, rmat[i][j] * std::sqrt(pi[i] * pi[j]) / scale);
+                row_sum += rmat[i][j] * pi[j];
+            }
+        }
+        gsl_matrix_set(smat, i, i, -row_sum / scale);
+    }
+    gsl_eigen_symmv(smat, lambda, umat, workspace);
+    gsl_eigen_symmv_sort(lambda, umat, GSL_EIGEN_SORT_VAL_DESC);
+    eigen_system.eigenvectors.resize(NUM_STATES * NUM_STATES);
+    eigen_system.inverse_eigenvectors.resize(NUM_STATES * NUM_STATES);
+    eigen_system.eigenvalues.resize(NUM_STATES);
+    for (unsigned int i = 0; i < NUM_STATES; ++i) {
+        eigen_system.eigenvalues[i] = gsl_vector_get(lambda, i);
+        for (unsigned int j = 0; j < NUM_STATES; ++j) {
+            eigen_system.eigenvectors[i * NUM_STATES + j] = gsl_matrix_get(umat, i, j) / std::sqrt(pi[i]);
+            eigen_system.inverse_eigenvectors[i * NUM_STATES + j] = gsl_matrix_get(umat, j, i) * std::sqrt(pi[j]);
+        }
+    }
+    // the largest eigenvalue is zero (up to rounding)
+    eigen_system.eigenvalues[0] = 0.0;
+    gsl_eigen_symmv_free(workspace);
+    gsl_vector_free(lambda);
+    gsl_matrix_free(umat);
+    gsl_matrix_free(smat);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ReadErrorModel
+
+// Upper bound on the number of cached error tables; the cache is simply
+// emptied when it is exceeded (models keep the tables they are using).
+static const unsigned long MAX_CACHED_ERROR_TABLES = 1024;
+
+ReadErrorModel::ReadErrorModel(double error_rate, const std::string& distribution)
+    : distribution_(distribution),
+      error_rate_(-1.0),
+      version_(0),
+      table_cache_(new ErrorTableCache()) {
+    if (distribution != "binomial" && distribution != "poisson") {
+        treeshrew_abort("Unrecognized read error distribution: '", distribution, "'");
+    }
+    this->set_error_rate(error_rate);
+}
+
+void ReadErrorModel::set_error_rate(double error_rate) {
+    if (this->distribution_ == "binomial") {
+        TREESHREW_ASSERT(error_rate >= 0.0 && error_rate <= 1.0);
+    } else {
+        TREESHREW_ASSERT(error_rate >= 0.0);
+    }
+    if (error_rate != this->error_rate_) {
+        this->error_rate_ = error_rate;
+        this->tables_.clear();
+        this->version_ = next_model_version();
+    }
+}
+
+std::shared_ptr<const ReadErrorModel::ErrorTables> ReadErrorModel::fetch_tables(unsigned long read_length) {
+    auto key = std::make_pair(this->error_rate_, read_length);
+    std::lock_guard<std::mutex> lock(this->table_cache_->mutex);
+    auto & cached_tables = this->table_cache_->tables;
+    auto cached = cached_tables.find(key);
+    if (cached == cached_tables.end()) {
+        if (cached_tables.size() >= MAX_CACHED_ERROR_TABLES) {
+            cached_tables.clear();
+        }
+        std::shared_ptr<ErrorTables> tables(new ErrorTables());
+        this->calc_tables(read_length, *tables);
+        cached = cached_tables.insert(std::make_pair(key, tables)).first;
+        ++this->table_cache_->num_tabulations;
+    }
+    return cached->second;
+}
+
+void ReadErrorModel::calc_tables(unsigned long read_length, ErrorTables& tables) const {
+    tables.probabilities.resize(read_length + 1);
+    tables.ln_probabilities.resize(read_length + 1);
+    double p = this->error_rate_;
+    double n = read_length;
+    // k * log(x), taking 0 * log(0) as 0
+    auto k_ln = [](double k, double x) {
+        return k == 0.0 ? 0.0 : k * std::log(x);
+    };
+    for (unsigned long k = 0; k <= read_length; ++k) {
+        if (this->distribution_ == "binomial") {
+            tables.probabilities[k] = gsl_ran_binomial_pdf(k, p, read_length);
+            tables.ln_probabilities[k] = std::lgamma(n + 1.0) - std::lgamma(k + 1.0) - std::lgamma(n - k + 1.0)
+                + k_ln(k, p) + k_ln(n - k, 1.0 - p);
+        } else {
+            double mean = p * n;
+            tables.probabilities[k] = gsl_ran_poisson_pdf(k, mean);
+            tables.ln_probabilities[k] = k_ln(k, mean) - mean - std::lgamma(k + 1.0);
+        }
+    }
+    tables.max_probabilities = tables.probabilities;
+    for (unsigned long k = read_length; k > 0; --k) {
+        tables.max_probabilities[k - 1] = std::max(tables.max_probabilities[k - 1], tables.max_probabilities[k]);
+    }
+}
+
+} // namespace treeshrew
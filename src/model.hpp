@@ -0,0 +1,272 @@
+#ifndef TREESHREW_MODEL_HPP
+#define TREESHREW_MODEL_HPP
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "utility.hpp"
+
+namespace treeshrew {
+
+// Model versions are drawn from a single process-wide sequence, so that a
+// version identifies a parameter set across all models (and copies) of a
+// kind.
+unsigned long next_model_version();
+
+////////////////////////////////////////////////////////////////////////////////
+// SiteRateModel
+
+// Among-site rate heterogeneity: a discrete-gamma distribution with
+// ``num_gamma_categories`` equiprobable categories (Yang 1994, mean rate of
+// each category), optionally mixed with a proportion of invariant sites
+// (an additional, final category with rate 0). Category rates are
+// recalculated lazily, and only when a parameter has changed.
+class SiteRateModel {
+
+    public:
+        SiteRateModel(unsigned int num_gamma_categories=1,
+                bool has_invariant_sites=false,
+                double gamma_shape=1.0,
+                double proportion_invariant=0.0);
+        inline unsigned int get_num_gamma_categories() const {
+            return this->num_gamma_categories_;
+        }
+        inline bool has_invariant_sites() const {
+            return this->has_invariant_sites_;
+        }
+        inline unsigned int get_num_categories() const {
+            return this->num_gamma_categories_ + (this->has_invariant_sites_ ? 1 : 0);
+        }
+        inline double get_gamma_shape() const {
+            return this->gamma_shape_;
+        }
+        inline void set_gamma_shape(double gamma_shape) {
+            TREESHREW_ASSERT(gamma_shape > 0.0);
+            if (gamma_shape != this->gamma_shape_) {
+                this->gamma_shape_ = gamma_shape;
+                this->flag_as_dirty();
+            }
+        }
+        inline double get_proportion_invariant() const {
+            return this->proportion_invariant_;
+        }
+        inline void set_proportion_invariant(double proportion_invariant) {
+            TREESHREW_ASSERT(proportion_invariant >= 0.0 && proportion_invariant < 1.0);
+            if (proportion_invariant != this->proportion_invariant_) {
+                this->proportion_invariant_ = proportion_invariant;
+                this->flag_as_dirty();
+            }
+        }
+        // Changes whenever the category rates or weights change.
+        inline unsigned long get_version() const {
+            return this->version_;
+        }
+        inline const std::vector<double>& get_category_rates() {
+            if (this->is_dirty_) {
+                this->calc_categories();
+            }
+            return this->category_rates_;
+        }
+        inline const std::vector<double>& get_category_weights() {
+            if (this->is_dirty_) {
+                this->calc_categories();
+            }
+            return this->category_weights_;
+        }
+
+    private:
+        inline void flag_as_dirty() {
+            this->is_dirty_ = true;
+            this->version_ = next_model_version();
+        }
+        void calc_categories();
+
+    private:
+        unsigned int            num_gamma_categories_;
+        bool                    has_invariant_sites_;
+        double                  gamma_shape_;
+        double                  proportion_invariant_;
+        bool                    is_dirty_;
+        unsigned long           version_;
+        std::vector<double>     category_rates_;
+        std::vector<double>     category_weights_;
+
+}; // SiteRateModel
+
+////////////////////////////////////////////////////////////////////////////////
+// EigenSystem
+
+// Eigen-decomposition of a rate matrix, Q = V diag(lambda) V^{-1}, in the
+// row-major layout expected by ``beagleSetEigenDecomposition()``.
+struct EigenSystem {
+    std::vector<double>     eigenvectors;
+    std::vector<double>     inverse_eigenvectors;
+    std::vector<double>     eigenvalues;
+}; // EigenSystem
+
+////////////////////////////////////////////////////////////////////////////////
+// SubstitutionModel
+
+// Time-reversible nucleotide substitution model: one of "JC69", "K80"
+// (kappa), "HKY85" (kappa and state frequencies) or "GTR" (exchangeabilities
+// and state frequencies). Exchangeabilities are in the order AC, AG, AT, CG,
+// CT, GT. The rate matrix is normalized to one expected substitution per
+// unit time.
+//
+// Eigen-decompositions are cached by parameter values in a cache that is
+// shared between copies of a model, so returning to a previously visited
+// parameter set (e.g., after a rejected proposal) does not recompute it.
+class SubstitutionModel {
+
+    public:
+        static const unsigned int NUM_STATES = 4;
+        static const unsigned int NUM_EXCHANGEABILITIES = 6;
+
+    public:
+        SubstitutionModel(const std::string& name="JC69");
+        inline const std::string& get_name() const {
+            return this->name_;
+        }
+        void set_kappa(double kappa);
+        double get_kappa() const;
+        void set_exchangeabilities(const std::vector<double>& exchangeabilities);
+        inline const std::vector<double>& get_exchangeabilities() const {
+            return this->exchangeabilities_;
+        }
+        void set_state_frequencies(const std::vector<double>& state_frequencies);
+        inline const std::vector<double>& get_state_frequencies() const {
+            return this->state_frequencies_;
+        }
+        // Changes whenever the rate matrix changes.
+        inline unsigned long get_version() const {
+            return this->version_;
+        }
+        inline const EigenSystem& get_eigen_system() {
+            if (this->is_dirty_) {
+                this->update_eigen_system();
+            }
+            return this->eigen_system_;
+        }
+        // Number of eigen-decompositions actually computed (i.e., cache
+        // misses) over all copies sharing this model's cache.
+        inline unsigned long get_num_decompositions() const {
+            return this->eigen_system_cache_->num_decompositions;
+        }
+
+    private:
+        // Shared by copies of a model, which may be used from different
+        // threads.
+        struct EigenSystemCache {
+            EigenSystemCache() : num_decompositions(0) {}
+            std::mutex                                  mutex;
+            std::map<std::vector<double>, EigenSystem>  eigen_systems;
+            unsigned long                               num_decompositions;
+        };
+
+    private:
+        inline void flag_as_dirty() {
+            this->is_dirty_ = true;
+            this->version_ = next_model_version();
+        }
+        void update_eigen_system();
+        void calc_eigen_system(EigenSystem& eigen_system) const;
+
+    private:
+        std::string                         name_;
+        std::vector<double>                 exchangeabilities_;
+        std::vector<double>                 state_frequencies_;
+        bool                                is_dirty_;
+        unsigned long                       version_;
+        EigenSystem                         eigen_system_;
+        std::shared_ptr<EigenSystemCache>   eigen_system_cache_;
+
+}; // SubstitutionModel
+
+////////////////////////////////////////////////////////////////////////////////
+// ReadErrorModel
+
+// Distribution of the number of sequencing errors (i.e., mismatches against
+// the sequence it was read from) in a short read: binomial over the sites
+// of the read with probability ``error_rate`` per site ("binomial"), or
+// Poisson with mean ``error_rate`` times the read length ("poisson"). The
+// probabilities of 0 to L errors in a read of L sites are tabulated, in
+// linear and log space, once per read length and error rate, so that
+// scoring a read against each of its windows is a table lookup.
+class ReadErrorModel {
+
+    public:
+        ReadErrorModel(double error_rate=0.0107, const std::string& distribution="binomial");
+        inline const std::string& get_distribution() const {
+            return this->distribution_;
+        }
+        inline double get_error_rate() const {
+            return this->error_rate_;
+        }
+        void set_error_rate(double error_rate);
+        // Changes whenever the tabulated probabilities change.
+        inline unsigned long get_version() const {
+            return this->version_;
+        }
+        // Probability of ``k`` errors in a read of ``read_length`` sites at
+        // index ``k``, for ``k`` from 0 to ``read_length``. Remains valid
+        // until the error rate of this model is changed.
+        inline const std::vector<double>& get_probabilities(unsigned long read_length) {
+            return this->get_tables(read_length).probabilities;
+        }
+        // As ``get_probabilities()``, but natural logarithms (calculated
+        // directly, so finite where the probabilities underflow).
+        inline const std::vector<double>& get_ln_probabilities(unsigned long read_length) {
+            return this->get_tables(read_length).ln_probabilities;
+        }
+        // Largest probability of ``k`` or more errors in a read of
+        // ``read_length`` sites, at index ``k``.
+        inline const std::vector<double>& get_max_probabilities(unsigned long read_length) {
+            return this->get_tables(read_length).max_probabilities;
+        }
+        // Number of tables actually calculated (i.e., cache misses) over
+        // all copies sharing this model's cache.
+        inline unsigned long get_num_tabulations() const {
+            return this->table_cache_->num_tabulations;
+        }
+
+    private:
+        struct ErrorTables {
+            std::vector<double>     probabilities;
+            std::vector<double>     ln_probabilities;
+            std::vector<double>     max_probabilities;
+        };
+        // Shared by copies of a model, which may be used from different
+        // threads; keyed by error rate and read length.
+        struct ErrorTableCache {
+            ErrorTableCache() : num_tabulations(0) {}
+            std::mutex                                                                      mutex;
+            std::map<std::pair<double, unsigned long>, std::shared_ptr<const ErrorTables>>  tables;
+            unsigned long                                                                   num_tabulations;
+        };
+
+    private:
+        inline const ErrorTables& get_tables(unsigned long read_length) {
+            auto tables = this->tables_.find(read_length);
+            if (tables == this->tables_.end()) {
+                tables = this->tables_.insert(std::make_pair(read_length, this->fetch_tables(read_length))).first;
+            }
+            return *tables->second;
+        }
+        std::shared_ptr<const ErrorTables> fetch_tables(unsigned long read_length);
+        void calc_tables(unsigned long read_length, ErrorTables& tables) const;
+
+    private:
+        std::string                                                     distribution_;
+        double                                                          error_rate_;
+        unsigned long                                                   version_;
+        // Tables for the current error rate, by read length
+        std::map<unsigned long, std::shared_ptr<const ErrorTables>>     tables_;
+        std::shared_ptr<ErrorTableCache>                                table_cache_;
+
+}; // ReadErrorModel
+
+} // namespace treeshrew
+
+#endif
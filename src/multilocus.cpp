@@ -0,0 +1,66 @@
+#include <atomic>
+#include <algorithm>
+#include "multilocus.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// MultiLocusStateSpace
+
+MultiLocusStateSpace::MultiLocusStateSpace(unsigned long max_sequences,
+        unsigned long max_sites,
+        unsigned int num_threads)
+    : max_sequences_(max_sequences),
+      max_sites_(max_sites),
+      thread_pool_(num_threads) {
+}
+
+MultiLocusStateSpace::~MultiLocusStateSpace() {
+    this->clear();
+}
+
+unsigned long MultiLocusStateSpace::add_locus(
+        std::istream& tree_src,
+        std::istream& alignment_src,
+        const std::string& tree_format,
+        const std::string& alignment_format
+        ) {
+    StateSpace * locus = new StateSpace(this->max_sequences_, this->max_sites_);
+    locus->set_beagle_settings(this->beagle_settings_);
+    locus->set_site_rate_model(this->site_rate_model_);
+    locus->set_substitution_model(this->substitution_model_);
+    locus->initialize_with_tree_and_alignment(tree_src, alignment_src, tree_format, alignment_format);
+    this->loci_.push_back(locus);
+    this->locus_ln_probabilities_.push_back(0.0);
+    return this->loci_.size() - 1;
+}
+
+void MultiLocusStateSpace::clear() {
+    for (auto & locus : this->loci_) {
+        delete locus;
+    }
+    this->loci_.clear();
+    this->locus_ln_probabilities_.clear();
+}
+
+double MultiLocusStateSpace::calc_ln_probability() {
+    // loci are handed out one at a time, as their cost varies with their
+    // size and with how much of each is dirty
+    std::atomic<unsigned long> next_locus_idx(0);
+    unsigned long num_workers = std::min(static_cast<unsigned long>(this->get_num_threads()), this->loci_.size());
+    for (unsigned long worker_idx = 0; worker_idx < num_workers; ++worker_idx) {
+        this->thread_pool_.submit([this, &next_locus_idx] {
+            for (unsigned long locus_idx = next_locus_idx++; locus_idx < this->loci_.size(); locus_idx = next_locus_idx++) {
+                this->locus_ln_probabilities_[locus_idx] = this->loci_[locus_idx]->get_gene_tree()->calc_ln_probability();
+            }
+        });
+    }
+    this->thread_pool_.wait();
+    double ln_probability = 0.0;
+    for (auto locus_ln_probability : this->locus_ln_probabilities_) {
+        ln_probability += locus_ln_probability;
+    }
+    return ln_probability;
+}
+
+} // namespace treeshrew
@@ -0,0 +1,88 @@
+#ifndef TREESHREW_MULTILOCUS_HPP
+#define TREESHREW_MULTILOCUS_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "statespace.hpp"
+#include "threadpool.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// MultiLocusStateSpace
+
+// A gene tree and alignment per locus, each in its own ``StateSpace`` (and
+// so with its own BEAGLE instance and dirty tracking), evaluated
+// concurrently on a pool of worker threads. The log-likelihood is the sum
+// over loci, taken in locus order so that it does not depend on scheduling.
+class MultiLocusStateSpace {
+
+    public:
+        // ``max_sequences`` and ``max_sites`` apply to each locus;
+        // ``num_threads`` of 0 uses one thread per hardware thread.
+        MultiLocusStateSpace(unsigned long max_sequences,
+                unsigned long max_sites,
+                unsigned int num_threads=0);
+        ~MultiLocusStateSpace();
+        // Reads the tree and alignment of a new locus; returns the index of
+        // the locus.
+        unsigned long add_locus(
+                std::istream& tree_src,
+                std::istream& alignment_src,
+                const std::string& tree_format="newick",
+                const std::string& alignment_format="fasta"
+                );
+        void clear();
+        inline unsigned long get_num_loci() const {
+            return this->loci_.size();
+        }
+        inline StateSpace * get_locus(unsigned long locus_idx) {
+            TREESHREW_ASSERT(locus_idx < this->loci_.size());
+            return this->loci_[locus_idx];
+        }
+        inline GeneTree * get_gene_tree(unsigned long locus_idx) {
+            return this->get_locus(locus_idx)->get_gene_tree();
+        }
+        inline unsigned int get_num_threads() const {
+            return this->thread_pool_.get_num_threads();
+        }
+        // Settings and models take effect for loci added afterwards; those
+        // of existing loci are changed through their gene trees.
+        inline void set_beagle_settings(const BeagleSettings& settings) {
+            this->beagle_settings_ = settings;
+        }
+        inline void set_site_rate_model(const SiteRateModel& site_rate_model) {
+            this->site_rate_model_ = site_rate_model;
+        }
+        inline void set_substitution_model(const SubstitutionModel& substitution_model) {
+            this->substitution_model_ = substitution_model;
+        }
+        // Sum of the log-likelihoods of all loci. Loci with no dirty nodes
+        // return their cached values.
+        double calc_ln_probability();
+        // Per-locus values of the last ``calc_ln_probability()``.
+        inline double get_locus_ln_probability(unsigned long locus_idx) const {
+            TREESHREW_ASSERT(locus_idx < this->locus_ln_probabilities_.size());
+            return this->locus_ln_probabilities_[locus_idx];
+        }
+
+    private:
+        MultiLocusStateSpace(const MultiLocusStateSpace&) = delete;
+        MultiLocusStateSpace& operator=(const MultiLocusStateSpace&) = delete;
+
+    private:
+        unsigned long               max_sequences_;
+        unsigned long               max_sites_;
+        ThreadPool                  thread_pool_;
+        BeagleSettings              beagle_settings_;
+        SiteRateModel               site_rate_model_;
+        SubstitutionModel           substitution_model_;
+        std::vector<StateSpace *>   loci_;
+        std::vector<double>         locus_ln_probabilities_;
+
+}; // MultiLocusStateSpace
+
+} // namespace treeshrew
+
+#endif
@@ -0,0 +1,751 @@
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include "nativeengine.hpp"
+
+#if defined(__AVX2__) && defined(__FMA__)
+#   define TREESHREW_NATIVE_AVX2 1
+#   include <immintrin.h>
+#elif defined(__SSE2__)
+#   define TREESHREW_NATIVE_SSE2 1
+#   include <emmintrin.h>
+#endif
+
+namespace treeshrew {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+// Vec4
+
+// The 4 state values of a pattern, as ``double`` or ``float``.
+template <class Real> struct Vec4;
+
+#if defined(TREESHREW_NATIVE_AVX2)
+
+template <> struct Vec4<double> {
+    __m256d v;
+    static inline Vec4 load(const double * src) {
+        return {_mm256_loadu_pd(src)};
+    }
+    static inline Vec4 broadcast(const double * src) {
+        return {_mm256_broadcast_sd(src)};
+    }
+    static inline Vec4 broadcast(double value) {
+        return {_mm256_set1_pd(value)};
+    }
+    static inline Vec4 zero() {
+        return {_mm256_setzero_pd()};
+    }
+    inline void store(double * dest) const {
+        _mm256_storeu_pd(dest, this->v);
+    }
+    inline double sum() const {
+        __m128d lo = _mm256_castpd256_pd128(this->v);
+        __m128d hi = _mm256_extractf128_pd(this->v, 1);
+        lo = _mm_add_pd(lo, hi);
+        return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+    }
+};
+inline Vec4<double> operator*(const Vec4<double>& a, const Vec4<double>& b) {
+    return {_mm256_mul_pd(a.v, b.v)};
+}
+// a * b + c
+inline Vec4<double> multiply_add(const Vec4<double>& a, const Vec4<double>& b, const Vec4<double>& c) {
+    return {_mm256_fmadd_pd(a.v, b.v, c.v)};
+}
+
+template <> struct Vec4<float> {
+    __m128 v;
+    static inline Vec4 load(const float * src) {
+        return {_mm_loadu_ps(src)};
+    }
+    static inline Vec4 broadcast(const float * src) {
+        return {_mm_broadcast_ss(src)};
+    }
+    inline void store(float * dest) const {
+        _mm_storeu_ps(dest, this->v);
+    }
+};
+inline Vec4<float> operator*(const Vec4<float>& a, const Vec4<float>& b) {
+    return {_mm_mul_ps(a.v, b.v)};
+}
+inline Vec4<float> multiply_add(const Vec4<float>& a, const Vec4<float>& b, const Vec4<float>& c) {
+    return {_mm_fmadd_ps(a.v, b.v, c.v)};
+}
+inline Vec4<double> to_double(const Vec4<float>& a) {
+    return {_mm256_cvtps_pd(a.v)};
+}
+
+#elif defined(TREESHREW_NATIVE_SSE2)
+
+template <> struct Vec4<double> {
+    __m128d lo;
+    __m128d hi;
+    static inline Vec4 load(const double * src) {
+        return {_mm_loadu_pd(src), _mm_loadu_pd(src + 2)};
+    }
+    static inline Vec4 broadcast(const double * src) {
+        return Vec4::broadcast(*src);
+    }
+    static inline Vec4 broadcast(double value) {
+        return {_mm_set1_pd(value), _mm_set1_pd(value)};
+    }
+    static inline Vec4 zero() {
+        return {_mm_setzero_pd(), _mm_setzero_pd()};
+    }
+    inline void store(double * dest) const {
+        _mm_storeu_pd(dest, this->lo);
+        _mm_storeu_pd(dest + 2, this->hi);
+    }
+    inline double sum() const {
+        __m128d s = _mm_add_pd(this->lo, this->hi);
+        return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+    }
+};
+inline Vec4<double> operator*(const Vec4<double>& a, const Vec4<double>& b) {
+    return {_mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi)};
+}
+inline Vec4<double> multiply_add(const Vec4<double>& a, const Vec4<double>& b, const Vec4<double>& c) {
+    return {_mm_add_pd(_mm_mul_pd(a.lo, b.lo), c.lo), _mm_add_pd(_mm_mul_pd(a.hi, b.hi), c.hi)};
+}
+
+template <> struct Vec4<float> {
+    __m128 v;
+    static inline Vec4 load(const float * src) {
+        return {_mm_loadu_ps(src)};
+    }
+    static inline Vec4 broadcast(const float * src) {
+        return {_mm_load1_ps(src)};
+    }
+    inline void store(float * dest) const {
+        _mm_storeu_ps(dest, this->v);
+    }
+};
+inline Vec4<float> operator*(const Vec4<float>& a, const Vec4<float>& b) {
+    return {_mm_mul_ps(a.v, b.v)};
+}
+inline Vec4<float> multiply_add(const Vec4<float>& a, const Vec4<float>& b, const Vec4<float>& c) {
+    return {_mm_add_ps(_mm_mul_ps(a.v, b.v), c.v)};
+}
+inline Vec4<double> to_double(const Vec4<float>& a) {
+    return {_mm_cvtps_pd(a.v), _mm_cvtps_pd(_mm_movehl_ps(a.v, a.v))};
+}
+
+#else
+
+template <class Real> struct Vec4 {
+    Real v[4];
+    static inline Vec4 load(const Real * src) {
+        return {{src[0], src[1], src[2], src[3]}};
+    }
+    static inline Vec4 broadcast(const Real * src) {
+        return Vec4::broadcast(*src);
+    }
+    static inline Vec4 broadcast(Real value) {
+        return {{value, value, value, value}};
+    }
+    static inline Vec4 zero() {
+        return {{0, 0, 0, 0}};
+    }
+    inline void store(Real * dest) const {
+        std::copy(this->v, this->v + 4, dest);
+    }
+    inline Real sum() const {
+        return (this->v[0] + this->v[1]) + (this->v[2] + this->v[3]);
+    }
+};
+template <class Real>
+inline Vec4<Real> operator*(const Vec4<Real>& a, const Vec4<Real>& b) {
+    return {{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}};
+}
+template <class Real>
+inline Vec4<Real> multiply_add(const Vec4<Real>& a, const Vec4<Real>& b, const Vec4<Real>& c) {
+    return {{a.v[0] * b.v[0] + c.v[0], a.v[1] * b.v[1] + c.v[1], a.v[2] * b.v[2] + c.v[2], a.v[3] * b.v[3] + c.v[3]}};
+}
+inline Vec4<double> to_double(const Vec4<float>& a) {
+    return {{a.v[0], a.v[1], a.v[2], a.v[3]}};
+}
+
+#endif
+
+// Widening for reductions, which are always in double precision
+inline Vec4<double> to_double(const Vec4<double>& a) {
+    return a;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Children
+
+// Matrix (in column layout) applied to the data of a child, for each
+// pattern of a category.
+template <class Real>
+struct PartialsChild {
+    const Real * partials;
+    const Real * columns;
+    inline Vec4<Real> operator()(int pattern_idx) const {
+        const Real * p = this->partials + pattern_idx * 4;
+        Vec4<Real> result = Vec4<Real>::load(this->columns) * Vec4<Real>::broadcast(p);
+        result = multiply_add(Vec4<Real>::load(this->columns + 4), Vec4<Real>::broadcast(p + 1), result);
+        result = multiply_add(Vec4<Real>::load(this->columns + 8), Vec4<Real>::broadcast(p + 2), result);
+        return multiply_add(Vec4<Real>::load(this->columns + 12), Vec4<Real>::broadcast(p + 3), result);
+    }
+};
+
+template <class Real>
+struct StatesChild {
+    const int * states;
+    const Real * columns;
+    inline Vec4<Real> operator()(int pattern_idx) const {
+        // states beyond the last are missing data, in the padded column
+        return Vec4<Real>::load(this->columns + 4 * std::min(this->states[pattern_idx], 4));
+    }
+};
+
+template <class Real, class Child1, class Child2>
+void update_partials_kernel(Real * dest, const Child1& child1, const Child2& child2, int num_patterns) {
+    for (int pattern_idx = 0; pattern_idx < num_patterns; ++pattern_idx) {
+        (child1(pattern_idx) * child2(pattern_idx)).store(dest + pattern_idx * 4);
+    }
+}
+
+template <class Real, class Child1>
+void update_partials_kernel(Real * dest,
+        const Child1& child1,
+        const int * states2,
+        const Real * partials2,
+        const Real * columns2,
+        int num_patterns) {
+    if (states2) {
+        update_partials_kernel(dest, child1, StatesChild<Real>{states2, columns2}, num_patterns);
+    } else {
+        update_partials_kernel(dest, child1, PartialsChild<Real>{partials2, columns2}, num_patterns);
+    }
+}
+
+// Accumulates, per pattern, the weighted probability of the partials below
+// an edge given the partials above (including the state frequencies), for
+// the transition matrix and its derivatives.
+template <class Real, class Child>
+void edge_kernel(const Real * upper_partials,
+        const Child& child,
+        const Child& first_derivative_child,
+        const Child& second_derivative_child,
+        bool has_derivatives,
+        double category_weight,
+        const Vec4<double>& state_frequencies,
+        int num_patterns,
+        double * site_values,
+        double * site_first_derivatives,
+        double * site_second_derivatives) {
+    Vec4<double> weight = Vec4<double>::broadcast(category_weight);
+    for (int pattern_idx = 0; pattern_idx < num_patterns; ++pattern_idx) {
+        Vec4<double> upper = to_double(Vec4<Real>::load(upper_partials + pattern_idx * 4)) * state_frequencies * weight;
+        site_values[pattern_idx] += (upper * to_double(child(pattern_idx))).sum();
+        if (has_derivatives) {
+            site_first_derivatives[pattern_idx] += (upper * to_double(first_derivative_child(pattern_idx))).sum();
+            site_second_derivatives[pattern_idx] += (upper * to_double(second_derivative_child(pattern_idx))).sum();
+        }
+    }
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+// NativeLikelihoodEngine
+
+template <class Real>
+NativeLikelihoodEngine<Real>::NativeLikelihoodEngine(int num_tips,
+        int num_buffers,
+        int num_patterns,
+        int num_eigen_buffers,
+        int num_matrix_buffers,
+        int num_categories,
+        unsigned int num_threads)
+    : num_tips_(num_tips),
+      num_buffers_(num_buffers),
+      num_patterns_(num_patterns),
+      num_eigen_buffers_(num_eigen_buffers),
+      num_matrix_buffers_(num_matrix_buffers),
+      num_categories_(num_categories),
+      buffer_kinds_(num_buffers, EMPTY_BUFFER),
+      tip_states_(num_tips),
+      partials_(num_buffers),
+      eigenvectors_(num_eigen_buffers),
+      inverse_eigenvectors_(num_eigen_buffers),
+      eigenvalues_(num_eigen_buffers),
+      state_frequencies_(num_eigen_buffers, std::vector<double>(NUM_STATES, 1.0 / NUM_STATES)),
+      category_weights_(num_eigen_buffers, std::vector<double>(num_categories, 1.0 / num_categories)),
+      category_rates_(num_categories, 1.0),
+      pattern_weights_(num_patterns, 1.0),
+      matrices_(num_matrix_buffers, std::vector<Real>(num_categories * MATRIX_SIZE, 0)),
+      site_ln_likelihoods_(num_patterns, 0.0),
+      site_first_derivatives_(num_patterns, 0.0),
+      site_second_derivatives_(num_patterns, 0.0),
+      thread_pool_(num_threads > 1 ? new ThreadPool(num_threads) : nullptr) {
+}
+
+template <class Real>
+const char * NativeLikelihoodEngine<Real>::get_kernel_name() {
+#if defined(TREESHREW_NATIVE_AVX2)
+    return "AVX2";
+#elif defined(TREESHREW_NATIVE_SSE2)
+    return "SSE2";
+#else
+    return "scalar";
+#endif
+}
+
+template <class Real>
+bool NativeLikelihoodEngine<Real>::is_vectorized() {
+#if defined(TREESHREW_NATIVE_AVX2) || defined(TREESHREW_NATIVE_SSE2)
+    return true;
+#else
+    return false;
+#endif
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::set_tip_states(int tip_index, const int * states) {
+    if (tip_index < 0 || tip_index >= this->num_tips_) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    this->tip_states_[tip_index].assign(states, states + this->num_patterns_);
+    this->partials_[tip_index].clear();
+    this->buffer_kinds_[tip_index] = TIP_STATES_BUFFER;
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::set_tip_partials(int tip_index, const double * partials) {
+    if (tip_index < 0 || tip_index >= this->num_tips_) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    // shared by all categories
+    this->partials_[tip_index].assign(partials, partials + this->num_patterns_ * NUM_STATES);
+    this->tip_states_[tip_index].clear();
+    this->buffer_kinds_[tip_index] = TIP_PARTIALS_BUFFER;
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::set_partials(int buffer_index, const double * partials) {
+    if (!this->is_valid_buffer(buffer_index)) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    this->partials_[buffer_index].assign(partials, partials + this->num_categories_ * this->num_patterns_ * NUM_STATES);
+    if (buffer_index < this->num_tips_) {
+        this->tip_states_[buffer_index].clear();
+    }
+    this->buffer_kinds_[buffer_index] = PARTIALS_BUFFER;
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::set_eigen_decomposition(int eigen_index,
+        const double * eigenvectors,
+        const double * inverse_eigenvectors,
+        const double * eigenvalues) {
+    if (!this->is_valid_eigen(eigen_index)) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    this->eigenvectors_[eigen_index].assign(eigenvectors, eigenvectors + NUM_STATES * NUM_STATES);
+    this->inverse_eigenvectors_[eigen_index].assign(inverse_eigenvectors, inverse_eigenvectors + NUM_STATES * NUM_STATES);
+    this->eigenvalues_[eigen_index].assign(eigenvalues, eigenvalues + NUM_STATES);
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::set_state_frequencies(int state_frequencies_index, const double * state_frequencies) {
+    if (!this->is_valid_eigen(state_frequencies_index)) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    this->state_frequencies_[state_frequencies_index].assign(state_frequencies, state_frequencies + NUM_STATES);
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::set_category_weights(int category_weights_index, const double * category_weights) {
+    if (!this->is_valid_eigen(category_weights_index)) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    this->category_weights_[category_weights_index].assign(category_weights, category_weights + this->num_categories_);
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::set_category_rates(const double * category_rates) {
+    this->category_rates_.assign(category_rates, category_rates + this->num_categories_);
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::set_pattern_weights(const double * pattern_weights) {
+    this->pattern_weights_.assign(pattern_weights, pattern_weights + this->num_patterns_);
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::set_transition_matrix(int matrix_index, const double * matrix, double padded_value) {
+    if (!this->is_valid_matrix(matrix_index)) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    for (int cat = 0; cat < this->num_categories_; ++cat) {
+        Real * columns = this->matrices_[matrix_index].data() + cat * MATRIX_SIZE;
+        const double * rows = matrix + cat * NUM_STATES * NUM_STATES;
+        for (int from_state = 0; from_state < NUM_STATES; ++from_state) {
+            for (int to_state = 0; to_state < NUM_STATES; ++to_state) {
+                columns[to_state * NUM_STATES + from_state] = rows[from_state * NUM_STATES + to_state];
+            }
+            columns[NUM_STATES * NUM_STATES + from_state] = padded_value;
+        }
+    }
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::update_transition_matrices(int eigen_index,
+        const int * probability_indices,
+        const int * first_derivative_indices,
+        const int * second_derivative_indices,
+        const double * edge_lengths,
+        int count) {
+    if (!this->is_valid_eigen(eigen_index) || this->eigenvalues_[eigen_index].empty()) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    const double * eigenvectors = this->eigenvectors_[eigen_index].data();
+    const double * inverse_eigenvectors = this->inverse_eigenvectors_[eigen_index].data();
+    const double * eigenvalues = this->eigenvalues_[eigen_index].data();
+    // the matrix, first and second derivative are V diag(f(eigenvalues)) V^{-1}
+    // for f = exp(lt), l exp(lt) and l^2 exp(lt) (with rates folded into l)
+    const int * matrix_indices[3] = {probability_indices, first_derivative_indices, second_derivative_indices};
+    const double padded_values[3] = {1.0, 0.0, 0.0};
+    double scaled_exponentials[NUM_STATES];
+    for (int edge_idx = 0; edge_idx < count; ++edge_idx) {
+        for (int order = 0; order < 3; ++order) {
+            if (!matrix_indices[order]) {
+                continue;
+            }
+            int matrix_index = matrix_indices[order][edge_idx];
+            if (!this->is_valid_matrix(matrix_index)) {
+                return BEAGLE_ERROR_OUT_OF_RANGE;
+            }
+            for (int cat = 0; cat < this->num_categories_; ++cat) {
+                double rate = this->category_rates_[cat];
+                for (int k = 0; k < NUM_STATES; ++k) {
+                    double l = eigenvalues[k] * rate;
+                    double f = std::exp(l * edge_lengths[edge_idx]);
+                    for (int i = 0; i < order; ++i) {
+                        f *= l;
+                    }
+                    scaled_exponentials[k] = f;
+                }
+                Real * columns = this->matrices_[matrix_index].data() + cat * MATRIX_SIZE;
+                for (int from_state = 0; from_state < NUM_STATES; ++from_state) {
+                    for (int to_state = 0; to_state < NUM_STATES; ++to_state) {
+                        double value = 0.0;
+                        for (int k = 0; k < NUM_STATES; ++k) {
+                            value += eigenvectors[from_state * NUM_STATES + k]
+                                * scaled_exponentials[k]
+                                * inverse_eigenvectors[k * NUM_STATES + to_state];
+                        }
+                        columns[to_state * NUM_STATES + from_state] = value;
+                    }
+                    columns[NUM_STATES * NUM_STATES + from_state] = padded_values[order];
+                }
+            }
+        }
+    }
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+const Real * NativeLikelihoodEngine<Real>::get_partials(int buffer_index, int category) const {
+    switch (this->buffer_kinds_[buffer_index]) {
+        case TIP_PARTIALS_BUFFER:
+            return this->partials_[buffer_index].data();
+        case PARTIALS_BUFFER:
+            return this->partials_[buffer_index].data() + category * this->num_patterns_ * NUM_STATES;
+        default:
+            return nullptr;
+    }
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::update_partials(const BeagleOperation * operations, int count) {
+    if (this->thread_pool_ && count > 1
+            && static_cast<long>(count) * this->num_categories_ * this->num_patterns_ >= MIN_PARALLEL_WORK
+            && this->schedule_by_level(operations, count)) {
+        this->run_by_level(operations, count);
+        return BEAGLE_SUCCESS;
+    }
+    for (int op_idx = 0; op_idx < count; ++op_idx) {
+        int result = this->prepare_partials_operation(operations[op_idx]);
+        if (result != BEAGLE_SUCCESS) {
+            return result;
+        }
+        this->run_partials_operation(operations[op_idx]);
+    }
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+bool NativeLikelihoodEngine<Real>::schedule_by_level(const BeagleOperation * operations, int count) {
+    // An operation's level is one more than the highest level of the
+    // operations writing its children, so the operations of a level are
+    // independent. Batches that overwrite a buffer already read or written
+    // in the batch, and invalid batches (reported by the serial loop), are
+    // not scheduled.
+    std::vector<int>& write_levels = this->buffer_write_levels_;
+    std::vector<bool>& is_read = this->buffer_is_read_;
+    write_levels.assign(this->num_buffers_, -1);
+    is_read.assign(this->num_buffers_, false);
+    int num_levels = 0;
+    this->operation_levels_.resize(count);
+    for (int op_idx = 0; op_idx < count; ++op_idx) {
+        const BeagleOperation& op = operations[op_idx];
+        int dest_index = op.destinationPartials;
+        if (!this->is_valid_buffer(dest_index)
+                || !this->is_valid_buffer(op.child1Partials)
+                || !this->is_valid_buffer(op.child2Partials)
+                || !this->is_valid_matrix(op.child1TransitionMatrix)
+                || !this->is_valid_matrix(op.child2TransitionMatrix)) {
+            return false;
+        }
+        if (write_levels[dest_index] >= 0 || is_read[dest_index]) {
+            return false;
+        }
+        int level = 0;
+        for (int child_index : {op.child1Partials, op.child2Partials}) {
+            if (write_levels[child_index] >= 0) {
+                level = std::max(level, write_levels[child_index] + 1);
+            } else if (this->buffer_kinds_[child_index] == EMPTY_BUFFER) {
+                return false;
+            }
+            is_read[child_index] = true;
+        }
+        write_levels[dest_index] = level;
+        this->operation_levels_[op_idx] = level;
+        num_levels = std::max(num_levels, level + 1);
+    }
+    if (num_levels == count) {
+        // a chain of operations: nothing to run concurrently
+        return false;
+    }
+    this->level_operations_.resize(num_levels);
+    for (auto & level_operations : this->level_operations_) {
+        level_operations.clear();
+    }
+    for (int op_idx = 0; op_idx < count; ++op_idx) {
+        this->level_operations_[this->operation_levels_[op_idx]].push_back(op_idx);
+    }
+    return true;
+}
+
+template <class Real>
+void NativeLikelihoodEngine<Real>::run_by_level(const BeagleOperation * operations, int count) {
+    for (int op_idx = 0; op_idx < count; ++op_idx) {
+        this->prepare_partials_operation(operations[op_idx]);
+    }
+    for (const auto & level_operations : this->level_operations_) {
+        int num_level_operations = level_operations.size();
+        int num_workers = std::min(num_level_operations, static_cast<int>(this->thread_pool_->get_num_threads()));
+        if (num_workers < 2
+                || static_cast<long>(num_level_operations) * this->num_categories_ * this->num_patterns_ < MIN_PARALLEL_WORK) {
+            for (int op_idx : level_operations) {
+                this->run_partials_operation(operations[op_idx]);
+            }
+            continue;
+        }
+        // operations are handed out one at a time, as tip operations are
+        // cheaper than internal ones
+        std::atomic<int> next_idx(0);
+        for (int worker_idx = 0; worker_idx < num_workers; ++worker_idx) {
+            this->thread_pool_->submit([this, operations, &level_operations, &next_idx, num_level_operations] {
+                for (int idx = next_idx++; idx < num_level_operations; idx = next_idx++) {
+                    this->run_partials_operation(operations[level_operations[idx]]);
+                }
+            });
+        }
+        this->thread_pool_->wait();
+    }
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::prepare_partials_operation(const BeagleOperation& op) {
+    int dest_index = op.destinationPartials;
+    if (!this->is_valid_buffer(dest_index)
+            || !this->is_valid_buffer(op.child1Partials)
+            || !this->is_valid_buffer(op.child2Partials)
+            || !this->is_valid_matrix(op.child1TransitionMatrix)
+            || !this->is_valid_matrix(op.child2TransitionMatrix)) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    if (this->buffer_kinds_[op.child1Partials] == EMPTY_BUFFER
+            || this->buffer_kinds_[op.child2Partials] == EMPTY_BUFFER) {
+        return BEAGLE_ERROR_GENERAL;
+    }
+    this->partials_[dest_index].resize(this->num_categories_ * this->num_patterns_ * NUM_STATES);
+    this->buffer_kinds_[dest_index] = PARTIALS_BUFFER;
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+void NativeLikelihoodEngine<Real>::run_partials_operation(const BeagleOperation& op) {
+    std::vector<Real>& dest = this->partials_[op.destinationPartials];
+    const int * states1 = this->buffer_kinds_[op.child1Partials] == TIP_STATES_BUFFER ? this->tip_states_[op.child1Partials].data() : nullptr;
+    const int * states2 = this->buffer_kinds_[op.child2Partials] == TIP_STATES_BUFFER ? this->tip_states_[op.child2Partials].data() : nullptr;
+    for (int cat = 0; cat < this->num_categories_; ++cat) {
+        Real * dest_partials = dest.data() + cat * this->num_patterns_ * NUM_STATES;
+        const Real * columns1 = this->matrices_[op.child1TransitionMatrix].data() + cat * MATRIX_SIZE;
+        const Real * columns2 = this->matrices_[op.child2TransitionMatrix].data() + cat * MATRIX_SIZE;
+        const Real * partials2 = this->get_partials(op.child2Partials, cat);
+        if (states1) {
+            update_partials_kernel(dest_partials, StatesChild<Real>{states1, columns1},
+                    states2, partials2, columns2, this->num_patterns_);
+        } else {
+            update_partials_kernel(dest_partials, PartialsChild<Real>{this->get_partials(op.child1Partials, cat), columns1},
+                    states2, partials2, columns2, this->num_patterns_);
+        }
+    }
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::calculate_root_log_likelihood(int buffer_index,
+        int category_weights_index,
+        int state_frequencies_index,
+        double * out_ln_likelihood) {
+    if (!this->is_valid_buffer(buffer_index)
+            || !this->is_valid_eigen(category_weights_index)
+            || !this->is_valid_eigen(state_frequencies_index)) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    if (!this->get_partials(buffer_index, 0)) {
+        return BEAGLE_ERROR_GENERAL;
+    }
+    const std::vector<double>& category_weights = this->category_weights_[category_weights_index];
+    Vec4<double> state_frequencies = Vec4<double>::load(this->state_frequencies_[state_frequencies_index].data());
+    double ln_likelihood = 0.0;
+    for (int pattern_idx = 0; pattern_idx < this->num_patterns_; ++pattern_idx) {
+        Vec4<double> site = Vec4<double>::zero();
+        for (int cat = 0; cat < this->num_categories_; ++cat) {
+            site = multiply_add(Vec4<double>::broadcast(category_weights[cat]),
+                    to_double(Vec4<Real>::load(this->get_partials(buffer_index, cat) + pattern_idx * NUM_STATES)),
+                    site);
+        }
+        this->site_ln_likelihoods_[pattern_idx] = std::log((site * state_frequencies).sum());
+        ln_likelihood += this->pattern_weights_[pattern_idx] * this->site_ln_likelihoods_[pattern_idx];
+    }
+    *out_ln_likelihood = ln_likelihood;
+    return std::isfinite(ln_likelihood) ? BEAGLE_SUCCESS : BEAGLE_ERROR_FLOATING_POINT;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::calculate_edge_log_likelihood(int parent_buffer_index,
+        int child_buffer_index,
+        int probability_index,
+        int first_derivative_index,
+        int second_derivative_index,
+        int category_weights_index,
+        int state_frequencies_index,
+        double * out_ln_likelihood,
+        double * out_first_derivative,
+        double * out_second_derivative) {
+    bool has_derivatives = first_derivative_index >= 0 && second_derivative_index >= 0;
+    if (!this->is_valid_buffer(parent_buffer_index)
+            || !this->is_valid_buffer(child_buffer_index)
+            || !this->is_valid_matrix(probability_index)
+            || (has_derivatives && (!this->is_valid_matrix(first_derivative_index) || !this->is_valid_matrix(second_derivative_index)))
+            || !this->is_valid_eigen(category_weights_index)
+            || !this->is_valid_eigen(state_frequencies_index)) {
+        return BEAGLE_ERROR_OUT_OF_RANGE;
+    }
+    if (!this->get_partials(parent_buffer_index, 0) || this->buffer_kinds_[child_buffer_index] == EMPTY_BUFFER) {
+        return BEAGLE_ERROR_GENERAL;
+    }
+    if (!has_derivatives) {
+        // derivative columns are ignored
+        first_derivative_index = probability_index;
+        second_derivative_index = probability_index;
+    }
+    const std::vector<double>& category_weights = this->category_weights_[category_weights_index];
+    Vec4<double> state_frequencies = Vec4<double>::load(this->state_frequencies_[state_frequencies_index].data());
+    // site likelihoods and their (unnormalized) derivatives accumulate over
+    // categories in the site buffers
+    std::vector<double>& site_values = this->site_ln_likelihoods_;
+    std::vector<double>& site_first_derivatives = this->site_first_derivatives_;
+    std::vector<double>& site_second_derivatives = this->site_second_derivatives_;
+    std::fill(site_values.begin(), site_values.end(), 0.0);
+    std::fill(site_first_derivatives.begin(), site_first_derivatives.end(), 0.0);
+    std::fill(site_second_derivatives.begin(), site_second_derivatives.end(), 0.0);
+    const int * child_states = this->buffer_kinds_[child_buffer_index] == TIP_STATES_BUFFER ? this->tip_states_[child_buffer_index].data() : nullptr;
+    for (int cat = 0; cat < this->num_categories_; ++cat) {
+        const Real * upper_partials = this->get_partials(parent_buffer_index, cat);
+        const Real * columns = this->matrices_[probability_index].data() + cat * MATRIX_SIZE;
+        const Real * first_derivative_columns = this->matrices_[first_derivative_index].data() + cat * MATRIX_SIZE;
+        const Real * second_derivative_columns = this->matrices_[second_derivative_index].data() + cat * MATRIX_SIZE;
+        if (child_states) {
+            edge_kernel(upper_partials,
+                    StatesChild<Real>{child_states, columns},
+                    StatesChild<Real>{child_states, first_derivative_columns},
+                    StatesChild<Real>{child_states, second_derivative_columns},
+                    has_derivatives, category_weights[cat], state_frequencies, this->num_patterns_,
+                    site_values.data(), site_first_derivatives.data(), site_second_derivatives.data());
+        } else {
+            const Real * child_partials = this->get_partials(child_buffer_index, cat);
+            edge_kernel(upper_partials,
+                    PartialsChild<Real>{child_partials, columns},
+                    PartialsChild<Real>{child_partials, first_derivative_columns},
+                    PartialsChild<Real>{child_partials, second_derivative_columns},
+                    has_derivatives, category_weights[cat], state_frequencies, this->num_patterns_,
+                    site_values.data(), site_first_derivatives.data(), site_second_derivatives.data());
+        }
+    }
+    double ln_likelihood = 0.0;
+    double first_derivative = 0.0;
+    double second_derivative = 0.0;
+    for (int pattern_idx = 0; pattern_idx < this->num_patterns_; ++pattern_idx) {
+        double site_value = site_values[pattern_idx];
+        site_values[pattern_idx] = std::log(site_value);
+        ln_likelihood += this->pattern_weights_[pattern_idx] * site_values[pattern_idx];
+        if (has_derivatives) {
+            // derivatives of the log-likelihood
+            double d1 = site_first_derivatives[pattern_idx] / site_value;
+            double d2 = site_second_derivatives[pattern_idx] / site_value - d1 * d1;
+            site_first_derivatives[pattern_idx] = d1;
+            site_second_derivatives[pattern_idx] = d2;
+            first_derivative += this->pattern_weights_[pattern_idx] * d1;
+            second_derivative += this->pattern_weights_[pattern_idx] * d2;
+        }
+    }
+    *out_ln_likelihood = ln_likelihood;
+    if (has_derivatives) {
+        if (out_first_derivative) {
+            *out_first_derivative = first_derivative;
+        }
+        if (out_second_derivative) {
+            *out_second_derivative = second_derivative;
+        }
+    }
+    return std::isfinite(ln_likelihood) ? BEAGLE_SUCCESS : BEAGLE_ERROR_FLOATING_POINT;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::get_site_log_likelihoods(double * out_ln_likelihoods) {
+    std::copy(this->site_ln_likelihoods_.begin(), this->site_ln_likelihoods_.end(), out_ln_likelihoods);
+    return BEAGLE_SUCCESS;
+}
+
+template <class Real>
+int NativeLikelihoodEngine<Real>::get_site_derivatives(double * out_first_derivatives, double * out_second_derivatives) {
+    std::copy(this->site_first_derivatives_.begin(), this->site_first_derivatives_.end(), out_first_derivatives);
+    if (out_second_derivatives) {
+        std::copy(this->site_second_derivatives_.begin(), this->site_second_derivatives_.end(), out_second_derivatives);
+    }
+    return BEAGLE_SUCCESS;
+}
+
+template class NativeLikelihoodEngine<double>;
+template class NativeLikelihoodEngine<float>;
+
+} // namespace treeshrew
@@ -0,0 +1,159 @@
+#ifndef TREESHREW_NATIVEENGINE_HPP
+#define TREESHREW_NATIVEENGINE_HPP
+
+#include <vector>
+#include <memory>
+#include "likelihoodengine.hpp"
+#include "threadpool.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// NativeLikelihoodEngine
+
+// Built-in Felsenstein pruning for 4 states, with the buffer layout of a
+// BEAGLE instance (partials are category-major, with the 4 states of each
+// pattern interleaved). The kernels operate on the 4 states of a pattern as
+// a single vector, using AVX2 (with FMA) or SSE2 where the build targets
+// them (see ``get_kernel_name()``).
+//
+// Partials and transition matrices are stored and pruned as ``Real``
+// (``double`` or ``float``); reductions over states, categories and
+// patterns at the root or across an edge are always done in double
+// precision. There is no rescaling, so single precision partials underflow
+// for much smaller trees than double precision ones.
+//
+// With more than one thread, each ``update_partials()`` batch is grouped
+// into dependency levels (operations whose children are tips or earlier
+// levels), and the operations of a level run concurrently; independent
+// subtrees of a large tree thus prune in parallel. Batches and levels too
+// small to be worth the hand-off run serially on the calling thread.
+template <class Real>
+class NativeLikelihoodEngine : public LikelihoodEngine {
+
+    public:
+        static const int NUM_STATES = 4;
+
+    public:
+        // ``num_buffers`` counts tip and internal buffers alike (i.e., it
+        // is the sum of BEAGLE's partials and compact buffer counts).
+        NativeLikelihoodEngine(int num_tips,
+                int num_buffers,
+                int num_patterns,
+                int num_eigen_buffers,
+                int num_matrix_buffers,
+                int num_categories,
+                unsigned int num_threads=1);
+        int set_tip_states(int tip_index, const int * states) override;
+        int set_tip_partials(int tip_index, const double * partials) override;
+        int set_partials(int buffer_index, const double * partials) override;
+        int set_eigen_decomposition(int eigen_index,
+                const double * eigenvectors,
+                const double * inverse_eigenvectors,
+                const double * eigenvalues) override;
+        int set_state_frequencies(int state_frequencies_index, const double * state_frequencies) override;
+        int set_category_weights(int category_weights_index, const double * category_weights) override;
+        int set_category_rates(const double * category_rates) override;
+        int set_pattern_weights(const double * pattern_weights) override;
+        int set_transition_matrix(int matrix_index, const double * matrix, double padded_value) override;
+        int update_transition_matrices(int eigen_index,
+                const int * probability_indices,
+                const int * first_derivative_indices,
+                const int * second_derivative_indices,
+                const double * edge_lengths,
+                int count) override;
+        int update_partials(const BeagleOperation * operations, int count) override;
+        int calculate_root_log_likelihood(int buffer_index,
+                int category_weights_index,
+                int state_frequencies_index,
+                double * out_ln_likelihood) override;
+        int calculate_edge_log_likelihood(int parent_buffer_index,
+                int child_buffer_index,
+                int probability_index,
+                int first_derivative_index,
+                int second_derivative_index,
+                int category_weights_index,
+                int state_frequencies_index,
+                double * out_ln_likelihood,
+                double * out_first_derivative,
+                double * out_second_derivative) override;
+        int get_site_log_likelihoods(double * out_ln_likelihoods) override;
+        int get_site_derivatives(double * out_first_derivatives, double * out_second_derivatives) override;
+
+        // "AVX2", "SSE2" or "scalar"
+        static const char * get_kernel_name();
+        static bool is_vectorized();
+        inline unsigned int get_num_threads() const {
+            return this->thread_pool_ ? this->thread_pool_->get_num_threads() : 1;
+        }
+
+    private:
+        enum BufferKind {
+            EMPTY_BUFFER,
+            TIP_STATES_BUFFER,
+            TIP_PARTIALS_BUFFER,
+            PARTIALS_BUFFER
+        };
+        // Matrices are kept transposed, as the column of each state and a
+        // final column for missing data (the padded value), so that
+        // applying a matrix is a sum of scaled columns.
+        static const int MATRIX_SIZE = (NUM_STATES + 1) * NUM_STATES;
+        // Fewest pattern-categories (summed over operations) worth
+        // spreading over threads, in a batch and in each level
+        static const long MIN_PARALLEL_WORK = 16384;
+
+    private:
+        // Checks the buffers of an operation and allocates its destination
+        int prepare_partials_operation(const BeagleOperation& op);
+        void run_partials_operation(const BeagleOperation& op);
+        // Assigns the operations of a batch to dependency levels; false if
+        // the batch cannot (or need not) be run by level.
+        bool schedule_by_level(const BeagleOperation * operations, int count);
+        void run_by_level(const BeagleOperation * operations, int count);
+        // Partials of category ``category`` (nullptr for states or empty)
+        const Real * get_partials(int buffer_index, int category) const;
+        inline bool is_valid_buffer(int buffer_index) const {
+            return buffer_index >= 0 && buffer_index < this->num_buffers_;
+        }
+        inline bool is_valid_matrix(int matrix_index) const {
+            return matrix_index >= 0 && matrix_index < this->num_matrix_buffers_;
+        }
+        inline bool is_valid_eigen(int eigen_index) const {
+            return eigen_index >= 0 && eigen_index < this->num_eigen_buffers_;
+        }
+
+    private:
+        int                                     num_tips_;
+        int                                     num_buffers_;
+        int                                     num_patterns_;
+        int                                     num_eigen_buffers_;
+        int                                     num_matrix_buffers_;
+        int                                     num_categories_;
+        std::vector<BufferKind>                 buffer_kinds_;
+        std::vector<std::vector<int>>           tip_states_;
+        // internal partials are allocated on first use
+        std::vector<std::vector<Real>>          partials_;
+        std::vector<std::vector<double>>        eigenvectors_;
+        std::vector<std::vector<double>>        inverse_eigenvectors_;
+        std::vector<std::vector<double>>        eigenvalues_;
+        std::vector<std::vector<double>>        state_frequencies_;
+        std::vector<std::vector<double>>        category_weights_;
+        std::vector<double>                     category_rates_;
+        std::vector<double>                     pattern_weights_;
+        std::vector<std::vector<Real>>          matrices_;
+        std::vector<double>                     site_ln_likelihoods_;
+        std::vector<double>                     site_first_derivatives_;
+        std::vector<double>                     site_second_derivatives_;
+        // nullptr if single-threaded
+        std::unique_ptr<ThreadPool>             thread_pool_;
+        // scratch for scheduling by level
+        std::vector<int>                        buffer_write_levels_;
+        std::vector<bool>                       buffer_is_read_;
+        std::vector<int>                        operation_levels_;
+        std::vector<std::vector<int>>           level_operations_;
+
+}; // NativeLikelihoodEngine
+
+} // namespace treeshrew
+
+#endif
@@ -0,0 +1,95 @@
+#include <algorithm>
+#include <gsl/gsl_randist.h>
+#include "rell.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// RellBootstrap
+
+RellBootstrap::RellBootstrap(const std::vector<unsigned long>& pattern_counts, unsigned long seed)
+    : rng_(gsl_rng_alloc(gsl_rng_mt19937)),
+      num_sites_(0),
+      pattern_probabilities_(pattern_counts.size()),
+      replicate_pattern_counts_(pattern_counts.size()),
+      num_replicates_(0) {
+    gsl_rng_set(this->rng_, seed);
+    for (auto count : pattern_counts) {
+        this->num_sites_ += count;
+    }
+    if (this->num_sites_ == 0) {
+        treeshrew_abort("RELL bootstrap requires at least one site");
+    }
+    for (unsigned long pattern_idx = 0; pattern_idx < pattern_counts.size(); ++pattern_idx) {
+        this->pattern_probabilities_[pattern_idx] = static_cast<double>(pattern_counts[pattern_idx]) / this->num_sites_;
+    }
+}
+
+RellBootstrap::~RellBootstrap() {
+    gsl_rng_free(this->rng_);
+}
+
+unsigned long RellBootstrap::add_tree(const std::vector<double>& pattern_ln_probabilities) {
+    if (pattern_ln_probabilities.size() != this->get_num_patterns()) {
+        treeshrew_abort("Number of pattern log-likelihoods (", pattern_ln_probabilities.size(),
+                ") does not match number of patterns (", this->get_num_patterns(), ")");
+    }
+    // existing replicates do not cover the new tree
+    this->clear_replicates();
+    this->pattern_ln_probabilities_.push_back(pattern_ln_probabilities);
+    return this->pattern_ln_probabilities_.size() - 1;
+}
+
+void RellBootstrap::run(unsigned long num_replicates) {
+    unsigned long num_trees = this->get_num_trees();
+    unsigned long num_patterns = this->get_num_patterns();
+    this->replicate_ln_probabilities_.resize((this->num_replicates_ + num_replicates) * num_trees, 0.0);
+    for (unsigned long replicate_idx = 0; replicate_idx < num_replicates; ++replicate_idx) {
+        // drawing sites with replacement is a multinomial draw of pattern
+        // counts
+        gsl_ran_multinomial(this->rng_,
+                num_patterns,
+                this->num_sites_,
+                this->pattern_probabilities_.data(),
+                this->replicate_pattern_counts_.data());
+        double * ln_probabilities = this->replicate_ln_probabilities_.data() + this->num_replicates_ * num_trees;
+        for (unsigned long tree_idx = 0; tree_idx < num_trees; ++tree_idx) {
+            const std::vector<double>& pattern_ln_probabilities = this->pattern_ln_probabilities_[tree_idx];
+            double ln_probability = 0.0;
+            for (unsigned long pattern_idx = 0; pattern_idx < num_patterns; ++pattern_idx) {
+                ln_probability += this->replicate_pattern_counts_[pattern_idx] * pattern_ln_probabilities[pattern_idx];
+            }
+            ln_probabilities[tree_idx] = ln_probability;
+        }
+        ++this->num_replicates_;
+    }
+}
+
+std::vector<double> RellBootstrap::get_bootstrap_proportions() const {
+    unsigned long num_trees = this->get_num_trees();
+    std::vector<double> proportions(num_trees, 0.0);
+    if (this->num_replicates_ == 0 || num_trees == 0) {
+        return proportions;
+    }
+    for (unsigned long replicate_idx = 0; replicate_idx < this->num_replicates_; ++replicate_idx) {
+        const double * ln_probabilities = this->replicate_ln_probabilities_.data() + replicate_idx * num_trees;
+        double max_ln_probability = *std::max_element(ln_probabilities, ln_probabilities + num_trees);
+        unsigned long num_best = std::count(ln_probabilities, ln_probabilities + num_trees, max_ln_probability);
+        for (unsigned long tree_idx = 0; tree_idx < num_trees; ++tree_idx) {
+            if (ln_probabilities[tree_idx] == max_ln_probability) {
+                proportions[tree_idx] += 1.0 / num_best;
+            }
+        }
+    }
+    for (auto & proportion : proportions) {
+        proportion /= this->num_replicates_;
+    }
+    return proportions;
+}
+
+void RellBootstrap::clear_replicates() {
+    this->num_replicates_ = 0;
+    this->replicate_ln_probabilities_.clear();
+}
+
+} // namespace treeshrew
@@ -0,0 +1,67 @@
+#ifndef TREESHREW_RELL_HPP
+#define TREESHREW_RELL_HPP
+
+#include <vector>
+#include <gsl/gsl_rng.h>
+#include "utility.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// RellBootstrap
+
+// Resampling-estimated log-likelihoods (RELL; Kishino, Miyata and Hasegawa
+// 1990): each bootstrap replicate redraws the sites of the alignment with
+// replacement, and scores each candidate tree by reweighting its per-pattern
+// log-likelihoods (see ``GeneTree::calc_site_ln_probabilities()``) with the
+// resampled pattern counts, rather than by rerunning the pruning.
+class RellBootstrap {
+
+    public:
+        // ``pattern_counts`` are the number of sites showing each pattern.
+        RellBootstrap(const std::vector<unsigned long>& pattern_counts, unsigned long seed=0);
+        ~RellBootstrap();
+        // Returns the index of the tree.
+        unsigned long add_tree(const std::vector<double>& pattern_ln_probabilities);
+        inline unsigned long get_num_trees() const {
+            return this->pattern_ln_probabilities_.size();
+        }
+        inline unsigned long get_num_patterns() const {
+            return this->pattern_probabilities_.size();
+        }
+        // Log-likelihoods of all trees for ``num_replicates`` further
+        // replicates (drawn from the generator's current state), replicate
+        // by replicate.
+        void run(unsigned long num_replicates);
+        inline unsigned long get_num_replicates() const {
+            return this->num_replicates_;
+        }
+        inline double get_replicate_ln_probability(unsigned long replicate_idx, unsigned long tree_idx) const {
+            TREESHREW_ASSERT(replicate_idx < this->num_replicates_ && tree_idx < this->get_num_trees());
+            return this->replicate_ln_probabilities_[replicate_idx * this->get_num_trees() + tree_idx];
+        }
+        // Proportion of replicates in which each tree has the highest
+        // log-likelihood (ties are shared).
+        std::vector<double> get_bootstrap_proportions() const;
+        // Clears the replicates (but not the trees).
+        void clear_replicates();
+
+    private:
+        RellBootstrap(const RellBootstrap&) = delete;
+        RellBootstrap& operator=(const RellBootstrap&) = delete;
+
+    private:
+        gsl_rng *                               rng_;
+        unsigned int                            num_sites_;
+        std::vector<double>                     pattern_probabilities_;
+        std::vector<unsigned int>               replicate_pattern_counts_;
+        std::vector<std::vector<double>>        pattern_ln_probabilities_;
+        unsigned long                           num_replicates_;
+        // Tree log-likelihoods, ``get_num_trees()`` per replicate
+        std::vector<double>                     replicate_ln_probabilities_;
+
+}; // RellBootstrap
+
+} // namespace treeshrew
+
+#endif
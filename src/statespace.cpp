@@ -1,13 +1,41 @@
+#include <atomic>
+#include <algorithm>
 #include "statespace.hpp"
 #include "dataio.hpp"
 #include "utility.hpp"
 
 namespace treeshrew {
 
+// Reads per chunk of work handed to a read thread: enough to amortize the
+// hand-off, few enough to balance reads of uneven cost.
+static const unsigned long DEFAULT_READ_CHUNK_SIZE = 256;
+
+// Sum of ``values[0..num_values)``, added pairwise in a fixed order.
+static double pairwise_sum(const double * values, unsigned long num_values) {
+    if (num_values <= 8) {
+        double sum = 0.0;
+        for (unsigned long idx = 0; idx < num_values; ++idx) {
+            sum += values[idx];
+        }
+        return sum;
+    }
+    unsigned long half = num_values / 2;
+    return pairwise_sum(values, half) + pairwise_sum(values + half, num_values - half);
+}
+
 StateSpace::StateSpace(unsigned long max_sequences,
         unsigned long max_sites)
     : alignment_(max_sequences, max_sites)
-    , gene_tree_(nullptr) {
+    , gene_tree_(nullptr)
+    , read_chunk_size_(DEFAULT_READ_CHUNK_SIZE)
+    , short_read_seed_length_(0)
+    , are_short_read_probabilities_dirty_(true)
+    , cached_short_read_seed_length_(0)
+    , cached_read_error_model_version_(0)
+    , short_read_ln_probability_(0.0)
+    , num_short_read_windows_(0)
+    , num_short_read_windows_scored_(0)
+    , short_read_ln_probability_error_bound_(0.0) {
 }
 
 StateSpace::~StateSpace() {
@@ -21,6 +49,7 @@ void StateSpace::load_short_reads(std::istream& src) {
     for (auto & seq : dna) {
         this->short_reads_.add(*seq);
     }
+    this->are_short_read_probabilities_dirty_ = true;
 }
 
 void StateSpace::initialize_with_tree_and_alignment(
@@ -43,7 +72,6 @@ void StateSpace::initialize_with_tree_and_alignment(
     } else {
         this->gene_tree_ = trees[0];
     }
-    this->gene_tree_->create_beagle_instance(this->alignment_.get_max_sites());
 
     // alignment
     NucleotideSequences dna;
@@ -52,8 +80,26 @@ void StateSpace::initialize_with_tree_and_alignment(
     for (auto leaf_iter = this->gene_tree_->leaf_begin(); leaf_iter != this->gene_tree_->leaf_end(); ++leaf_iter) {
         NucleotideSequence * dseq = dna.get_sequence(leaf_iter->get_label());
         this->alignment_.new_sequence(&(*leaf_iter), dseq);
-        this->gene_tree_->set_tip_partials(*leaf_iter,
-                this->alignment_.get_partials_data(&(*leaf_iter)));
+    }
+
+    // likelihood is calculated over unique site patterns
+    this->alignment_.compress_patterns();
+    this->alignment_.pack_sequences();
+    this->gene_tree_->set_beagle_settings(this->beagle_settings_);
+    this->gene_tree_->set_site_rate_model(this->site_rate_model_);
+    this->gene_tree_->set_substitution_model(this->substitution_model_);
+    // compact states where there are no partial ambiguities
+    this->gene_tree_->create_beagle_instance(this->alignment_.get_num_patterns(),
+            this->alignment_.get_site_patterns().get_num_compact_rows());
+    this->gene_tree_->set_pattern_weights(this->alignment_.get_pattern_weights_data());
+    for (auto leaf_iter = this->gene_tree_->leaf_begin(); leaf_iter != this->gene_tree_->leaf_end(); ++leaf_iter) {
+        if (this->alignment_.has_compact_pattern_states(&(*leaf_iter))) {
+            this->gene_tree_->set_tip_states(*leaf_iter,
+                    this->alignment_.get_pattern_states_data(&(*leaf_iter)));
+        } else {
+            this->gene_tree_->set_tip_partials(*leaf_iter,
+                    this->alignment_.get_pattern_partials_data(&(*leaf_iter)));
+        }
     }
 }
 
@@ -63,29 +109,186 @@ void StateSpace::dispose_gene_tree() {
         delete this->gene_tree_;
         this->gene_tree_ = nullptr;
     }
+    this->are_short_read_probabilities_dirty_ = true;
 }
 
 void StateSpace::dispose_alignment() {
     this->alignment_.clear();
+    this->are_short_read_probabilities_dirty_ = true;
+}
+
+void StateSpace::set_num_read_threads(unsigned int num_threads) {
+    if (num_threads == 0) {
+        num_threads = ThreadPool::get_default_num_threads();
+    }
+    if (num_threads != this->get_num_read_threads()) {
+        this->read_thread_pool_.reset(num_threads > 1 ? new ThreadPool(num_threads) : nullptr);
+    }
 }
 
 double StateSpace::calc_ln_probability_of_short_reads() {
-    double ln_prob = 0.0;
+    std::vector<GeneNodeData *> leaves;
+    for (auto ndi = this->gene_tree_->leaf_begin(); ndi != this->gene_tree_->leaf_end(); ++ndi) {
+        leaves.push_back(&(*ndi));
+    }
+    unsigned int seed_length = this->short_read_seed_length_;
+    if (seed_length > 0 && this->alignment_.get_seed_length() != seed_length) {
+        this->alignment_.build_seed_index(seed_length);
+    }
+    unsigned long num_reads = this->short_reads_.size();
+    unsigned long num_leaves = leaves.size();
+    // the cached probabilities of each read against each leaf can be reused
+    // for leaves whose sequences have not changed, unless anything else
+    // they depend on has
+    if (leaves != this->short_read_leaves_
+            || seed_length != this->cached_short_read_seed_length_
+            || this->read_error_model_.get_version() != this->cached_read_error_model_version_
+            || this->read_leaf_probabilities_.size() != num_reads * num_leaves) {
+        this->are_short_read_probabilities_dirty_ = true;
+    }
+    std::vector<unsigned long> changed_leaf_indices;
+    for (unsigned long leaf_idx = 0; leaf_idx < num_leaves; ++leaf_idx) {
+        unsigned long version = this->alignment_.get_sequence_version(leaves[leaf_idx]);
+        if (this->are_short_read_probabilities_dirty_ || version != this->short_read_leaf_versions_[leaf_idx]) {
+            changed_leaf_indices.push_back(leaf_idx);
+        }
+    }
+    if (this->are_short_read_probabilities_dirty_) {
+        this->short_read_leaves_ = leaves;
+        this->short_read_leaf_versions_.assign(num_leaves, 0);
+        this->cached_short_read_seed_length_ = seed_length;
+        this->cached_read_error_model_version_ = this->read_error_model_.get_version();
+        this->read_leaf_probabilities_.assign(num_reads * num_leaves, 0.0);
+        this->read_leaf_windows_scored_.assign(num_reads * num_leaves, 0);
+        this->is_read_seeded_.assign(num_reads, 0);
+        this->read_ln_probabilities_.assign(num_reads, 0.0);
+        this->read_ln_probability_error_bounds_.assign(num_reads, 0.0);
+    }
+    unsigned long num_leaf_windows = 0;
     for (auto sri = this->short_reads_.cbegin(); sri != this->short_reads_.cend(); ++sri) {
-        const ShortReadSequence& short_read = *sri;
-        double sub_prob = 0.0;
-        for (auto ndi = this->gene_tree_->leaf_begin(); ndi != this->gene_tree_->leaf_end(); ++ndi) {
-            GeneNodeData& gnd = *ndi;
-            // sub_prob += short_read.calc_probability_of_sequence(
-            //         this->alignment_.sequence_states_cbegin(&gnd),
-            //         this->alignment_.sequence_states_cend(&gnd),
-            //         0.5);
-            sub_prob += this->alignment_.calc_probability_of_sequence(&gnd, short_read, 0.0107);
+        num_leaf_windows += this->alignment_.get_num_active_sites() - sri->size() + 1;
+    }
+    this->num_short_read_windows_ = num_leaf_windows * num_leaves;
+    if (changed_leaf_indices.empty()) {
+        this->num_short_read_windows_scored_ = 0;
+        return this->short_read_ln_probability_;
+    }
+    bool are_all_leaves_changed = changed_leaf_indices.size() == num_leaves;
+    std::vector<unsigned long> all_leaf_indices(num_leaves);
+    for (unsigned long leaf_idx = 0; leaf_idx < num_leaves; ++leaf_idx) {
+        all_leaf_indices[leaf_idx] = leaf_idx;
+    }
+    // the error model is not safe to use from several threads, so its
+    // tables are looked up here, once per read length
+    std::vector<const std::vector<double> *> error_probabilities;
+    std::vector<const std::vector<double> *> max_error_probabilities;
+    for (auto sri = this->short_reads_.cbegin(); sri != this->short_reads_.cend(); ++sri) {
+        unsigned long read_length = sri->size();
+        if (read_length >= error_probabilities.size()) {
+            error_probabilities.resize(read_length + 1, nullptr);
+            max_error_probabilities.resize(read_length + 1, nullptr);
+        }
+        if (!error_probabilities[read_length]) {
+            error_probabilities[read_length] = &this->read_error_model_.get_probabilities(read_length);
+            max_error_probabilities[read_length] = &this->read_error_model_.get_max_probabilities(read_length);
         }
-        // std::cerr << "*** " << sub_prob << std::endl;
-        ln_prob += std::log(sub_prob);
     }
-    return ln_prob;
+    std::atomic<unsigned long> num_windows_scored(0);
+    auto score_reads = [this, &leaves, &changed_leaf_indices, &all_leaf_indices, are_all_leaves_changed,
+                &error_probabilities, &max_error_probabilities, &num_windows_scored, seed_length, num_leaves]
+            (unsigned long begin_idx, unsigned long end_idx) {
+        std::vector<uint64_t> read_seeds;
+        std::vector<unsigned long> offsets;
+        unsigned long num_chunk_windows_scored = 0;
+        for (unsigned long read_idx = begin_idx; read_idx < end_idx; ++read_idx) {
+            const ShortReadSequence& short_read = *(this->short_reads_.cbegin() + read_idx);
+            const std::vector<double>& read_error_probabilities = *error_probabilities[short_read.size()];
+            unsigned long num_offsets = this->alignment_.get_num_active_sites() - short_read.size() + 1;
+            double * leaf_probs = &this->read_leaf_probabilities_[read_idx * num_leaves];
+            unsigned long * leaf_windows_scored = &this->read_leaf_windows_scored_[read_idx * num_leaves];
+            auto score_leaves = [&](const std::vector<unsigned long>& leaf_indices, bool is_seeded) {
+                for (auto leaf_idx : leaf_indices) {
+                    if (is_seeded) {
+                        leaf_probs[leaf_idx] = this->alignment_.calc_seeded_probability_of_sequence(leaves[leaf_idx],
+                                short_read, read_seeds, read_error_probabilities, offsets);
+                        leaf_windows_scored[leaf_idx] = offsets.size();
+                    } else {
+                        leaf_probs[leaf_idx] = this->alignment_.calc_probability_of_sequence(leaves[leaf_idx],
+                                short_read, read_error_probabilities);
+                        leaf_windows_scored[leaf_idx] = num_offsets;
+                    }
+                    num_chunk_windows_scored += leaf_windows_scored[leaf_idx];
+                }
+            };
+            auto sum_leaves = [&]() {
+                double sub_prob = 0.0;
+                for (unsigned long leaf_idx = 0; leaf_idx < num_leaves; ++leaf_idx) {
+                    sub_prob += leaf_probs[leaf_idx];
+                }
+                return sub_prob;
+            };
+            // reads that cannot be seeded, or share no seed with any
+            // sequence, are scored against every window; a read switching
+            // between the two is rescored against every leaf, so that the
+            // result does not depend on which leaves changed
+            bool is_seeded = seed_length > 0 && this->alignment_.find_read_seeds(short_read, read_seeds);
+            if (is_seeded) {
+                if (this->is_read_seeded_[read_idx] && !are_all_leaves_changed) {
+                    score_leaves(changed_leaf_indices, true);
+                } else {
+                    score_leaves(all_leaf_indices, true);
+                }
+                if (sum_leaves() == 0.0) {
+                    is_seeded = false;
+                    score_leaves(all_leaf_indices, false);
+                }
+            } else {
+                score_leaves(changed_leaf_indices, false);
+            }
+            this->is_read_seeded_[read_idx] = is_seeded;
+            double sub_prob = sum_leaves();
+            this->read_ln_probabilities_[read_idx] = std::log(sub_prob);
+            if (is_seeded) {
+                // a window sharing no seed with the read has no run of
+                // ``seed_length`` matching sites, and so has at least
+                // ``read_length / seed_length`` errors
+                unsigned long num_read_windows_scored = 0;
+                for (unsigned long leaf_idx = 0; leaf_idx < num_leaves; ++leaf_idx) {
+                    num_read_windows_scored += leaf_windows_scored[leaf_idx];
+                }
+                double max_skipped_prob = (*max_error_probabilities[short_read.size()])[short_read.size() / seed_length];
+                double skipped_prob = (num_leaves * num_offsets - num_read_windows_scored) * max_skipped_prob;
+                this->read_ln_probability_error_bounds_[read_idx] = std::log1p(skipped_prob / sub_prob);
+            } else {
+                this->read_ln_probability_error_bounds_[read_idx] = 0.0;
+            }
+        }
+        num_windows_scored += num_chunk_windows_scored;
+    };
+    unsigned long chunk_size = this->read_chunk_size_;
+    unsigned long num_chunks = (num_reads + chunk_size - 1) / chunk_size;
+    if (!this->read_thread_pool_ || num_chunks < 2) {
+        score_reads(0, num_reads);
+    } else {
+        std::atomic<unsigned long> next_chunk_idx(0);
+        unsigned long num_workers = std::min(static_cast<unsigned long>(this->get_num_read_threads()), num_chunks);
+        for (unsigned long worker_idx = 0; worker_idx < num_workers; ++worker_idx) {
+            this->read_thread_pool_->submit([&score_reads, &next_chunk_idx, num_chunks, chunk_size, num_reads] {
+                for (unsigned long chunk_idx = next_chunk_idx++; chunk_idx < num_chunks; chunk_idx = next_chunk_idx++) {
+                    score_reads(chunk_idx * chunk_size, std::min((chunk_idx + 1) * chunk_size, num_reads));
+                }
+            });
+        }
+        this->read_thread_pool_->wait();
+    }
+    for (auto leaf_idx : changed_leaf_indices) {
+        this->short_read_leaf_versions_[leaf_idx] = this->alignment_.get_sequence_version(leaves[leaf_idx]);
+    }
+    this->are_short_read_probabilities_dirty_ = false;
+    this->num_short_read_windows_scored_ = num_windows_scored;
+    this->short_read_ln_probability_error_bound_ = pairwise_sum(this->read_ln_probability_error_bounds_.data(), num_reads);
+    this->short_read_ln_probability_ = pairwise_sum(this->read_ln_probabilities_.data(), num_reads);
+    return this->short_read_ln_probability_;
 }
 
 void StateSpace::write_phylogenetic_data(std::ostream& out) {
@@ -113,7 +316,28 @@ void StateSpace::write_phylogenetic_data(std::ostream& out) {
     out << "end;\n";
 
     // calculate the likelihood
-    out << "begin paup;\n    set crit=likelihood;\n    lset userbr nst=1 rmatrix=estimate basefreq=equal rates=equal pinvar=0;\n    lscore;\nend;\n";
+    const SiteRateModel& site_rate_model = this->gene_tree_->get_site_rate_model();
+    const SubstitutionModel& substitution_model = this->gene_tree_->get_substitution_model();
+    out << "begin paup;\n    set crit=likelihood;\n    lset userbr";
+    if (substitution_model.get_name() == "JC69") {
+        out << " nst=1 rmatrix=estimate basefreq=equal";
+    } else {
+        // exchangeabilities relative to G<->T
+        const std::vector<double>& exchangeabilities = substitution_model.get_exchangeabilities();
+        const std::vector<double>& state_frequencies = substitution_model.get_state_frequencies();
+        out << " nst=6 rmatrix=(";
+        for (unsigned int i = 0; i < SubstitutionModel::NUM_EXCHANGEABILITIES - 1; ++i) {
+            out << (i > 0 ? " " : "") << exchangeabilities[i] / exchangeabilities[SubstitutionModel::NUM_EXCHANGEABILITIES - 1];
+        }
+        out << ") basefreq=(" << state_frequencies[0] << " " << state_frequencies[1] << " " << state_frequencies[2] << ")";
+    }
+    if (site_rate_model.get_num_gamma_categories() > 1) {
+        out << " rates=gamma ncat=" << site_rate_model.get_num_gamma_categories()
+            << " shape=" << site_rate_model.get_gamma_shape();
+    } else {
+        out << " rates=equal";
+    }
+    out << " pinvar=" << site_rate_model.get_proportion_invariant() << ";\n    lscore;\nend;\n";
 }
 
 } // treeshrew
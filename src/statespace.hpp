@@ -2,8 +2,11 @@
 #define TREESHREW_STATESPACE_HPP
 
 #include <iostream>
+#include <vector>
+#include <memory>
 #include "character.hpp"
 #include "genetree.hpp"
+#include "threadpool.hpp"
 
 namespace treeshrew {
 
@@ -21,16 +24,133 @@ class StateSpace {
                 );
         void dispose_gene_tree();
         void dispose_alignment();
+        // Sum over reads of the log of the probability of each read given
+        // the leaf sequences. Reads are scored in chunks of consecutive
+        // reads handed out to the read threads, and their log-probabilities
+        // summed pairwise in read order, so that the result does not depend
+        // on the number of threads. The probability of each read given each
+        // leaf is cached: only leaves whose sequences have changed (see
+        // ``NucleotideAlignment::update_sequence()``) are rescored, unless
+        // the reads, leaves, error model or seed length have changed.
         double calc_ln_probability_of_short_reads();
+        // Forces the next ``calc_ln_probability_of_short_reads()`` to
+        // rescore every read against every leaf.
+        inline void flag_short_read_probabilities_as_dirty() {
+            this->are_short_read_probabilities_dirty_ = true;
+        }
+        // Per-read values of the last
+        // ``calc_ln_probability_of_short_reads()``.
+        inline const std::vector<double>& get_read_ln_probabilities() const {
+            return this->read_ln_probabilities_;
+        }
+        // ``num_threads`` of 0 uses one thread per hardware thread; 1 (the
+        // default) scores reads on the calling thread.
+        void set_num_read_threads(unsigned int num_threads);
+        inline unsigned int get_num_read_threads() const {
+            return this->read_thread_pool_ ? this->read_thread_pool_->get_num_threads() : 1;
+        }
+        inline void set_read_chunk_size(unsigned long read_chunk_size) {
+            TREESHREW_ASSERT(read_chunk_size > 0);
+            this->read_chunk_size_ = read_chunk_size;
+        }
+        inline unsigned long get_read_chunk_size() const {
+            return this->read_chunk_size_;
+        }
+        // 0 (the default) scores each read against every window of every
+        // leaf sequence. Otherwise, reads are scored against only the
+        // windows sharing a seed (a run of this many bases, up to
+        // ``NucleotideAlignment::MAX_SEED_LENGTH``) with them, which
+        // underestimates their log-probability by at most
+        // ``get_short_read_ln_probability_error_bound()``.
+        inline void set_short_read_seed_length(unsigned int seed_length) {
+            TREESHREW_ASSERT(seed_length <= NucleotideAlignment::MAX_SEED_LENGTH);
+            this->short_read_seed_length_ = seed_length;
+        }
+        inline unsigned int get_short_read_seed_length() const {
+            return this->short_read_seed_length_;
+        }
+        // Upper bounds on how much the last
+        // ``calc_ln_probability_of_short_reads()`` underestimated the
+        // log-probability of the reads (in total, and of each read) by
+        // skipping windows: a window sharing no seed with a read of L sites
+        // has at least L / ``seed_length`` errors, so its probability is at
+        // most the largest probability of that many or more errors. 0 if no
+        // windows were skipped.
+        inline double get_short_read_ln_probability_error_bound() const {
+            return this->short_read_ln_probability_error_bound_;
+        }
+        inline const std::vector<double>& get_read_ln_probability_error_bounds() const {
+            return this->read_ln_probability_error_bounds_;
+        }
+        // Windows (over all reads and leaves) of the last
+        // ``calc_ln_probability_of_short_reads()``, and how many of them
+        // it scored (rather than skipped, or took from the cache).
+        inline unsigned long get_num_short_read_windows() const {
+            return this->num_short_read_windows_;
+        }
+        inline unsigned long get_num_short_read_windows_scored() const {
+            return this->num_short_read_windows_scored_;
+        }
         void write_phylogenetic_data(std::ostream&);
         inline GeneTree * get_gene_tree() {
             return this->gene_tree_;
         }
+        inline NucleotideAlignment& get_alignment() {
+            return this->alignment_;
+        }
+        // Takes effect on the next call to
+        // ``initialize_with_tree_and_alignment()``.
+        inline void set_beagle_settings(const BeagleSettings& settings) {
+            this->beagle_settings_ = settings;
+        }
+        // Takes effect on the next call to
+        // ``initialize_with_tree_and_alignment()``.
+        inline void set_site_rate_model(const SiteRateModel& site_rate_model) {
+            this->site_rate_model_ = site_rate_model;
+        }
+        // Takes effect on the next call to
+        // ``initialize_with_tree_and_alignment()``.
+        inline void set_substitution_model(const SubstitutionModel& substitution_model) {
+            this->substitution_model_ = substitution_model;
+        }
+        // Used by ``calc_ln_probability_of_short_reads()``; binomial with a
+        // per-site error rate of 0.0107 by default.
+        inline void set_read_error_model(const ReadErrorModel& read_error_model) {
+            this->read_error_model_ = read_error_model;
+        }
+        inline ReadErrorModel& get_read_error_model() {
+            return this->read_error_model_;
+        }
 
     private:
+        BeagleSettings                      beagle_settings_;
+        SiteRateModel                       site_rate_model_;
+        SubstitutionModel                   substitution_model_;
+        ReadErrorModel                      read_error_model_;
         ShortReadSequences                  short_reads_;
         NucleotideAlignment                 alignment_;
         GeneTree *                          gene_tree_;
+        // nullptr if reads are scored on the calling thread
+        std::unique_ptr<ThreadPool>         read_thread_pool_;
+        unsigned long                       read_chunk_size_;
+        std::vector<double>                 read_ln_probabilities_;
+        unsigned int                        short_read_seed_length_;
+        // Cached probability (and number of windows scored) of each read
+        // given each leaf, row by row; whether each read was scored against
+        // seeded windows only; and what the cache was calculated with
+        bool                                are_short_read_probabilities_dirty_;
+        std::vector<GeneNodeData *>         short_read_leaves_;
+        std::vector<unsigned long>          short_read_leaf_versions_;
+        unsigned int                        cached_short_read_seed_length_;
+        unsigned long                       cached_read_error_model_version_;
+        std::vector<double>                 read_leaf_probabilities_;
+        std::vector<unsigned long>          read_leaf_windows_scored_;
+        std::vector<unsigned char>          is_read_seeded_;
+        double                              short_read_ln_probability_;
+        std::vector<double>                 read_ln_probability_error_bounds_;
+        unsigned long                       num_short_read_windows_;
+        unsigned long                       num_short_read_windows_scored_;
+        double                              short_read_ln_probability_error_bound_;
 
 
 }; // StateSpace
@@ -0,0 +1,73 @@
+#include "threadpool.hpp"
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// ThreadPool
+
+ThreadPool::ThreadPool(unsigned int num_threads)
+    : num_tasks_pending_(0),
+      is_stopping_(false) {
+    if (num_threads == 0) {
+        num_threads = ThreadPool::get_default_num_threads();
+    }
+    this->workers_.reserve(num_threads);
+    for (unsigned int thread_idx = 0; thread_idx < num_threads; ++thread_idx) {
+        this->workers_.emplace_back(&ThreadPool::run_worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->is_stopping_ = true;
+    }
+    this->task_available_.notify_all();
+    for (auto & worker : this->workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(const std::function<void()>& task) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->tasks_.push(task);
+        ++this->num_tasks_pending_;
+    }
+    this->task_available_.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(this->mutex_);
+    this->tasks_completed_.wait(lock, [this] { return this->num_tasks_pending_ == 0; });
+}
+
+unsigned int ThreadPool::get_default_num_threads() {
+    unsigned int num_threads = std::thread::hardware_concurrency();
+    return num_threads > 0 ? num_threads : 1;
+}
+
+void ThreadPool::run_worker() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex_);
+            this->task_available_.wait(lock, [this] { return this->is_stopping_ || !this->tasks_.empty(); });
+            if (this->tasks_.empty()) {
+                return;
+            }
+            task = std::move(this->tasks_.front());
+            this->tasks_.pop();
+        }
+        task();
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            --this->num_tasks_pending_;
+            if (this->num_tasks_pending_ == 0) {
+                this->tasks_completed_.notify_all();
+            }
+        }
+    }
+}
+
+} // namespace treeshrew
@@ -0,0 +1,51 @@
+#ifndef TREESHREW_THREADPOOL_HPP
+#define TREESHREW_THREADPOOL_HPP
+
+#include <vector>
+#include <queue>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace treeshrew {
+
+////////////////////////////////////////////////////////////////////////////////
+// ThreadPool
+
+// Fixed set of worker threads running submitted tasks in submission order.
+// Tasks must not throw.
+class ThreadPool {
+
+    public:
+        // ``num_threads`` of 0 uses one thread per hardware thread.
+        ThreadPool(unsigned int num_threads=0);
+        ~ThreadPool();
+        void submit(const std::function<void()>& task);
+        // Blocks until all submitted tasks have completed.
+        void wait();
+        inline unsigned int get_num_threads() const {
+            return this->workers_.size();
+        }
+
+        static unsigned int get_default_num_threads();
+
+    private:
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+        void run_worker();
+
+    private:
+        std::vector<std::thread>                workers_;
+        std::queue<std::function<void()>>       tasks_;
+        std::mutex                              mutex_;
+        std::condition_variable                 task_available_;
+        std::condition_variable                 tasks_completed_;
+        unsigned long                           num_tasks_pending_;
+        bool                                    is_stopping_;
+
+}; // ThreadPool
+
+} // namespace treeshrew
+
+#endif
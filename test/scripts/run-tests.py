@@ -10,6 +10,8 @@ import argparse
 import inspect
 import subprocess
 import re
+import random
+import tempfile
 
 import dendropy
 from dendropy import treecalc
@@ -209,6 +211,31 @@ class TestRunner(object):
             return False
         return True
 
+    def write_short_reads(self, data_filepath, num_reads, read_lengths=(36, 50, 100), error_rate=0.02, seed=1):
+        """
+        Writes ``num_reads`` reads, copied (with errors) from random windows
+        of the ungapped sequences in the FASTA file ``data_filepath``, to a
+        temporary FASTA file, and returns its path (for the caller to remove).
+        """
+        rng = random.Random(seed)
+        sequences = []
+        for line in open(data_filepath):
+            line = line.strip()
+            if line.startswith(">"):
+                sequences.append("")
+            elif sequences:
+                sequences[-1] += re.sub("[^ACGT]", "", line.upper())
+        f = tempfile.NamedTemporaryFile(mode="w", suffix=".fasta", delete=False)
+        for read_idx in range(num_reads):
+            sequence = rng.choice(sequences)
+            read_length = rng.choice(read_lengths)
+            offset = rng.randrange(len(sequence) - read_length + 1)
+            read = [rng.choice("ACGT") if rng.random() < error_rate else c
+                    for c in sequence[offset:offset+read_length]]
+            f.write(">read{}\n{}\n".format(read_idx, "".join(read)))
+        f.close()
+        return f.name
+
     def compare_trees(self, tree1, tree2):
         status = TestRunner.PASS
         tree1.update_splits()
@@ -363,6 +390,245 @@ class TestRunner(object):
     def test_tree_score2(self):
         return self.compare_tree_scores("pythonidae.tree.newick", "pythonidae.chars.fasta")
 
+    def compare_incremental_tree_scores(self, tree_filename, data_filename):
+        full_tree_filepath = os.path.join(self.data_dir, "basic", tree_filename)
+        full_data_filepath = os.path.join(self.data_dir, "basic", data_filename)
+        self.execute_test("incremental_likelihood",
+                [full_tree_filepath, full_data_filepath])
+        if self.test_retcode != 0:
+            return self.fail("Incremental log-likelihoods do not match full recalculation (tree: '{}', data: '{}'): {}".format(tree_filename, data_filename, self.test_stderr))
+        return TestRunner.PASS
+
+    def test_incremental_tree_score1(self):
+        return self.compare_incremental_tree_scores("primates.beast.mcct.medianh.newick.tre", "primates.chars.fasta")
+
+    def test_incremental_tree_score2(self):
+        return self.compare_incremental_tree_scores("pythonidae.tree.newick", "pythonidae.chars.fasta")
+
+    def compare_substitution_model_scores(self, tree_filename, data_filename):
+        full_tree_filepath = os.path.join(self.data_dir, "basic", tree_filename)
+        full_data_filepath = os.path.join(self.data_dir, "basic", data_filename)
+        self.execute_test("substitution_models",
+                [full_tree_filepath, full_data_filepath])
+        if self.test_retcode != 0:
+            return self.fail("Substitution model log-likelihoods are inconsistent (tree: '{}', data: '{}'): {}".format(tree_filename, data_filename, self.test_stderr))
+        return TestRunner.PASS
+
+    def test_substitution_model_scores1(self):
+        return self.compare_substitution_model_scores("primates.beast.mcct.medianh.newick.tre", "primates.chars.fasta")
+
+    def test_substitution_model_scores2(self):
+        return self.compare_substitution_model_scores("pythonidae.tree.newick", "pythonidae.chars.fasta")
+
+    def check_edge_length_optimization(self, tree_filename, data_filename):
+        full_tree_filepath = os.path.join(self.data_dir, "basic", tree_filename)
+        full_data_filepath = os.path.join(self.data_dir, "basic", data_filename)
+        self.execute_test("edge_length_optimization",
+                [full_tree_filepath, full_data_filepath])
+        if self.test_retcode != 0:
+            return self.fail("Edge length derivatives or optimization failed (tree: '{}', data: '{}'): {}".format(tree_filename, data_filename, self.test_stderr))
+        return TestRunner.PASS
+
+    def test_edge_length_optimization1(self):
+        return self.check_edge_length_optimization("primates.beast.mcct.medianh.newick.tre", "primates.chars.fasta")
+
+    def test_edge_length_optimization2(self):
+        return self.check_edge_length_optimization("pythonidae.tree.newick", "pythonidae.chars.fasta")
+
+    def compare_native_engine_scores(self, tree_filename, data_filename, native_settings=""):
+        full_tree_filepath = os.path.join(self.data_dir, "basic", tree_filename)
+        full_data_filepath = os.path.join(self.data_dir, "basic", data_filename)
+        self.execute_test("native_likelihood_engine",
+                [full_tree_filepath, full_data_filepath, native_settings])
+        if self.test_retcode != 0:
+            return self.fail("Native engine log-likelihoods do not match BEAGLE (tree: '{}', data: '{}'): {}".format(tree_filename, data_filename, self.test_stderr))
+        return TestRunner.PASS
+
+    def test_native_engine_scores1(self):
+        return self.compare_native_engine_scores("primates.beast.mcct.medianh.newick.tre", "primates.chars.fasta")
+
+    def test_native_engine_scores2(self):
+        return self.compare_native_engine_scores("pythonidae.tree.newick", "pythonidae.chars.fasta")
+
+    def test_threaded_native_engine_scores1(self):
+        return self.compare_native_engine_scores("primates.beast.mcct.medianh.newick.tre", "primates.chars.fasta", "threaded")
+
+    def test_threaded_native_engine_scores2(self):
+        return self.compare_native_engine_scores("pythonidae.tree.newick", "pythonidae.chars.fasta", "threaded")
+
+    def compare_precision_scores(self, tree_filename, data_filename, beagle_settings):
+        full_tree_filepath = os.path.join(self.data_dir, "basic", tree_filename)
+        full_data_filepath = os.path.join(self.data_dir, "basic", data_filename)
+        self.execute_test("precision_divergence",
+                [full_tree_filepath, full_data_filepath, beagle_settings])
+        if self.test_retcode != 0:
+            return self.fail("Single precision log-likelihood diverges from double precision (tree: '{}', data: '{}', settings: '{}'): {}".format(tree_filename, data_filename, beagle_settings, self.test_stderr))
+        return TestRunner.PASS
+
+    def test_precision_divergence1(self):
+        return self.compare_precision_scores("primates.beast.mcct.medianh.newick.tre", "primates.chars.fasta", "native")
+
+    def test_precision_divergence2(self):
+        return self.compare_precision_scores("pythonidae.tree.newick", "pythonidae.chars.fasta", "native")
+
+    def test_precision_divergence3(self):
+        return self.compare_precision_scores("pythonidae.tree.newick", "pythonidae.chars.fasta", "cpu")
+
+    def compare_checkpointed_scores(self, tree_filename, data_filename, beagle_settings):
+        full_tree_filepath = os.path.join(self.data_dir, "basic", tree_filename)
+        full_data_filepath = os.path.join(self.data_dir, "basic", data_filename)
+        self.execute_test("checkpointed_partials",
+                [full_tree_filepath, full_data_filepath, beagle_settings])
+        if self.test_retcode != 0:
+            return self.fail("Memory-bounded log-likelihoods do not match unbounded (tree: '{}', data: '{}', settings: '{}'): {}".format(tree_filename, data_filename, beagle_settings, self.test_stderr))
+        return TestRunner.PASS
+
+    def test_checkpointed_partials1(self):
+        return self.compare_checkpointed_scores("primates.beast.mcct.medianh.newick.tre", "primates.chars.fasta", "native")
+
+    def test_checkpointed_partials2(self):
+        return self.compare_checkpointed_scores("pythonidae.tree.newick", "pythonidae.chars.fasta", "native")
+
+    def test_checkpointed_partials3(self):
+        return self.compare_checkpointed_scores("pythonidae.tree.newick", "pythonidae.chars.fasta", "cpu")
+
+    def test_pooled_tree_scoring(self):
+        data_filepath = os.path.join(self.data_dir, "basic", "pythonidae.chars.fasta")
+        tree_filepaths = [os.path.join(self.data_dir, "basic", f) for f in ("pythonidae.tree.newick", "pythonidae.rotated.newick")]
+        self.execute_test("pooled_tree_scoring",
+                [data_filepath] + tree_filepaths)
+        if self.test_retcode != 0:
+            return self.fail("Pooled tree scoring failed: {}".format(self.test_stderr))
+        return TestRunner.PASS
+
+    def test_batch_tree_scoring(self):
+        tree_filepath = os.path.join(self.data_dir, "basic", "pythonidae.trees.newick")
+        data_filepath = os.path.join(self.data_dir, "basic", "pythonidae.chars.fasta")
+        self.execute_test("score_phylogenetic_tree",
+                [os.path.join(self.data_dir, "basic", "pythonidae.tree.newick"), data_filepath])
+        if self.test_retcode != 0:
+            return TestRunner.ERROR
+        check_ln_like = float(self.test_stdout)
+        ln_likes = {}
+        for num_threads in ("1", "4"):
+            self.execute_test("score_trees",
+                    [tree_filepath, data_filepath, "newick", num_threads])
+            if self.test_retcode != 0:
+                return TestRunner.ERROR
+            ln_likes[num_threads] = [float(v) for v in self.test_stdout.split()]
+        if len(ln_likes["1"]) != 6:
+            return self.fail("Expected 6 log-likelihoods, but found {}".format(len(ln_likes["1"])))
+        if ln_likes["1"] != ln_likes["4"]:
+            return self.fail("Log-likelihoods differ with number of threads: {} vs. {}".format(ln_likes["1"], ln_likes["4"]))
+        # first two trees are the same tree, with children in reverse order
+        for ln_like in ln_likes["1"][:2]:
+            if not self.is_almost_equal(check_ln_like, ln_like):
+                return self.fail("Unequal log-likelihoods: {} vs. {}".format(check_ln_like, ln_like))
+        return TestRunner.PASS
+
+    def check_batched_instance_scores(self, beagle_settings):
+        tree_filepath = os.path.join(self.data_dir, "basic", "pythonidae.trees.newick")
+        data_filepath = os.path.join(self.data_dir, "basic", "pythonidae.chars.fasta")
+        ln_likes = {}
+        # 6 trees: one at a time, a full and a partial block, and one block
+        for trees_per_instance in ("1", "4", "6"):
+            self.execute_test("score_trees",
+                    [tree_filepath, data_filepath, "newick", "2", beagle_settings, trees_per_instance])
+            if self.test_retcode != 0:
+                return self.fail("Batched tree scoring failed: {}".format(self.test_stderr))
+            ln_likes[trees_per_instance] = [float(v) for v in self.test_stdout.split()]
+        for trees_per_instance in ("4", "6"):
+            if len(ln_likes[trees_per_instance]) != len(ln_likes["1"]):
+                return self.fail("Expected {} log-likelihoods, but found {}".format(len(ln_likes["1"]), len(ln_likes[trees_per_instance])))
+            for ln_like, check_ln_like in zip(ln_likes[trees_per_instance], ln_likes["1"]):
+                if not self.is_almost_equal(check_ln_like, ln_like):
+                    return self.fail("Log-likelihoods differ with {} trees per instance: {} vs. {}".format(trees_per_instance, ln_likes[trees_per_instance], ln_likes["1"]))
+        return TestRunner.PASS
+
+    def test_batched_instance_scoring1(self):
+        return self.check_batched_instance_scores("")
+
+    def test_batched_instance_scoring2(self):
+        return self.check_batched_instance_scores("native")
+
+    def test_multi_locus_likelihood(self):
+        loci = [("primates.beast.mcct.medianh.newick.tre", "primates.chars.fasta"),
+                ("pythonidae.tree.newick", "pythonidae.chars.fasta"),
+                ("pythonidae.rotated.newick", "pythonidae.chars.fasta")]
+        args = []
+        for tree_filename, data_filename in loci:
+            args.append(os.path.join(self.data_dir, "basic", tree_filename))
+            args.append(os.path.join(self.data_dir, "basic", data_filename))
+        self.execute_test("multi_locus_likelihood", args)
+        if self.test_retcode != 0:
+            return self.fail("Multi-locus log-likelihoods do not match single loci: {}".format(self.test_stderr))
+        return TestRunner.PASS
+
+    def test_threaded_short_read_likelihood(self):
+        data_filepath = os.path.join(self.data_dir, "basic", "pythonidae.chars.fasta")
+        tree_filepath = os.path.join(self.data_dir, "basic", "pythonidae.tree.newick")
+        short_read_filepath = self.write_short_reads(data_filepath, 300)
+        try:
+            self.execute_test("threaded_short_read_likelihood",
+                    [short_read_filepath, data_filepath, tree_filepath])
+        finally:
+            os.remove(short_read_filepath)
+        if self.test_retcode != 0:
+            return self.fail("Multi-threaded short read log-probabilities are not identical to single-threaded: {}".format(self.test_stderr))
+        return TestRunner.PASS
+
+    def test_seeded_short_read_likelihood(self):
+        data_filepath = os.path.join(self.data_dir, "basic", "pythonidae.chars.fasta")
+        tree_filepath = os.path.join(self.data_dir, "basic", "pythonidae.tree.newick")
+        short_read_filepath = self.write_short_reads(data_filepath, 300)
+        try:
+            self.execute_test("seeded_short_read_likelihood",
+                    [short_read_filepath, data_filepath, tree_filepath])
+        finally:
+            os.remove(short_read_filepath)
+        if self.test_retcode != 0:
+            return self.fail("Seeded short read log-probabilities are not within their error bounds: {}".format(self.test_stderr))
+        return TestRunner.PASS
+
+    def test_incremental_short_read_likelihood(self):
+        data_filepath = os.path.join(self.data_dir, "basic", "pythonidae.chars.fasta")
+        tree_filepath = os.path.join(self.data_dir, "basic", "pythonidae.tree.newick")
+        short_read_filepath = self.write_short_reads(data_filepath, 100)
+        try:
+            self.execute_test("incremental_short_read_likelihood",
+                    [short_read_filepath, data_filepath, tree_filepath])
+        finally:
+            os.remove(short_read_filepath)
+        if self.test_retcode != 0:
+            return self.fail("Incremental short read log-probabilities are not identical to rescored: {}".format(self.test_stderr))
+        return TestRunner.PASS
+
+    def test_rell_bootstrap(self):
+        tree_filepath = os.path.join(self.data_dir, "basic", "pythonidae.trees.newick")
+        data_filepath = os.path.join(self.data_dir, "basic", "pythonidae.chars.fasta")
+        self.execute_test("rell_bootstrap",
+                [tree_filepath, data_filepath, "newick", "1000"])
+        if self.test_retcode != 0:
+            return self.fail("RELL bootstrap failed: {}".format(self.test_stderr))
+        proportions = [float(v) for v in self.test_stdout.split()]
+        if len(proportions) != 6:
+            return self.fail("Expected 6 bootstrap proportions, but found {}".format(len(proportions)))
+        if not self.is_almost_equal(sum(proportions), 1.0):
+            return self.fail("Bootstrap proportions do not sum to 1: {}".format(proportions))
+        return TestRunner.PASS
+
+    def test_packed_mismatch_count(self):
+        self.execute_test("packed_mismatch_count")
+        if self.test_retcode != 0:
+            return self.fail("Packed mismatch counts do not match state comparisons: {}".format(self.test_stderr))
+        return TestRunner.PASS
+
+    def test_read_error_model(self):
+        self.execute_test("read_error_model")
+        if self.test_retcode != 0:
+            return self.fail("Read error probability tables do not match error distributions: {}".format(self.test_stderr))
+        return TestRunner.PASS
+
     def test_tree_read_from_file(self):
         treefile = os.path.join(self.data_dir, "basic", "bird_orders.nex")
         self.execute_test("read_tree",
@@ -167,16 +167,20 @@ void run_child_iteration(const std::vector<treeshrew::GeneTree *>& trees,
 void run_tree_scoring(
         std::vector<treeshrew::GeneTree *>& trees,
         treeshrew::NucleotideSequences& data,
+        const treeshrew::BeagleSettings& beagle_settings,
         TimeLogger& time_logger,
         unsigned long nreps) {
     RunClock * clock = nullptr;
     for (unsigned long i = 0; i < nreps; ++i) {
         for (auto & tree : trees) {
+            tree->set_beagle_settings(beagle_settings);
             clock = time_logger.get_timer("Likelihood");
             clock->start();
-            tree->create_beagle_instance(data.get_num_sites());
+            tree->create_beagle_instance(data.get_num_patterns(), data.get_num_compact_sequences());
             data.set_tip_data(tree);
             tree->calc_ln_probability();
+            // return the instance (and its tip data) for the next tree
+            tree->free_beagle_instance();
             clock->stop();
         }
     }
@@ -184,7 +188,7 @@ void run_tree_scoring(
 
 int main(int argc, char * argv[]) {
     if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <NEWICK-TREEFILE> <FASTA-DATAFILE>" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <NEWICK-TREEFILE> <FASTA-DATAFILE> [NREPS] [BEAGLE-SETTINGS]" << std::endl;
         exit(1);
     }
     std::string tree_filepath(argv[1]);
@@ -193,9 +197,14 @@ int main(int argc, char * argv[]) {
     if (argc >= 4) {
         std::istringstream(argv[3]) >> nreps;
     }
+    treeshrew::BeagleSettings beagle_settings;
+    if (argc >= 5) {
+        beagle_settings.parse(argv[4]);
+    }
 
     treeshrew::NucleotideSequences data;
     treeshrew::sequenceio::read_from_filepath(data, data_filepath, "fasta");
+    data.compress_patterns();
     std::vector<treeshrew::GeneTree *> trees;
     treeshrew::treeio::read_from_filepath(trees, tree_filepath, "newick");
 
@@ -204,9 +213,16 @@ int main(int argc, char * argv[]) {
     run_postorder_iteration(trees, time_logger, nreps);
     run_leaf_iteration(trees, time_logger, nreps);
     run_child_iteration(trees, time_logger, nreps);
-    run_tree_scoring(trees, data, time_logger, nreps);
+    run_tree_scoring(trees, data, beagle_settings, time_logger, nreps);
 
     time_logger.summarize(std::cout);
+    if (!trees.empty()) {
+        trees[0]->create_beagle_instance(data.get_num_patterns(), data.get_num_compact_sequences());
+        trees[0]->write_beagle_instance_details(std::cout);
+    }
+    treeshrew::BeagleInstancePool& pool = treeshrew::BeagleInstancePool::get_pool();
+    std::cout << "BEAGLE instances created: " << pool.get_num_instances_created()
+        << " (" << pool.get_num_check_outs() << " check-outs)" << std::endl;
 }
 
 
@@ -0,0 +1,94 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include "../src/statespace.hpp"
+
+treeshrew::StateSpace * load_state_space(const char * tree_filepath,
+        const char * data_filepath,
+        const treeshrew::BeagleSettings& beagle_settings) {
+    std::ifstream tree_src(tree_filepath);
+    std::ifstream data_src(data_filepath);
+    treeshrew::StateSpace * state_space = new treeshrew::StateSpace(100, 50000);
+    state_space->set_beagle_settings(beagle_settings);
+    state_space->set_site_rate_model(treeshrew::SiteRateModel(4, true, 0.5, 0.2));
+    state_space->initialize_with_tree_and_alignment(tree_src, data_src);
+    return state_space;
+}
+
+// Scores a tree under partials memory budgets from the smallest allowed
+// (no checkpoints) upwards, and checks that the log-likelihood matches that
+// of the unbounded tree initially, after changing each edge in turn, and
+// through proposals that are accepted or rejected. ``BEAGLE-SETTINGS``
+// (e.g., "native") is applied to both trees.
+int main(int argc, char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: checkpointed_partials <NEWICK-TREEFILE> <FASTA-DATAFILE> [BEAGLE-SETTINGS]" << std::endl;
+        exit(1);
+    }
+    treeshrew::BeagleSettings beagle_settings;
+    if (argc >= 4) {
+        beagle_settings.parse(argv[3]);
+    }
+    int num_fails = 0;
+    for (unsigned long num_extra_buffers : {0, 2, 8, 1000}) {
+        treeshrew::StateSpace * check_state_space = load_state_space(argv[1], argv[2], beagle_settings);
+        treeshrew::GeneTree * check_tree = check_state_space->get_gene_tree();
+        treeshrew::BeagleSettings bounded_settings = beagle_settings;
+        bounded_settings.set_partials_memory_budget(check_tree->get_min_partials_memory_budget()
+                + num_extra_buffers * check_tree->get_partials_buffer_size());
+        treeshrew::StateSpace * state_space = load_state_space(argv[1], argv[2], bounded_settings);
+        treeshrew::GeneTree * tree = state_space->get_gene_tree();
+        if (!tree->is_partials_memory_bounded()) {
+            std::cerr << "Budget of " << bounded_settings.get_partials_memory_budget()
+                << " bytes did not bound the partials" << std::endl;
+            ++num_fails;
+        }
+        auto compare = [&](const std::string& description) {
+            double ln_like = tree->calc_ln_probability();
+            double check_ln_like = check_tree->calc_ln_probability();
+            if (std::fabs(ln_like - check_ln_like) > 1e-8) {
+                std::cerr << num_extra_buffers << " extra buffers, " << description << ": log-likelihood "
+                    << std::setprecision(12) << ln_like << " does not match unbounded " << check_ln_like << std::endl;
+                ++num_fails;
+            }
+        };
+        compare("initial");
+        // both trees are read from the same file, so their nodes are visited
+        // in the same order
+        auto check_ndi = check_tree->postorder_begin();
+        unsigned long node_idx = 0;
+        for (auto ndi = tree->postorder_begin(); ndi != tree->postorder_end(); ++ndi, ++check_ndi, ++node_idx) {
+            if (ndi.node() == tree->head_node()) {
+                continue;
+            }
+            double edge_len = ndi->get_edge_length() * 1.5 + 0.01;
+            tree->set_edge_length(ndi.node(), edge_len);
+            check_tree->set_edge_length(check_ndi.node(), edge_len);
+            compare("edge " + ndi->get_label());
+            tree->begin_proposal();
+            check_tree->begin_proposal();
+            tree->set_edge_length(ndi.node(), edge_len * 0.5);
+            check_tree->set_edge_length(check_ndi.node(), edge_len * 0.5);
+            compare("proposed edge " + ndi->get_label());
+            if (node_idx % 2 == 0) {
+                tree->accept_proposal();
+                check_tree->accept_proposal();
+            } else {
+                tree->reject_proposal();
+                check_tree->reject_proposal();
+            }
+            compare("after proposal on edge " + ndi->get_label());
+        }
+        std::cout << num_extra_buffers << " extra buffers: " << tree->get_num_checkpoint_nodes() << " checkpoints, "
+            << std::setprecision(12) << tree->calc_ln_probability() << std::endl;
+        delete state_space;
+        delete check_state_space;
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}
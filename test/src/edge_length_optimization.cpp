@@ -0,0 +1,102 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <cmath>
+#include "../src/statespace.hpp"
+
+// Checks edge log-likelihoods (along each root path, and for all edges
+// from a single pre-order pass) and their derivatives against the full
+// (root) likelihood and finite differences, and that Newton-Raphson
+// optimization of all edge lengths improves the likelihood and leaves each
+// edge at a stationary point.
+int main(int argc, char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: edge_length_optimization <NEWICK-TREEFILE> <FASTA-DATAFILE>" << std::endl;
+        exit(1);
+    }
+    std::ifstream tree_src(argv[1]);
+    std::ifstream data_src(argv[2]);
+    treeshrew::StateSpace state_space(100, 50000);
+    treeshrew::SubstitutionModel hky("HKY85");
+    hky.set_kappa(4.0);
+    hky.set_state_frequencies({0.3, 0.2, 0.22, 0.28});
+    state_space.set_substitution_model(hky);
+    state_space.set_site_rate_model(treeshrew::SiteRateModel(4, true, 0.5, 0.2));
+    state_space.initialize_with_tree_and_alignment(tree_src, data_src);
+    treeshrew::GeneTree * tree = state_space.get_gene_tree();
+    double initial_ln_like = tree->calc_ln_probability();
+    std::cout << std::setprecision(12) << initial_ln_like << std::endl;
+    int num_fails = 0;
+
+    // a single pre-order pass gives the log-likelihood across every edge
+    std::vector<treeshrew::GeneTree::GeneTreeNode *> edge_nodes;
+    std::vector<double> edge_ln_likes;
+    tree->calc_edge_ln_probabilities(edge_nodes, edge_ln_likes);
+    for (unsigned long edge_idx = 0; edge_idx < edge_nodes.size(); ++edge_idx) {
+        if (std::fabs(edge_ln_likes[edge_idx] - initial_ln_like) > 1e-6) {
+            std::cerr << "Node '" << edge_nodes[edge_idx]->data().get_label() << "': pre-order edge log-likelihood "
+                << std::setprecision(12) << edge_ln_likes[edge_idx]
+                << " does not match root log-likelihood " << initial_ln_like << std::endl;
+            ++num_fails;
+        }
+    }
+
+    for (auto ndi = tree->postorder_begin(); ndi != tree->postorder_end(); ++ndi) {
+        if (ndi.node() == tree->head_node()) {
+            continue;
+        }
+        double edge_len = ndi->get_edge_length();
+        double first_derivative = 0.0;
+        double second_derivative = 0.0;
+        double edge_ln_like = tree->calc_edge_ln_probability_derivatives(ndi.node(), first_derivative, second_derivative);
+        if (std::fabs(edge_ln_like - initial_ln_like) > 1e-6) {
+            std::cerr << "Node '" << ndi->get_label() << "': edge log-likelihood "
+                << std::setprecision(12) << edge_ln_like
+                << " does not match root log-likelihood " << initial_ln_like << std::endl;
+            ++num_fails;
+        }
+        double h = edge_len * 1e-4;
+        double d0 = 0.0;
+        double dd0 = 0.0;
+        double ln_like_plus = tree->calc_edge_ln_probability_derivatives(ndi.node(), edge_len + h, d0, dd0);
+        double ln_like_minus = tree->calc_edge_ln_probability_derivatives(ndi.node(), edge_len - h, d0, dd0);
+        double fd_first_derivative = (ln_like_plus - ln_like_minus) / (2 * h);
+        double fd_second_derivative = (ln_like_plus - 2 * edge_ln_like + ln_like_minus) / (h * h);
+        if (std::fabs(fd_first_derivative - first_derivative) > 1e-4 * std::max(1.0, std::fabs(first_derivative))
+                || std::fabs(fd_second_derivative - second_derivative) > 1e-2 * std::max(1.0, std::fabs(second_derivative))) {
+            std::cerr << "Node '" << ndi->get_label() << "': derivatives "
+                << std::setprecision(12) << first_derivative << ", " << second_derivative
+                << " do not match finite differences " << fd_first_derivative << ", " << fd_second_derivative << std::endl;
+            ++num_fails;
+        }
+    }
+
+    double optimized_ln_like = tree->optimize_edge_lengths(1e-6);
+    std::cout << std::setprecision(12) << optimized_ln_like << std::endl;
+    tree->flag_all_as_dirty();
+    double full_ln_like = tree->calc_ln_probability();
+    if (optimized_ln_like < initial_ln_like || std::fabs(optimized_ln_like - full_ln_like) > 1e-8) {
+        std::cerr << "Optimized log-likelihood " << std::setprecision(12) << optimized_ln_like
+            << " (full recalculation: " << full_ln_like << ") is not an improvement on "
+            << initial_ln_like << std::endl;
+        ++num_fails;
+    }
+    for (auto ndi = tree->postorder_begin(); ndi != tree->postorder_end(); ++ndi) {
+        if (ndi.node() == tree->head_node() || ndi->get_edge_length() <= 1e-6) {
+            continue;
+        }
+        double first_derivative = 0.0;
+        double second_derivative = 0.0;
+        tree->calc_edge_ln_probability_derivatives(ndi.node(), first_derivative, second_derivative);
+        // at a stationary point, a further Newton-Raphson step is negligible
+        if (std::fabs(first_derivative) > 1e-2 && std::fabs(first_derivative / second_derivative) > 1e-5) {
+            std::cerr << "Node '" << ndi->get_label() << "': optimized edge length "
+                << ndi->get_edge_length() << " has nonzero derivative " << first_derivative << std::endl;
+            ++num_fails;
+        }
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}
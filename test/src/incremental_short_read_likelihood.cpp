@@ -0,0 +1,97 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include "../src/statespace.hpp"
+
+treeshrew::StateSpace * load_state_space(const char * short_read_filepath,
+        const char * data_filepath,
+        const char * tree_filepath) {
+    std::ifstream short_read_src(short_read_filepath);
+    std::ifstream data_src(data_filepath);
+    std::ifstream tree_src(tree_filepath);
+    treeshrew::BeagleSettings beagle_settings;
+    beagle_settings.set_native_engine();
+    treeshrew::StateSpace * state_space = new treeshrew::StateSpace(100, 50000);
+    state_space->set_beagle_settings(beagle_settings);
+    state_space->load_short_reads(short_read_src);
+    state_space->initialize_with_tree_and_alignment(tree_src, data_src);
+    return state_space;
+}
+
+// Changes the sequence of each leaf in turn (copying a stretch of another
+// leaf's sequence into it, and changing a few sites), and checks that the
+// log-probability of short reads, rescoring only the changed leaf, is
+// bit-identical to that of rescoring every leaf, and that only the windows
+// of the changed leaf are scored. Exhaustive and seeded scoring are checked.
+int main(int argc, char * argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: incremental_short_read_likelihood <SHORT-READ-DATAFILE> <ALIGNMENT-DATAFILE> <TREE-FILE>" << std::endl;
+        exit(1);
+    }
+    int num_fails = 0;
+    for (unsigned int seed_length : {0, 11}) {
+        treeshrew::StateSpace * state_space = load_state_space(argv[1], argv[2], argv[3]);
+        treeshrew::StateSpace * check_state_space = load_state_space(argv[1], argv[2], argv[3]);
+        state_space->set_short_read_seed_length(seed_length);
+        check_state_space->set_short_read_seed_length(seed_length);
+        state_space->calc_ln_probability_of_short_reads();
+        // both trees are read from the same file, so their leaves are
+        // visited in the same order
+        std::vector<treeshrew::GeneNodeData *> leaves;
+        std::vector<treeshrew::GeneNodeData *> check_leaves;
+        for (auto ndi = state_space->get_gene_tree()->leaf_begin(); ndi != state_space->get_gene_tree()->leaf_end(); ++ndi) {
+            leaves.push_back(&(*ndi));
+        }
+        for (auto ndi = check_state_space->get_gene_tree()->leaf_begin(); ndi != check_state_space->get_gene_tree()->leaf_end(); ++ndi) {
+            check_leaves.push_back(&(*ndi));
+        }
+        unsigned long num_sites = state_space->get_alignment().get_num_active_sites();
+        for (unsigned long leaf_idx = 0; leaf_idx < leaves.size(); ++leaf_idx) {
+            unsigned long src_leaf_idx = (leaf_idx + 1) % leaves.size();
+            unsigned long begin_site = (leaf_idx * 97) % (num_sites - 200);
+            for (auto & space_leaves : {std::make_pair(state_space, &leaves), std::make_pair(check_state_space, &check_leaves)}) {
+                treeshrew::NucleotideAlignment& alignment = space_leaves.first->get_alignment();
+                treeshrew::GeneNodeData * leaf = (*space_leaves.second)[leaf_idx];
+                auto states = alignment.sequence_states_begin(leaf);
+                auto src_states = alignment.sequence_states_cbegin((*space_leaves.second)[src_leaf_idx]);
+                std::copy(src_states + begin_site, src_states + begin_site + 150, states + begin_site);
+                for (unsigned long site_idx = begin_site + 10; site_idx < begin_site + 200; site_idx += 37) {
+                    states[site_idx] = (states[site_idx] + 1) % 4;
+                }
+                alignment.update_sequence(leaf);
+            }
+            double ln_prob = state_space->calc_ln_probability_of_short_reads();
+            check_state_space->flag_short_read_probabilities_as_dirty();
+            double check_ln_prob = check_state_space->calc_ln_probability_of_short_reads();
+            if (ln_prob != check_ln_prob
+                    || state_space->get_read_ln_probabilities() != check_state_space->get_read_ln_probabilities()
+                    || state_space->get_short_read_ln_probability_error_bound() != check_state_space->get_short_read_ln_probability_error_bound()) {
+                std::cerr << "Seed length " << seed_length << ", leaf " << leaf_idx << ": log-probability "
+                    << std::setprecision(17) << ln_prob << " is not identical to rescored " << check_ln_prob << std::endl;
+                ++num_fails;
+            }
+            if (seed_length == 0 && state_space->get_num_short_read_windows_scored()
+                    != state_space->get_num_short_read_windows() / leaves.size()) {
+                std::cerr << "Leaf " << leaf_idx << ": " << state_space->get_num_short_read_windows_scored()
+                    << " windows scored, rather than those of the changed leaf only ("
+                    << state_space->get_num_short_read_windows() / leaves.size() << ")" << std::endl;
+                ++num_fails;
+            }
+        }
+        if (state_space->calc_ln_probability_of_short_reads() != check_state_space->calc_ln_probability_of_short_reads()
+                || state_space->get_num_short_read_windows_scored() != 0) {
+            std::cerr << "Seed length " << seed_length << ": unchanged sequences were rescored" << std::endl;
+            ++num_fails;
+        }
+        std::cout << "seed length " << seed_length << ": " << std::setprecision(12)
+            << state_space->calc_ln_probability_of_short_reads() << std::endl;
+        delete state_space;
+        delete check_state_space;
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}
@@ -0,0 +1,69 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include "../src/multilocus.hpp"
+
+// Loads each (tree, alignment) pair as a locus, and checks that the
+// multi-locus log-likelihood is the sum of those of the loci scored on
+// their own, both initially and after perturbing an edge of each locus in
+// turn (so that only that locus is recalculated).
+int main(int argc, char * argv[]) {
+    if (argc < 3 || (argc - 1) % 2 != 0) {
+        std::cerr << "Usage: multi_locus_likelihood <NEWICK-TREEFILE> <FASTA-DATAFILE> [<NEWICK-TREEFILE> <FASTA-DATAFILE> ...]" << std::endl;
+        exit(1);
+    }
+    treeshrew::SiteRateModel site_rate_model(4, true, 0.5, 0.2);
+    treeshrew::MultiLocusStateSpace multi_locus(100, 50000, 4);
+    multi_locus.set_site_rate_model(site_rate_model);
+    std::vector<treeshrew::StateSpace *> single_loci;
+    for (int argi = 1; argi < argc; argi += 2) {
+        std::ifstream tree_src(argv[argi]);
+        std::ifstream data_src(argv[argi + 1]);
+        multi_locus.add_locus(tree_src, data_src);
+        std::ifstream single_tree_src(argv[argi]);
+        std::ifstream single_data_src(argv[argi + 1]);
+        treeshrew::StateSpace * single_locus = new treeshrew::StateSpace(100, 50000);
+        single_locus->set_site_rate_model(site_rate_model);
+        single_locus->initialize_with_tree_and_alignment(single_tree_src, single_data_src);
+        single_loci.push_back(single_locus);
+    }
+    int num_fails = 0;
+    for (unsigned long round = 0; round <= multi_locus.get_num_loci(); ++round) {
+        if (round > 0) {
+            // lengthen the first edge below the root of one locus
+            unsigned long locus_idx = round - 1;
+            for (auto gene_tree : {multi_locus.get_gene_tree(locus_idx), single_loci[locus_idx]->get_gene_tree()}) {
+                treeshrew::GeneTree::GeneTreeNode * nd = gene_tree->head_node()->first_child_node();
+                gene_tree->set_edge_length(nd, nd->data().get_edge_length() * 1.5 + 0.01);
+            }
+        }
+        double ln_like = multi_locus.calc_ln_probability();
+        double check_ln_like = 0.0;
+        for (unsigned long locus_idx = 0; locus_idx < single_loci.size(); ++locus_idx) {
+            double locus_ln_like = single_loci[locus_idx]->get_gene_tree()->calc_ln_probability();
+            check_ln_like += locus_ln_like;
+            if (std::fabs(locus_ln_like - multi_locus.get_locus_ln_probability(locus_idx)) > 1e-8) {
+                std::cerr << "Round " << round << ", locus " << locus_idx + 1 << ": log-likelihood "
+                    << std::setprecision(12) << multi_locus.get_locus_ln_probability(locus_idx)
+                    << " does not match single-locus log-likelihood " << locus_ln_like << std::endl;
+                ++num_fails;
+            }
+        }
+        std::cout << std::setprecision(12) << ln_like << std::endl;
+        if (std::fabs(ln_like - check_ln_like) > 1e-8) {
+            std::cerr << "Round " << round << ": multi-locus log-likelihood " << std::setprecision(12) << ln_like
+                << " does not match sum over single loci " << check_ln_like << std::endl;
+            ++num_fails;
+        }
+    }
+    for (auto & single_locus : single_loci) {
+        delete single_locus;
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}
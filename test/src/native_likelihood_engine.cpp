@@ -0,0 +1,98 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <cmath>
+#include "../src/statespace.hpp"
+
+// Scores a tree with the native engine and with BEAGLE (under HKY85 with
+// discrete-gamma rates and invariant sites), and checks that the root
+// log-likelihoods, edge log-likelihoods and their derivatives, and
+// incremental recalculation after an edge length change all agree.
+// ``NATIVE-SETTINGS`` (e.g., "threaded") further configures the native
+// engine, which is given 4 threads if threaded.
+int main(int argc, char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: native_likelihood_engine <NEWICK-TREEFILE> <FASTA-DATAFILE> [NATIVE-SETTINGS]" << std::endl;
+        exit(1);
+    }
+    std::string native_settings = argc >= 4 ? argv[3] : "";
+    treeshrew::SubstitutionModel hky("HKY85");
+    hky.set_kappa(4.0);
+    hky.set_state_frequencies({0.3, 0.2, 0.22, 0.28});
+    treeshrew::SiteRateModel site_rate_model(4, true, 0.5, 0.2);
+    std::vector<treeshrew::StateSpace *> state_spaces;
+    for (auto native_engine : {false, true}) {
+        std::ifstream tree_src(argv[1]);
+        std::ifstream data_src(argv[2]);
+        treeshrew::StateSpace * state_space = new treeshrew::StateSpace(100, 50000);
+        treeshrew::BeagleSettings beagle_settings;
+        if (native_engine) {
+            beagle_settings.parse(native_settings);
+            beagle_settings.set_native_engine();
+            beagle_settings.set_num_threads(4);
+        }
+        state_space->set_beagle_settings(beagle_settings);
+        state_space->set_substitution_model(hky);
+        state_space->set_site_rate_model(site_rate_model);
+        state_space->initialize_with_tree_and_alignment(tree_src, data_src);
+        state_spaces.push_back(state_space);
+    }
+    treeshrew::GeneTree * beagle_tree = state_spaces[0]->get_gene_tree();
+    treeshrew::GeneTree * native_tree = state_spaces[1]->get_gene_tree();
+    native_tree->write_beagle_instance_details(std::cerr);
+    int num_fails = 0;
+
+    double beagle_ln_like = beagle_tree->calc_ln_probability();
+    double native_ln_like = native_tree->calc_ln_probability();
+    std::cout << std::setprecision(12) << native_ln_like << std::endl;
+    if (std::fabs(beagle_ln_like - native_ln_like) > 1e-8) {
+        std::cerr << "Native log-likelihood " << std::setprecision(12) << native_ln_like
+            << " does not match BEAGLE log-likelihood " << beagle_ln_like << std::endl;
+        ++num_fails;
+    }
+
+    // both trees were read from the same source, so postorder visits
+    // corresponding nodes
+    auto beagle_ndi = beagle_tree->postorder_begin();
+    for (auto native_ndi = native_tree->postorder_begin(); native_ndi != native_tree->postorder_end(); ++native_ndi, ++beagle_ndi) {
+        if (native_ndi.node() == native_tree->head_node()) {
+            continue;
+        }
+        double beagle_first_derivative = 0.0;
+        double beagle_second_derivative = 0.0;
+        double beagle_edge_ln_like = beagle_tree->calc_edge_ln_probability_derivatives(beagle_ndi.node(),
+                beagle_first_derivative, beagle_second_derivative);
+        double native_first_derivative = 0.0;
+        double native_second_derivative = 0.0;
+        double native_edge_ln_like = native_tree->calc_edge_ln_probability_derivatives(native_ndi.node(),
+                native_first_derivative, native_second_derivative);
+        if (std::fabs(beagle_edge_ln_like - native_edge_ln_like) > 1e-8
+                || std::fabs(beagle_first_derivative - native_first_derivative) > 1e-6 * std::max(1.0, std::fabs(beagle_first_derivative))
+                || std::fabs(beagle_second_derivative - native_second_derivative) > 1e-6 * std::max(1.0, std::fabs(beagle_second_derivative))) {
+            std::cerr << "Node '" << native_ndi->get_label() << "': native edge log-likelihood and derivatives "
+                << std::setprecision(12) << native_edge_ln_like << ", " << native_first_derivative << ", " << native_second_derivative
+                << " do not match BEAGLE " << beagle_edge_ln_like << ", " << beagle_first_derivative << ", " << beagle_second_derivative
+                << std::endl;
+            ++num_fails;
+        }
+        // only the path from this edge to the root is recalculated
+        double edge_length = native_ndi->get_edge_length() * 1.5 + 0.01;
+        beagle_tree->set_edge_length(beagle_ndi.node(), edge_length);
+        native_tree->set_edge_length(native_ndi.node(), edge_length);
+        beagle_ln_like = beagle_tree->calc_ln_probability();
+        native_ln_like = native_tree->calc_ln_probability();
+        if (std::fabs(beagle_ln_like - native_ln_like) > 1e-8) {
+            std::cerr << "Node '" << native_ndi->get_label() << "': native log-likelihood " << std::setprecision(12) << native_ln_like
+                << " after edge length change does not match BEAGLE log-likelihood " << beagle_ln_like << std::endl;
+            ++num_fails;
+        }
+    }
+
+    for (auto & state_space : state_spaces) {
+        delete state_space;
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}
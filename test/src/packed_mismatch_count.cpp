@@ -0,0 +1,56 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cstdlib>
+#include "../../src/character.hpp"
+
+using namespace treeshrew;
+
+// Counts mismatches between random short reads and every window of random
+// long sequences with ``PackedSequence``, and checks them against
+// ``hamming_distance()``, for lengths on either side of word boundaries and
+// with and without ambiguous states (in either sequence).
+int main() {
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> base_dist(0, 3);
+    std::uniform_int_distribution<int> state_dist(0, 14);
+    std::uniform_int_distribution<int> percent_dist(0, 99);
+    unsigned long num_windows = 0;
+    unsigned long num_fails = 0;
+    for (unsigned long short_size : {1, 5, 31, 32, 33, 63, 64, 65, 100, 127, 128, 129, 150, 250}) {
+        for (int ambiguity_percent : {0, 2, 30}) {
+            for (int ambiguous_read = 0; ambiguous_read < 2; ++ambiguous_read) {
+                auto random_states = [&](unsigned long size, int percent) {
+                    CharacterStateVectorType states(size);
+                    for (auto & state : states) {
+                        state = percent_dist(rng) < percent ? state_dist(rng) : base_dist(rng);
+                    }
+                    return states;
+                };
+                CharacterStateVectorType short_read = random_states(short_size, ambiguous_read ? ambiguity_percent : 0);
+                CharacterStateVectorType long_read = random_states(short_size + 70, ambiguity_percent);
+                // let some windows match the read closely
+                std::copy(short_read.begin(), short_read.end(), long_read.begin() + 35);
+                long_read[35] = (long_read[35] + 1) % 4;
+                PackedSequence packed_short_read(short_read.data(), short_read.size());
+                PackedSequence packed_long_read(long_read.data(), long_read.size());
+                for (unsigned long offset = 0; offset + short_size <= long_read.size(); ++offset) {
+                    unsigned long expected = hamming_distance(short_read.cbegin(), short_read.cend(), long_read.cbegin() + offset);
+                    unsigned long observed = packed_long_read.count_mismatches(packed_short_read, offset);
+                    ++num_windows;
+                    if (observed != expected) {
+                        std::cerr << "Read length " << short_size << ", ambiguity " << ambiguity_percent
+                            << "%, offset " << offset << ": expected " << expected
+                            << " mismatches but counted " << observed << std::endl;
+                        ++num_fails;
+                    }
+                }
+            }
+        }
+    }
+    if (num_fails > 0) {
+        std::cerr << num_windows << " windows, " << num_fails << " failures (kernel: "
+            << PackedSequence::get_kernel_name() << ")" << std::endl;
+        exit(1);
+    }
+}
@@ -0,0 +1,89 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <cmath>
+#include "../src/dataio.hpp"
+#include "../src/character.hpp"
+#include "../src/genetree.hpp"
+
+// Scores each tree in the given files using pooled BEAGLE instances with
+// shared tip data (compact states where there are no ambiguities), and
+// checks the results against scoring with tip partials loaded for the tree
+// alone. All trees should be served by a single pooled
+// instance (with the tip data loaded once), whatever their leaf order, and
+// reusing that instance with tip data uploaded per tip should not inherit
+// the shared data set's pattern weights.
+int main(int argc, char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: pooled_tree_scoring <FASTA-DATAFILE> <NEWICK-TREEFILE> [<NEWICK-TREEFILE> ...]" << std::endl;
+        exit(1);
+    }
+    treeshrew::NucleotideSequences data;
+    treeshrew::sequenceio::read_from_filepath(data, argv[1], "fasta");
+    data.compress_patterns();
+    std::vector<treeshrew::GeneTree *> trees;
+    for (int argi = 2; argi < argc; ++argi) {
+        treeshrew::treeio::read_from_filepath(trees, argv[argi], "newick");
+    }
+    treeshrew::BeagleInstancePool& pool = treeshrew::BeagleInstancePool::get_pool();
+    int num_fails = 0;
+    std::vector<double> pooled_ln_likes;
+    for (auto & tree : trees) {
+        tree->create_beagle_instance(data.get_num_patterns(), data.get_num_compact_sequences());
+        data.set_tip_data(tree);
+        pooled_ln_likes.push_back(tree->calc_ln_probability());
+        tree->free_beagle_instance();
+        std::cout << std::setprecision(12) << pooled_ln_likes.back() << std::endl;
+    }
+    if (pool.get_num_instances_created() != 1) {
+        std::cerr << "Expected one pooled instance, but " << pool.get_num_instances_created() << " were created" << std::endl;
+        ++num_fails;
+    }
+    // the pooled instance now holds the shared data set's pattern weights,
+    // which must not apply to a tree uploading its own tip data without
+    // setting weights (all patterns then have equal weight)
+    treeshrew::GeneTree * reuse_tree = trees[0];
+    std::vector<double> unit_weights(data.get_num_patterns(), 1.0);
+    std::vector<double> unweighted_ln_likes;
+    for (int set_weights = 0; set_weights < 2; ++set_weights) {
+        reuse_tree->create_beagle_instance(data.get_num_patterns(), data.get_num_compact_sequences());
+        if (set_weights) {
+            reuse_tree->set_pattern_weights(unit_weights.data());
+        }
+        for (auto leaf_iter = reuse_tree->leaf_begin(); leaf_iter != reuse_tree->leaf_end(); ++leaf_iter) {
+            reuse_tree->set_tip_partials(*leaf_iter,
+                    data.get_site_patterns().get_partials_data(data.get_sequence(leaf_iter->get_label())));
+        }
+        unweighted_ln_likes.push_back(reuse_tree->calc_ln_probability());
+        reuse_tree->free_beagle_instance();
+    }
+    if (std::fabs(unweighted_ln_likes[0] - unweighted_ln_likes[1]) > 1e-8) {
+        std::cerr << "Tree 1: log-likelihood " << std::setprecision(12) << unweighted_ln_likes[0]
+            << " on an instance reused after shared tip data does not match " << unweighted_ln_likes[1]
+            << " with equal pattern weights" << std::endl;
+        ++num_fails;
+    }
+    for (unsigned long tree_idx = 0; tree_idx < trees.size(); ++tree_idx) {
+        treeshrew::GeneTree * tree = trees[tree_idx];
+        tree->create_beagle_instance(data.get_num_patterns());
+        tree->set_pattern_weights(data.get_site_patterns().pattern_weights_data());
+        for (auto leaf_iter = tree->leaf_begin(); leaf_iter != tree->leaf_end(); ++leaf_iter) {
+            tree->set_tip_partials(*leaf_iter,
+                    data.get_site_patterns().get_partials_data(data.get_sequence(leaf_iter->get_label())));
+        }
+        double ln_like = tree->calc_ln_probability();
+        tree->free_beagle_instance();
+        if (std::fabs(ln_like - pooled_ln_likes[tree_idx]) > 1e-8) {
+            std::cerr << "Tree " << tree_idx + 1 << ": pooled log-likelihood " << std::setprecision(12)
+                << pooled_ln_likes[tree_idx] << " does not match " << ln_like << std::endl;
+            ++num_fails;
+        }
+    }
+    for (auto & tree : trees) {
+        delete tree;
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}
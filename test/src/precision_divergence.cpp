@@ -0,0 +1,72 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include "../src/statespace.hpp"
+
+// Scores a tree with double and with single precision partials (under HKY85
+// with discrete-gamma rates and invariant sites), and reports how far the
+// single precision log-likelihood and pattern log-likelihoods diverge from
+// the double precision ones. ``BEAGLE-SETTINGS`` (e.g., "native" or "sse")
+// is applied to both; fails if the relative divergence of the
+// log-likelihood exceeds the tolerance.
+int main(int argc, char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: precision_divergence <NEWICK-TREEFILE> <FASTA-DATAFILE> [BEAGLE-SETTINGS [TOLERANCE]]" << std::endl;
+        exit(1);
+    }
+    std::string base_settings = argc >= 4 ? argv[3] : "";
+    double tolerance = argc >= 5 ? std::atof(argv[4]) : 1e-5;
+    treeshrew::SubstitutionModel hky("HKY85");
+    hky.set_kappa(4.0);
+    hky.set_state_frequencies({0.3, 0.2, 0.22, 0.28});
+    treeshrew::SiteRateModel site_rate_model(4, true, 0.5, 0.2);
+    std::vector<treeshrew::StateSpace *> state_spaces;
+    for (auto precision : {"double!", "single!"}) {
+        std::ifstream tree_src(argv[1]);
+        std::ifstream data_src(argv[2]);
+        treeshrew::StateSpace * state_space = new treeshrew::StateSpace(100, 50000);
+        treeshrew::BeagleSettings beagle_settings;
+        beagle_settings.parse(base_settings + "," + precision);
+        state_space->set_beagle_settings(beagle_settings);
+        state_space->set_substitution_model(hky);
+        state_space->set_site_rate_model(site_rate_model);
+        state_space->initialize_with_tree_and_alignment(tree_src, data_src);
+        state_space->get_gene_tree()->set_store_site_ln_probabilities(true);
+        state_spaces.push_back(state_space);
+    }
+    treeshrew::GeneTree * double_tree = state_spaces[0]->get_gene_tree();
+    treeshrew::GeneTree * single_tree = state_spaces[1]->get_gene_tree();
+    single_tree->write_beagle_instance_details(std::cerr);
+    double double_ln_like = double_tree->calc_ln_probability();
+    double single_ln_like = single_tree->calc_ln_probability();
+    const std::vector<double>& double_site_ln_likes = double_tree->calc_site_ln_probabilities();
+    const std::vector<double>& single_site_ln_likes = single_tree->calc_site_ln_probabilities();
+    double max_site_divergence = 0.0;
+    for (unsigned long pattern_idx = 0; pattern_idx < double_site_ln_likes.size(); ++pattern_idx) {
+        max_site_divergence = std::max(max_site_divergence,
+                std::fabs(double_site_ln_likes[pattern_idx] - single_site_ln_likes[pattern_idx]));
+    }
+    double divergence = std::fabs(double_ln_like - single_ln_like);
+    double relative_divergence = divergence / std::fabs(double_ln_like);
+    std::cout << std::setprecision(12)
+        << "double: " << double_ln_like << std::endl
+        << "single: " << single_ln_like << std::endl
+        << std::setprecision(4)
+        << "divergence: " << divergence << std::endl
+        << "relative divergence: " << relative_divergence << std::endl
+        << "maximum pattern divergence: " << max_site_divergence << std::endl;
+    for (auto & state_space : state_spaces) {
+        delete state_space;
+    }
+    if (!std::isfinite(single_ln_like) || relative_divergence > tolerance) {
+        std::cerr << "Single precision log-likelihood " << std::setprecision(12) << single_ln_like
+            << " diverges from double precision log-likelihood " << double_ln_like
+            << " by more than " << tolerance << " (relative)" << std::endl;
+        exit(1);
+    }
+}
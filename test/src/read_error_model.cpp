@@ -0,0 +1,85 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <gsl/gsl_randist.h>
+#include "../../src/model.hpp"
+
+using namespace treeshrew;
+
+// Checks the error probability tables of ``ReadErrorModel`` (and their
+// logarithms and tail maxima) against the GSL binomial and Poisson
+// densities, for a range of read lengths and error rates, and checks that
+// tables are calculated only once per read length and error rate, whether
+// looked up again, by a copy, or after changing the error rate and changing
+// it back.
+int main() {
+    unsigned long num_fails = 0;
+    for (auto distribution : {"binomial", "poisson"}) {
+        for (double error_rate : {0.0, 0.0107, 0.1, 0.5}) {
+            ReadErrorModel error_model(error_rate, distribution);
+            for (unsigned long read_length : {1, 2, 36, 100, 250, 1000}) {
+                const std::vector<double>& probs = error_model.get_probabilities(read_length);
+                const std::vector<double>& ln_probs = error_model.get_ln_probabilities(read_length);
+                if (probs.size() != read_length + 1 || ln_probs.size() != read_length + 1) {
+                    std::cerr << distribution << " error rate " << error_rate << ", read length " << read_length
+                        << ": tables have " << probs.size() << " and " << ln_probs.size() << " entries" << std::endl;
+                    ++num_fails;
+                    continue;
+                }
+                const std::vector<double>& max_probs = error_model.get_max_probabilities(read_length);
+                for (unsigned long k = 0; k <= read_length; ++k) {
+                    double expected_max = *std::max_element(probs.begin() + k, probs.end());
+                    if (max_probs[k] != expected_max) {
+                        std::cerr << distribution << " error rate " << error_rate << ", read length " << read_length
+                            << ": largest probability of " << k << " or more errors is " << expected_max
+                            << " but tabulated " << max_probs[k] << std::endl;
+                        ++num_fails;
+                    }
+                    double expected = std::string(distribution) == "binomial"
+                        ? gsl_ran_binomial_pdf(k, error_rate, read_length)
+                        : gsl_ran_poisson_pdf(k, error_rate * read_length);
+                    bool is_ln_prob_consistent = expected > 1e-300
+                        ? std::fabs(ln_probs[k] - std::log(expected)) <= 1e-9 * std::max(1.0, std::fabs(std::log(expected)))
+                        : ln_probs[k] < -690.0;
+                    if (probs[k] != expected || !is_ln_prob_consistent) {
+                        std::cerr << distribution << " error rate " << error_rate << ", read length " << read_length
+                            << ", " << k << " errors: expected " << std::setprecision(12) << expected
+                            << " but tabulated " << probs[k] << " (log " << ln_probs[k] << ")" << std::endl;
+                        ++num_fails;
+                    }
+                }
+            }
+        }
+    }
+
+    ReadErrorModel error_model(0.0107);
+    error_model.get_probabilities(100);
+    error_model.get_ln_probabilities(100);
+    ReadErrorModel copied_error_model(error_model);
+    copied_error_model.get_probabilities(100);
+    unsigned long version = error_model.get_version();
+    error_model.set_error_rate(0.02);
+    double changed_prob = error_model.get_probabilities(100)[1];
+    if (error_model.get_version() == version || changed_prob != gsl_ran_binomial_pdf(1, 0.02, 100)) {
+        std::cerr << "Changing the error rate did not change the tables" << std::endl;
+        ++num_fails;
+    }
+    error_model.set_error_rate(0.0107);
+    error_model.get_probabilities(100);
+    if (copied_error_model.get_probabilities(100)[1] != gsl_ran_binomial_pdf(1, 0.0107, 100)) {
+        std::cerr << "Changing the error rate of a model changed the tables of its copy" << std::endl;
+        ++num_fails;
+    }
+    if (error_model.get_num_tabulations() != 2) {
+        std::cerr << "Expected 2 tables to be calculated but " << error_model.get_num_tabulations()
+            << " were" << std::endl;
+        ++num_fails;
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}
@@ -0,0 +1,84 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include "../src/dataio.hpp"
+#include "../src/character.hpp"
+#include "../src/batchscoring.hpp"
+#include "../src/rell.hpp"
+
+// Scores the candidate trees in a tree file, keeping per-pattern
+// log-likelihoods, and writes the RELL bootstrap proportion of each tree
+// (one per line, in the order of the trees in the file). Checks that the
+// weighted pattern log-likelihoods add up to the tree log-likelihoods, that
+// the proportions sum to one, and that replicates are reproducible from
+// the seed.
+int main(int argc, char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: rell_bootstrap <TREEFILE> <FASTA-DATAFILE> [TREE-FORMAT [NUM-REPLICATES [SEED]]]" << std::endl;
+        exit(1);
+    }
+    std::string tree_format = argc >= 4 ? argv[3] : "nexus";
+    unsigned long num_replicates = argc >= 5 ? std::atol(argv[4]) : 1000;
+    unsigned long seed = argc >= 6 ? std::atol(argv[5]) : 1;
+    treeshrew::NucleotideSequences data;
+    treeshrew::sequenceio::read_from_filepath(data, argv[2], "fasta");
+    data.compress_patterns();
+    std::vector<treeshrew::GeneTree *> trees;
+    treeshrew::treeio::read_from_filepath(trees, argv[1], tree_format);
+    treeshrew::BatchTreeScorer scorer(data);
+    std::vector<double> ln_likes = scorer.calc_ln_probabilities(trees);
+    std::vector<std::vector<double>> site_ln_likes = scorer.calc_site_ln_probabilities(trees);
+    const treeshrew::SitePatterns& site_patterns = data.get_site_patterns();
+    int num_fails = 0;
+
+    treeshrew::RellBootstrap rell(site_patterns.get_pattern_counts(), seed);
+    for (unsigned long tree_idx = 0; tree_idx < trees.size(); ++tree_idx) {
+        double ln_like = 0.0;
+        for (unsigned long pattern_idx = 0; pattern_idx < site_patterns.get_num_patterns(); ++pattern_idx) {
+            ln_like += site_patterns.get_pattern_counts()[pattern_idx] * site_ln_likes[tree_idx][pattern_idx];
+        }
+        if (std::fabs(ln_like - ln_likes[tree_idx]) > 1e-8) {
+            std::cerr << "Tree " << tree_idx + 1 << ": summed pattern log-likelihoods " << std::setprecision(12)
+                << ln_like << " do not match log-likelihood " << ln_likes[tree_idx] << std::endl;
+            ++num_fails;
+        }
+        rell.add_tree(site_ln_likes[tree_idx]);
+    }
+    rell.run(num_replicates);
+    std::vector<double> proportions = rell.get_bootstrap_proportions();
+    double total_proportion = 0.0;
+    for (auto proportion : proportions) {
+        std::cout << std::setprecision(12) << proportion << std::endl;
+        total_proportion += proportion;
+    }
+    if (std::fabs(total_proportion - 1.0) > 1e-8) {
+        std::cerr << "Bootstrap proportions sum to " << std::setprecision(12) << total_proportion << std::endl;
+        ++num_fails;
+    }
+
+    treeshrew::RellBootstrap check_rell(site_patterns.get_pattern_counts(), seed);
+    for (auto & tree_site_ln_likes : site_ln_likes) {
+        check_rell.add_tree(tree_site_ln_likes);
+    }
+    check_rell.run(num_replicates);
+    for (unsigned long replicate_idx = 0; replicate_idx < num_replicates; ++replicate_idx) {
+        for (unsigned long tree_idx = 0; tree_idx < trees.size(); ++tree_idx) {
+            if (rell.get_replicate_ln_probability(replicate_idx, tree_idx) != check_rell.get_replicate_ln_probability(replicate_idx, tree_idx)) {
+                std::cerr << "Replicate " << replicate_idx + 1 << ", tree " << tree_idx + 1
+                    << ": log-likelihood differs between runs with the same seed" << std::endl;
+                ++num_fails;
+            }
+        }
+    }
+
+    for (auto & tree : trees) {
+        delete tree;
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}
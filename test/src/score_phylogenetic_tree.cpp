@@ -2,19 +2,31 @@
 #include <iomanip>
 #include <iostream>
 #include <string>
+#include <cstdlib>
 #include "../src/statespace.hpp"
 
 
 int main(int argc, char * argv[]) {
     // treeshrew::GeneTree g(10);
     if (argc < 3) {
-        std::cerr << "Usage: read_tree <NEWICK-TREEFILE> <FASTA-DATAFILE>" << std::endl;
+        std::cerr << "Usage: read_tree <NEWICK-TREEFILE> <FASTA-DATAFILE> [BEAGLE-SETTINGS [NUM-GAMMA-CATEGORIES GAMMA-SHAPE [PROPORTION-INVARIANT]]]" << std::endl;
         exit(1);
     }
     std::ifstream tree_src(argv[1]);
     std::ifstream data_src(argv[2]);
     treeshrew::StateSpace state_space(100, 50000);
+    if (argc >= 4) {
+        treeshrew::BeagleSettings beagle_settings;
+        beagle_settings.parse(argv[3]);
+        state_space.set_beagle_settings(beagle_settings);
+    }
+    if (argc >= 6) {
+        double prop_invar = argc >= 7 ? std::atof(argv[6]) : 0.0;
+        treeshrew::SiteRateModel site_rate_model(std::atoi(argv[4]), prop_invar > 0.0, std::atof(argv[5]), prop_invar);
+        state_space.set_site_rate_model(site_rate_model);
+    }
     state_space.initialize_with_tree_and_alignment(tree_src, data_src);
     state_space.write_phylogenetic_data(std::cerr);
+    state_space.get_gene_tree()->write_beagle_instance_details(std::cerr);
     std::cout << std::setprecision(12) << state_space.get_gene_tree()->calc_ln_probability() << std::endl;
 }
@@ -0,0 +1,39 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include "../src/dataio.hpp"
+#include "../src/character.hpp"
+#include "../src/batchscoring.hpp"
+
+// Scores every tree in a tree file against an alignment, using a pool of
+// worker threads (each scoring ``TREES-PER-INSTANCE`` trees at a time in a
+// single BEAGLE instance), and writes the log-likelihoods (one per line) in
+// the order of the trees in the file.
+int main(int argc, char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: score_trees <TREEFILE> <FASTA-DATAFILE> [TREE-FORMAT [NUM-THREADS [BEAGLE-SETTINGS [TREES-PER-INSTANCE]]]]" << std::endl;
+        exit(1);
+    }
+    std::ifstream tree_src(argv[1]);
+    if (!tree_src.good()) {
+        treeshrew::treeshrew_abort("Error opening file for input");
+    }
+    std::string tree_format = argc >= 4 ? argv[3] : "nexus";
+    unsigned int num_threads = argc >= 5 ? std::atoi(argv[4]) : 0;
+    treeshrew::NucleotideSequences data;
+    treeshrew::sequenceio::read_from_filepath(data, argv[2], "fasta");
+    data.compress_patterns();
+    treeshrew::BatchTreeScorer scorer(data, num_threads);
+    if (argc >= 6) {
+        treeshrew::BeagleSettings beagle_settings;
+        beagle_settings.parse(argv[5]);
+        scorer.set_beagle_settings(beagle_settings);
+    }
+    if (argc >= 7) {
+        scorer.set_num_trees_per_instance(std::atoi(argv[6]));
+    }
+    scorer.score_trees(tree_src, std::cout, tree_format);
+    std::cerr << scorer.get_num_threads() << " threads, "
+        << treeshrew::BeagleInstancePool::get_pool().get_num_instances_created() << " BEAGLE instances" << std::endl;
+}
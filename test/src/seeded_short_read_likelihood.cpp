@@ -0,0 +1,68 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include "../src/statespace.hpp"
+
+// Scores short reads against every window of the leaf sequences of a tree,
+// then against only the windows sharing seeds of various lengths with them,
+// and checks that the seeded log-probability of the reads, and of each
+// read, is no greater than the exhaustive one, and falls short of it by no
+// more than the reported error bound.
+int main(int argc, char * argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: seeded_short_read_likelihood <SHORT-READ-DATAFILE> <ALIGNMENT-DATAFILE> <TREE-FILE>" << std::endl;
+        exit(1);
+    }
+    std::ifstream short_read_src(argv[1]);
+    std::ifstream data_src(argv[2]);
+    std::ifstream tree_src(argv[3]);
+    treeshrew::BeagleSettings beagle_settings;
+    beagle_settings.set_native_engine();
+    treeshrew::StateSpace state_space(100, 50000);
+    state_space.set_beagle_settings(beagle_settings);
+    state_space.load_short_reads(short_read_src);
+    state_space.initialize_with_tree_and_alignment(tree_src, data_src);
+    double check_ln_prob = state_space.calc_ln_probability_of_short_reads();
+    std::vector<double> check_read_ln_probs = state_space.get_read_ln_probabilities();
+    if (state_space.get_short_read_ln_probability_error_bound() != 0.0
+            || state_space.get_num_short_read_windows_scored() != state_space.get_num_short_read_windows()) {
+        std::cerr << "Exhaustive scoring skipped windows" << std::endl;
+        exit(1);
+    }
+    std::cout << "exhaustive: " << std::setprecision(12) << check_ln_prob << std::endl;
+    int num_fails = 0;
+    for (unsigned int seed_length : {8, 11, 16}) {
+        state_space.set_short_read_seed_length(seed_length);
+        double ln_prob = state_space.calc_ln_probability_of_short_reads();
+        double error_bound = state_space.get_short_read_ln_probability_error_bound();
+        const std::vector<double>& read_ln_probs = state_space.get_read_ln_probabilities();
+        const std::vector<double>& read_error_bounds = state_space.get_read_ln_probability_error_bounds();
+        std::cout << "seed length " << seed_length << ": " << std::setprecision(12) << ln_prob
+            << ", error bound " << std::setprecision(4) << error_bound
+            << ", " << state_space.get_num_short_read_windows_scored() << " of "
+            << state_space.get_num_short_read_windows() << " windows scored" << std::endl;
+        double tolerance = 1e-9 * std::fabs(check_ln_prob);
+        if (ln_prob > check_ln_prob + tolerance || ln_prob + error_bound < check_ln_prob - tolerance) {
+            std::cerr << "Seed length " << seed_length << ": log-probability " << std::setprecision(12) << ln_prob
+                << " (error bound " << error_bound << ") is inconsistent with exhaustive " << check_ln_prob << std::endl;
+            ++num_fails;
+        }
+        for (unsigned long read_idx = 0; read_idx < read_ln_probs.size(); ++read_idx) {
+            double read_tolerance = 1e-9 * std::fabs(check_read_ln_probs[read_idx]) + 1e-12;
+            if (read_ln_probs[read_idx] > check_read_ln_probs[read_idx] + read_tolerance
+                    || read_ln_probs[read_idx] + read_error_bounds[read_idx] < check_read_ln_probs[read_idx] - read_tolerance) {
+                std::cerr << "Seed length " << seed_length << ", read " << read_idx << ": log-probability "
+                    << std::setprecision(12) << read_ln_probs[read_idx] << " (error bound " << read_error_bounds[read_idx]
+                    << ") is inconsistent with exhaustive " << check_read_ln_probs[read_idx] << std::endl;
+                ++num_fails;
+            }
+        }
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}
@@ -0,0 +1,74 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <cmath>
+#include "../src/statespace.hpp"
+
+// Checks that the K80, HKY85 and GTR models reduce to JC69 under equivalent
+// parameters, and that rejecting a substitution model proposal restores the
+// stored likelihood without recomputing the eigen-decomposition.
+int main(int argc, char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: substitution_models <NEWICK-TREEFILE> <FASTA-DATAFILE>" << std::endl;
+        exit(1);
+    }
+    std::ifstream tree_src(argv[1]);
+    std::ifstream data_src(argv[2]);
+    treeshrew::StateSpace state_space(100, 50000);
+    state_space.initialize_with_tree_and_alignment(tree_src, data_src);
+    treeshrew::GeneTree * tree = state_space.get_gene_tree();
+    double jc_ln_like = tree->calc_ln_probability();
+    std::cout << std::setprecision(12) << jc_ln_like << std::endl;
+    int num_fails = 0;
+
+    const std::vector<double> equal_freqs {0.25, 0.25, 0.25, 0.25};
+    const std::vector<double> equal_rates {1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+    treeshrew::SubstitutionModel k80("K80");
+    k80.set_kappa(1.0);
+    treeshrew::SubstitutionModel hky("HKY85");
+    hky.set_kappa(1.0);
+    hky.set_state_frequencies(equal_freqs);
+    treeshrew::SubstitutionModel gtr("GTR");
+    gtr.set_exchangeabilities(equal_rates);
+    gtr.set_state_frequencies(equal_freqs);
+    for (auto & model : {k80, hky, gtr}) {
+        tree->set_substitution_model(model);
+        double ln_like = tree->calc_ln_probability();
+        if (std::fabs(ln_like - jc_ln_like) > 1e-6) {
+            std::cerr << model.get_name() << " log-likelihood " << std::setprecision(12) << ln_like
+                << " does not match JC69 " << jc_ln_like << std::endl;
+            ++num_fails;
+        }
+    }
+
+    gtr.set_exchangeabilities({1.2, 4.5, 0.8, 1.1, 5.2, 1.0});
+    gtr.set_state_frequencies({0.3, 0.2, 0.22, 0.28});
+    tree->set_substitution_model(gtr);
+    double stored_ln_like = tree->calc_ln_probability();
+    treeshrew::SubstitutionModel& model = tree->get_substitution_model();
+    tree->begin_proposal();
+    model.set_exchangeabilities({1.0, 3.0, 1.0, 1.0, 3.0, 1.0});
+    double proposed_ln_like = tree->calc_ln_probability();
+    unsigned long num_decompositions = model.get_num_decompositions();
+    tree->reject_proposal();
+    tree->flag_all_as_dirty();
+    double rejected_ln_like = tree->calc_ln_probability();
+    if (proposed_ln_like == stored_ln_like || std::fabs(rejected_ln_like - stored_ln_like) > 1e-8) {
+        std::cerr << "Rejected substitution model proposal log-likelihood " << std::setprecision(12) << rejected_ln_like
+            << " does not match stored " << stored_ln_like << std::endl;
+        ++num_fails;
+    }
+    tree->begin_proposal();
+    model.set_exchangeabilities({1.0, 3.0, 1.0, 1.0, 3.0, 1.0});
+    double reproposed_ln_like = tree->calc_ln_probability();
+    tree->accept_proposal();
+    if (std::fabs(reproposed_ln_like - proposed_ln_like) > 1e-8
+            || model.get_num_decompositions() != num_decompositions) {
+        std::cerr << "Repeated substitution model proposal was not served from the cache" << std::endl;
+        ++num_fails;
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}
@@ -0,0 +1,48 @@
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include "../src/statespace.hpp"
+
+// Scores short reads against the leaf sequences of a tree with different
+// numbers of read threads and read chunk sizes, and checks that the
+// log-probability of the reads, and of each read, is bit-identical to that
+// scored on the calling thread.
+int main(int argc, char * argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: threaded_short_read_likelihood <SHORT-READ-DATAFILE> <ALIGNMENT-DATAFILE> <TREE-FILE>" << std::endl;
+        exit(1);
+    }
+    std::ifstream short_read_src(argv[1]);
+    std::ifstream data_src(argv[2]);
+    std::ifstream tree_src(argv[3]);
+    treeshrew::BeagleSettings beagle_settings;
+    beagle_settings.set_native_engine();
+    treeshrew::StateSpace state_space(100, 50000);
+    state_space.set_beagle_settings(beagle_settings);
+    state_space.load_short_reads(short_read_src);
+    state_space.initialize_with_tree_and_alignment(tree_src, data_src);
+    double check_ln_prob = state_space.calc_ln_probability_of_short_reads();
+    std::vector<double> check_read_ln_probs = state_space.get_read_ln_probabilities();
+    std::cout << check_read_ln_probs.size() << " reads: " << std::setprecision(12) << check_ln_prob << std::endl;
+    int num_fails = 0;
+    for (unsigned int num_threads : {2, 3, 8}) {
+        for (unsigned long read_chunk_size : {1, 7, 256}) {
+            state_space.set_num_read_threads(num_threads);
+            state_space.set_read_chunk_size(read_chunk_size);
+            state_space.flag_short_read_probabilities_as_dirty();
+            double ln_prob = state_space.calc_ln_probability_of_short_reads();
+            if (ln_prob != check_ln_prob || state_space.get_read_ln_probabilities() != check_read_ln_probs) {
+                std::cerr << num_threads << " threads, chunks of " << read_chunk_size << " reads: log-probability "
+                    << std::setprecision(17) << ln_prob << " is not identical to single-threaded "
+                    << check_ln_prob << std::endl;
+                ++num_fails;
+            }
+        }
+    }
+    if (num_fails > 0) {
+        exit(1);
+    }
+}